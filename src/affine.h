@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_set>
+
+#include "astnodes.h"
+
+// An integer expression as a linear combination of variables plus a
+// constant, used to reason about loop bounds and array indices. Any
+// arithmetic that could overflow makes the expression unknown.
+struct Affine {
+  std::map<std::string, int64_t> terms;
+  int64_t constant = 0;
+
+  Affine(int64_t constant = 0) : constant(constant) {}
+
+  static Affine var(const std::string& name) {
+    Affine result;
+    result.terms[name] = 1;
+    return result;
+  }
+
+  static std::optional<Affine> of(const Expr& expr) {
+    if (auto int_expr = dynamic_cast<const IntExpr*>(&expr)) {
+      return Affine(int_expr->value);
+    }
+    if (auto var_expr = dynamic_cast<const VarExpr*>(&expr)) {
+      return var(var_expr->identifier);
+    }
+    if (auto unop = dynamic_cast<const UnopExpr*>(&expr); unop && unop->op == "-") {
+      if (auto a = of(*unop->expr)) return a->scale(-1);
+      return std::nullopt;
+    }
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    if (!binop || !expr.type || !expr.type->is<Int>()) return std::nullopt;
+    auto l = of(*binop->left);
+    auto r = of(*binop->right);
+    if (!l || !r) return std::nullopt;
+    if (binop->op == "+") return l->add(*r);
+    if (binop->op == "-") return l->add(*r, -1);
+    if (binop->op == "*" && l->terms.empty()) return r->scale(l->constant);
+    if (binop->op == "*" && r->terms.empty()) return l->scale(r->constant);
+    return std::nullopt;
+  }
+
+  bool is_constant() const { return terms.empty(); }
+
+  int64_t coefficient(const std::string& name) const {
+    auto it = terms.find(name);
+    return it == terms.end() ? 0 : it->second;
+  }
+
+  // this + factor * other
+  std::optional<Affine> add(const Affine& other, int64_t factor = 1) const {
+    auto scaled = other.scale(factor);
+    if (!scaled) return std::nullopt;
+    Affine result = *this;
+    if (__builtin_add_overflow(result.constant, scaled->constant, &result.constant)) return std::nullopt;
+    for (const auto& [name, coefficient] : scaled->terms) {
+      auto& term = result.terms[name];
+      if (__builtin_add_overflow(term, coefficient, &term)) return std::nullopt;
+      if (term == 0) result.terms.erase(name);
+    }
+    return result;
+  }
+
+  std::optional<Affine> scale(int64_t factor) const {
+    Affine result;
+    if (factor == 0) return result;
+    if (__builtin_mul_overflow(constant, factor, &result.constant)) return std::nullopt;
+    for (const auto& [name, coefficient] : terms) {
+      if (__builtin_mul_overflow(coefficient, factor, &result.terms[name])) return std::nullopt;
+    }
+    return result;
+  }
+
+  // replaces a variable by an expression
+  std::optional<Affine> substitute(const std::string& name, const Affine& value) const {
+    auto coefficient = this->coefficient(name);
+    if (coefficient == 0) return *this;
+    Affine rest = *this;
+    rest.terms.erase(name);
+    return rest.add(value, coefficient);
+  }
+
+  // builds the expression back, for code that evaluates a derived bound
+  std::unique_ptr<Expr> to_expr() const {
+    std::unique_ptr<Expr> result;
+    auto add = [&](std::unique_ptr<Expr> term) {
+      term->type = Int::shared;
+      if (!result) {
+        result = std::move(term);
+        return;
+      }
+      result = std::make_unique<BinopExpr>(std::move(result), "+", std::move(term));
+      result->type = Int::shared;
+    };
+    for (const auto& [name, coefficient] : terms) {
+      auto var = std::make_unique<VarExpr>(name);
+      var->type = Int::shared;
+      if (coefficient == 1) {
+        add(std::move(var));
+      } else {
+        auto factor = std::make_unique<IntExpr>(coefficient);
+        factor->type = Int::shared;
+        add(std::make_unique<BinopExpr>(std::move(factor), "*", std::move(var)));
+      }
+    }
+    if (constant != 0 || !result) {
+      add(std::make_unique<IntExpr>(constant));
+    }
+    return result;
+  }
+
+  bool operator==(const Affine& other) const {
+    return constant == other.constant && terms == other.terms;
+  }
+};
+
+// Ranges of affine expressions over loop variables (each in [0, bound - 1],
+// or from a larger lower bound where a condition says so) and symbols that
+// are known to be at least one, like array dimensions.
+class AffineRanges {
+ public:
+  std::map<std::string, Affine> loops;
+  std::map<std::string, Affine> lower;
+  std::unordered_set<std::string> positive;
+
+  // the smallest (or largest) value over all loop iterations, in terms of symbols
+  std::optional<Affine> extreme(Affine a, bool largest) const {
+    // loop bounds only refer to enclosing loops, so this terminates
+    for (size_t round = 0; round <= loops.size(); round++) {
+      bool changed = false;
+      for (const auto& [name, bound] : loops) {
+        auto coefficient = a.coefficient(name);
+        if (coefficient == 0) continue;
+        changed = true;
+        if ((coefficient > 0) == largest) {
+          auto last = bound.add(Affine(-1));
+          if (!last) return std::nullopt;
+          auto next = a.substitute(name, *last);
+          if (!next) return std::nullopt;
+          a = *next;
+        } else if (auto least = lower.find(name); least != lower.end()) {
+          auto next = a.substitute(name, least->second);
+          if (!next) return std::nullopt;
+          a = *next;
+        } else {
+          a.terms.erase(name);
+        }
+      }
+      if (!changed) return a;
+    }
+    return std::nullopt;
+  }
+
+  // whether the expression is at least zero for every value of its symbols
+  bool nonnegative(const Affine& a) const {
+    auto least = a.constant;
+    for (const auto& [name, coefficient] : a.terms) {
+      if (coefficient < 0 || !positive.count(name)) return false;
+      if (__builtin_add_overflow(least, coefficient, &least)) return false;
+    }
+    return least >= 0;
+  }
+
+  // whether an index always lies in [0, bound)
+  bool in_range(const Affine& index, const Affine& bound) const {
+    auto least = extreme(index, false);
+    auto most = extreme(index, true);
+    if (!least || !most) return false;
+    auto slack = bound.add(*most, -1);
+    if (!slack || !(slack = slack->add(Affine(-1)))) return false;
+    return nonnegative(*least) && nonnegative(*slack);
+  }
+
+  // whether a loop bound is always positive
+  bool positive_bound(const Affine& bound) const {
+    auto least = extreme(bound, false);
+    if (!least) return false;
+    auto slack = least->add(Affine(-1));
+    return slack && nonnegative(*slack);
+  }
+};
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "affine.h"
+#include "astnodes.h"
+#include "clonevisitor.h"
+#include "context.h"
+#include "rewritevisitor.h"
+
+// Producer-consumer fusion: an array bound by `let a = array[...] body` that
+// is only ever read through full indexes a[e, ...] is never built; every read
+// computes body at that point instead. This only happens when each index is
+// provably in bounds, the loop bounds provably positive and the body cannot
+// fail for any element, so no check is lost, and when recomputing the
+// element at each read is estimated to be cheaper than storing and loading
+// it.
+class ArrayFusionVisitor : public RewriteVisitor {
+ public:
+  ArrayFusionVisitor(std::shared_ptr<Context> ctx) : ctx(ctx) {}
+
+  virtual void visit(const Program& program) override {
+    shapes.clear();
+    fuse(edit(program.cmds), {});
+    for (const auto& cmd : program.cmds) {
+      if (dynamic_cast<const FnCmd*>(cmd.get())) {
+        cmd->accept(*this);
+      }
+    }
+  }
+
+  virtual void visit(const FnCmd& fn) override {
+    std::unordered_set<std::string> dims;
+    shapes.clear();
+    for (const auto& param : fn.params) {
+      add_dims(*param->lvalue, dims);
+    }
+    fuse(edit(fn.stmts), dims);
+  }
+
+ private:
+  // relative cost of storing or loading one word of an array element
+  static constexpr int memory_cost = 6;
+  // trip count assumed for loops with unknown bounds
+  static constexpr int unknown_trips = 16;
+
+  struct Use {
+    const std::unique_ptr<Expr>* slot;
+    int reads;
+  };
+
+  std::shared_ptr<Context> ctx;
+  int ctr = 0;
+  // dimensions of the arrays in scope where they are known
+  std::unordered_map<std::string, std::vector<Affine>> shapes;
+
+  template <typename T>
+  void fuse(std::vector<std::unique_ptr<T>>& list, std::unordered_set<std::string> dims) {
+    for (size_t p = 0; p < list.size(); p++) {
+      if (auto read = dynamic_cast<const ReadCmd*>(list[p].get())) {
+        add_dims(*read->lvalue, dims);
+      }
+      const std::unique_ptr<Expr>* expr = nullptr;
+      const LValue* lvalue = nullptr;
+      if (auto let = dynamic_cast<const LetCmd*>(list[p].get())) {
+        expr = &let->expr, lvalue = let->lvalue.get();
+      } else if (auto let = dynamic_cast<const LetStmt*>(list[p].get())) {
+        expr = &let->expr, lvalue = let->lvalue.get();
+      } else {
+        continue;
+      }
+      auto producer = dynamic_cast<const ArrayLoopExpr*>(expr->get());
+      if (producer && dynamic_cast<const VarLValue*>(lvalue) && fusable(list, p, *producer, lvalue->identifier, dims)) {
+        add_dims(*lvalue, dims);
+        list.erase(list.begin() + p);
+        p--;
+        continue;
+      }
+      add_dims(*lvalue, dims, expr->get());
+    }
+  }
+
+  template <typename T>
+  bool fusable(std::vector<std::unique_ptr<T>>& list, size_t p, const ArrayLoopExpr& producer, const std::string& name,
+               const std::unordered_set<std::string>& dims) {
+    AffineRanges ranges;
+    ranges.positive = dims;
+    std::vector<Affine> bounds;
+    for (const auto& [variable, bound] : producer.axis) {
+      auto affine = Affine::of(*bound);
+      if (!affine || !ranges.positive_bound(*affine)) return false;
+      bounds.push_back(*affine);
+    }
+
+    // every element is computed when the array is built, but only the
+    // elements read are computed once it is fused
+    AffineRanges inside = ranges;
+    for (size_t i = 0; i < bounds.size(); i++) {
+      inside.loops[producer.axis[i].first] = bounds[i];
+    }
+    if (!safe(*producer.expr, inside, shapes)) return false;
+
+    std::unordered_set<std::string> free;
+    names(*producer.expr, free);
+    for (const auto& [variable, bound] : producer.axis) {
+      free.erase(variable);
+    }
+
+    // find every read, with the scope it happens in
+    std::vector<Use> uses;
+    std::unordered_set<std::string> rebound;
+    for (size_t i = p + 1; i < list.size(); i++) {
+      if (dynamic_cast<const FnCmd*>(list[i].get())) {
+        if (mentions(*list[i], name)) return false;
+        continue;
+      }
+      for (auto root : roots(*list[i])) {
+        Scope scope{ranges, rebound};
+        if (!find_uses(*root, name, free, scope, bounds, 1, false, uses)) return false;
+      }
+      if (auto binds = binds_of(*list[i])) {
+        for (const auto& bind : *binds) {
+          rebound.insert(bind);
+          ranges.positive.erase(bind);
+          if (bind == name) i = list.size();
+        }
+      }
+    }
+    if (uses.empty()) return false;
+
+    // recompute versus store, per element of the producer
+    auto cost = cost_of(*producer.expr);
+    auto words = producer.expr->type->size(ctx.get()) / 8;
+    int reads = 0;
+    for (const auto& use : uses) {
+      reads += use.reads;
+    }
+    if (reads > 1 && reads * cost > cost + (reads + 1) * words * memory_cost) return false;
+
+    for (const auto& use : uses) {
+      inline_read(*use.slot, producer);
+    }
+    return true;
+  }
+
+  struct Scope {
+    AffineRanges ranges;
+    std::unordered_set<std::string> rebound;
+  };
+
+  // collects reads of the array; false if it is used any other way or a read
+  // cannot be shown to be in bounds
+  bool find_uses(const std::unique_ptr<Expr>& expr, const std::string& name, const std::unordered_set<std::string>& free,
+                 Scope scope, const std::vector<Affine>& bounds, int reads, bool traversed, std::vector<Use>& uses) {
+    if (auto var = dynamic_cast<const VarExpr*>(expr.get())) {
+      return var->identifier != name;
+    }
+    if (auto index = dynamic_cast<const ArrayIndexExpr*>(expr.get())) {
+      auto var = dynamic_cast<const VarExpr*>(index->expr.get());
+      if (var && var->identifier == name) {
+        for (const auto& rebound : scope.rebound) {
+          if (free.count(rebound)) return false;
+        }
+        for (size_t i = 0; i < index->indices.size(); i++) {
+          auto affine = Affine::of(*index->indices[i]);
+          if (!affine || !scope.ranges.in_range(*affine, bounds[i])) return false;
+          if (!find_uses(index->indices[i], name, free, scope, bounds, reads, traversed, uses)) return false;
+        }
+        uses.push_back({&expr, reads});
+        return true;
+      }
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(expr.get())) {
+      if (!find_uses(let->value, name, free, scope, bounds, reads, traversed, uses)) return false;
+      if (let->identifier == name) return true;
+      bind(scope, let->identifier);
+      return find_uses(let->body, name, free, scope, bounds, reads, traversed, uses);
+    }
+    auto loop = [&](const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis, const std::unique_ptr<Expr>& body) {
+      for (const auto& [variable, bound] : axis) {
+        if (!find_uses(bound, name, free, scope, bounds, reads, traversed, uses)) return false;
+      }
+      auto inner = scope;
+      auto trips = 1;
+      for (const auto& [variable, bound] : axis) {
+        if (variable == name) return true;
+        bind(inner, variable);
+        auto affine = Affine::of(*bound);
+        if (affine) {
+          inner.ranges.loops[variable] = *affine;
+        }
+        trips *= affine && affine->is_constant() ? std::min<int64_t>(affine->constant, 1 << 16) : unknown_trips;
+      }
+      std::unordered_set<std::string> used;
+      names(*body, used);
+      bool walks = false;
+      for (const auto& [variable, bound] : axis) {
+        walks |= used.count(variable) > 0;
+      }
+      // the outermost loop walking through the array reads each element once,
+      // every other enclosing loop reads it again
+      if (!traversed && walks) {
+        return find_uses(body, name, free, inner, bounds, reads, true, uses);
+      }
+      return find_uses(body, name, free, inner, bounds, std::min(reads * trips, 1 << 20), traversed, uses);
+    };
+    if (auto array_loop = dynamic_cast<const ArrayLoopExpr*>(expr.get())) {
+      return loop(array_loop->axis, array_loop->expr);
+    }
+    if (auto sum_loop = dynamic_cast<const SumLoopExpr*>(expr.get())) {
+      return loop(sum_loop->axis, sum_loop->expr);
+    }
+    for (auto child : children(*expr)) {
+      if (!find_uses(*child, name, free, scope, bounds, reads, traversed, uses)) return false;
+    }
+    return true;
+  }
+
+  void bind(Scope& scope, const std::string& variable) {
+    scope.rebound.insert(variable);
+    scope.ranges.positive.erase(variable);
+    // ranges stated in terms of the old binding no longer hold
+    for (auto it = scope.ranges.loops.begin(); it != scope.ranges.loops.end();) {
+      if (it->first == variable || it->second.coefficient(variable)) {
+        it = scope.ranges.loops.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+
+  // a[e0, e1] becomes: let _pc0 = e0 in let _pc1 = e1 in body[i := _pc0, j := _pc1]
+  void inline_read(const std::unique_ptr<Expr>& slot, const ArrayLoopExpr& producer) {
+    auto& index = static_cast<const ArrayIndexExpr&>(*slot);
+    auto body = CloneVisitor::clone(*producer.expr);
+    std::vector<std::string> fresh;
+    for (const auto& [variable, bound] : producer.axis) {
+      fresh.push_back("_pc" + std::to_string(ctr++));
+      rename(body, variable, fresh.back());
+    }
+    auto type = slot->type;
+    for (int i = index.indices.size() - 1; i >= 0; i--) {
+      auto let = std::make_unique<LetExpr>(fresh[i], take(index.indices[i]), std::move(body));
+      let->type = type;
+      body = std::move(let);
+    }
+    edit(slot) = std::move(body);
+  }
+
+  // a rough count of the instructions needed to compute an expression
+  int cost_of(const Expr& expr) {
+    int cost = 1;
+    if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+      cost += builtins.count(call->identifier) ? 10 : 50;
+    } else if (auto binop = dynamic_cast<const BinopExpr*>(&expr); binop && (binop->op == "/" || binop->op == "%")) {
+      cost += 10;
+    }
+    int trips = 1;
+    auto loop_trips = [&](const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis) {
+      for (const auto& [variable, bound] : axis) {
+        auto affine = Affine::of(*bound);
+        trips *= affine && affine->is_constant() ? std::min<int64_t>(affine->constant, 1 << 10) : unknown_trips;
+      }
+    };
+    if (auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr)) loop_trips(loop->axis);
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(&expr)) loop_trips(loop->axis);
+    for (auto child : children(expr)) {
+      cost += cost_of(**child);
+    }
+    return std::min(cost * trips, 1 << 20);
+  }
+
+  // whether evaluating an expression cannot fail, with every index shown
+  // in bounds of an array of known shape
+  static bool safe(const Expr& expr, AffineRanges ranges, std::unordered_map<std::string, std::vector<Affine>> shapes) {
+    if (auto index = dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      auto var = dynamic_cast<const VarExpr*>(index->expr.get());
+      auto shape = var ? shapes.find(var->identifier) : shapes.end();
+      if (shape == shapes.end() || shape->second.size() != index->indices.size()) return false;
+      for (size_t i = 0; i < index->indices.size(); i++) {
+        auto affine = Affine::of(*index->indices[i]);
+        if (!affine || !ranges.in_range(*affine, shape->second[i])) return false;
+        if (!safe(*index->indices[i], ranges, shapes)) return false;
+      }
+      return true;
+    }
+    if (auto call = dynamic_cast<const CallExpr*>(&expr); call && !builtins.count(call->identifier)) return false;
+    if (auto binop = dynamic_cast<const BinopExpr*>(&expr); binop && (binop->op == "/" || binop->op == "%") && binop->type->is<Int>()) {
+      auto divisor = dynamic_cast<const IntExpr*>(binop->right.get());
+      if (!divisor || divisor->value == 0 || divisor->value == -1) return false;
+    }
+    if (dynamic_cast<const ArrayLoopExpr*>(&expr)) return false;
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(&expr)) {
+      for (const auto& [variable, bound] : loop->axis) {
+        auto affine = Affine::of(*bound);
+        if (!affine || !ranges.positive_bound(*affine) || !safe(*bound, ranges, shapes)) return false;
+        forget(variable, ranges, shapes);
+        ranges.loops[variable] = *affine;
+      }
+      return safe(*loop->expr, ranges, shapes);
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      if (!safe(*let->value, ranges, shapes)) return false;
+      forget(let->identifier, ranges, shapes);
+      return safe(*let->body, ranges, shapes);
+    }
+    for (auto child : children(expr)) {
+      if (!safe(**child, ranges, shapes)) return false;
+    }
+    return true;
+  }
+
+  // drops what is known in terms of a name being bound again
+  static void forget(const std::string& name, AffineRanges& ranges, std::unordered_map<std::string, std::vector<Affine>>& shapes) {
+    ranges.positive.erase(name);
+    ranges.lower.erase(name);
+    for (auto it = ranges.loops.begin(); it != ranges.loops.end();) {
+      it = it->first == name || it->second.coefficient(name) ? ranges.loops.erase(it) : std::next(it);
+    }
+    for (auto it = shapes.begin(); it != shapes.end();) {
+      auto mentions = it->first == name;
+      for (const auto& dim : it->second) mentions |= dim.coefficient(name) != 0;
+      it = mentions ? shapes.erase(it) : std::next(it);
+    }
+  }
+
+  void add_dims(const LValue& lvalue, std::unordered_set<std::string>& dims, const Expr* value = nullptr) {
+    AffineRanges unused;
+    forget(lvalue.identifier, unused, shapes);
+    dims.erase(lvalue.identifier);
+    if (auto array_lvalue = dynamic_cast<const ArrayLValue*>(&lvalue)) {
+      for (const auto& dim : array_lvalue->indices) forget(dim, unused, shapes);
+      dims.insert(array_lvalue->indices.begin(), array_lvalue->indices.end());
+      std::vector<Affine> shape;
+      for (const auto& dim : array_lvalue->indices) shape.push_back(Affine::var(dim));
+      shapes[lvalue.identifier] = shape;
+    } else if (auto literal = dynamic_cast<const ArrayLiteralExpr*>(value)) {
+      shapes[lvalue.identifier] = {Affine(literal->elements.size())};
+    } else if (auto loop = dynamic_cast<const ArrayLoopExpr*>(value)) {
+      std::vector<Affine> shape;
+      for (const auto& [_, bound] : loop->axis) {
+        auto affine = Affine::of(*bound);
+        if (!affine || affine->coefficient(lvalue.identifier)) return;
+        shape.push_back(*affine);
+      }
+      shapes[lvalue.identifier] = shape;
+    }
+  }
+
+  static bool mentions(const ASTNode& node, const std::string& name) {
+    for (auto root : roots(node)) {
+      std::unordered_set<std::string> used;
+      names(**root, used);
+      if (used.count(name)) return true;
+    }
+    if (auto fn = dynamic_cast<const FnCmd*>(&node)) {
+      for (const auto& stmt : fn->stmts) {
+        if (mentions(*stmt, name)) return true;
+      }
+    }
+    return false;
+  }
+
+  static std::vector<const std::unique_ptr<Expr>*> roots(const ASTNode& node) {
+    if (auto cmd = dynamic_cast<const LetCmd*>(&node)) return {&cmd->expr};
+    if (auto cmd = dynamic_cast<const ShowCmd*>(&node)) return {&cmd->expr};
+    if (auto cmd = dynamic_cast<const AssertCmd*>(&node)) return {&cmd->expr};
+    if (auto cmd = dynamic_cast<const WriteCmd*>(&node)) return {&cmd->expr};
+    if (auto cmd = dynamic_cast<const TimeCmd*>(&node)) return roots(*cmd->cmd);
+    if (auto stmt = dynamic_cast<const LetStmt*>(&node)) return {&stmt->expr};
+    if (auto stmt = dynamic_cast<const AssertStmt*>(&node)) return {&stmt->expr};
+    if (auto stmt = dynamic_cast<const ReturnStmt*>(&node)) return {&stmt->expr};
+    return {};
+  }
+
+  static std::optional<std::vector<std::string>> binds_of(const ASTNode& node) {
+    const LValue* lvalue = nullptr;
+    if (auto cmd = dynamic_cast<const LetCmd*>(&node)) lvalue = cmd->lvalue.get();
+    if (auto cmd = dynamic_cast<const ReadCmd*>(&node)) lvalue = cmd->lvalue.get();
+    if (auto cmd = dynamic_cast<const TimeCmd*>(&node)) return binds_of(*cmd->cmd);
+    if (auto stmt = dynamic_cast<const LetStmt*>(&node)) lvalue = stmt->lvalue.get();
+    if (!lvalue) return std::nullopt;
+    std::vector<std::string> binds{lvalue->identifier};
+    if (auto array_lvalue = dynamic_cast<const ArrayLValue*>(lvalue)) {
+      binds.insert(binds.end(), array_lvalue->indices.begin(), array_lvalue->indices.end());
+    }
+    return binds;
+  }
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <map>
@@ -48,6 +49,11 @@ class ASMDataVisitor : public ASTVisitor {
     if (expr.op == "||" || expr.op == "&&") {
       expr.left->accept(*this);
       expr.right->accept(*this);
+    } else if (opt > 0 && expr.op == "*" && is_shift(*expr.left)) {
+      // multiplying by a power of two becomes a shift, so the constant is never loaded
+      expr.right->accept(*this);
+    } else if (opt > 0 && expr.op == "*" && is_shift(*expr.right)) {
+      expr.left->accept(*this);
     } else {
       ASTVisitor::visit(expr);
     }
@@ -72,6 +78,7 @@ class ASMDataVisitor : public ASTVisitor {
       expr.axis[i].second->accept(*this);
       add_string("non-positive loop bound");
     }
+    visit_hoisted(expr.hoisted);
     expr.expr->accept(*this);
   }
 
@@ -81,7 +88,9 @@ class ASMDataVisitor : public ASTVisitor {
       add_string("non-positive loop bound");
     }
     add_string("overflow computing array size");
+    visit_hoisted(expr.hoisted);
     expr.expr->accept(*this);
+    if (expr.interior) expr.interior->accept(*this);
   }
 
   virtual void visit(const ShowCmd& cmd) override {
@@ -119,7 +128,10 @@ class ASMDataVisitor : public ASTVisitor {
   void add_float(double val) {
     if (const_map.count(val)) return;
     auto name = "const" + std::to_string(ctr++);
-    std::cout << name + ": dq " << val << "\n";
+    // emit the exact bits so folded values survive the round trip
+    uint64_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    std::cout << name + ": dq 0x" << std::hex << bits << std::dec << " ; " << val << "\n";
     const_map[val] = name;
   }
 
@@ -131,6 +143,19 @@ class ASMDataVisitor : public ASTVisitor {
   }
 
  private:
+  void visit_hoisted(const std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>>& hoisted) {
+    for (const auto& lets : hoisted) {
+      for (const auto& [variable, value] : lets) {
+        value->accept(*this);
+      }
+    }
+  }
+
+  bool is_shift(const Expr& expr) {
+    auto int_expr = dynamic_cast<const IntExpr*>(&expr);
+    return int_expr && int_expr->value > 0 && (int_expr->value & (int_expr->value - 1)) == 0;
+  }
+
   int ctr = 0;
   int opt = 0;
   std::shared_ptr<Context> ctx;
@@ -2,10 +2,14 @@
 
 #include <math.h>
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
+#include <functional>
 #include <map>
 #include <optional>
+#include <sstream>
+#include <set>
 #include <stack>
 #include <variant>
 
@@ -15,7 +19,10 @@
 #include "astvisitor.h"
 #include "context.h"
 #include "logger.h"
+#include "peephole.h"
+#include "regalloc.h"
 #include "resolvedtype.h"
+#include "rewritevisitor.h"
 
 class Stack {
  public:
@@ -146,49 +153,37 @@ class CallingConvention {
   int total_stack = 0;
 
   CallingConvention(const FnInfo& fn, Context* ctx) : fn(fn) {
-    auto int_count = 0, float_count = 0, offset = 0;
+    size_t int_count = 0, float_count = 0;
+    auto offset = 0;
+
+    // return, aggregates are written through a pointer passed in rdi
+    if (fn.return_type->is<Int>() || fn.return_type->is<Bool>()) {
+      ret = "rax";
+      return_position = "rax";
+    } else if (fn.return_type->is<Float>()) {
+      ret = "xmm0";
+      return_position = "xmm0";
+    } else {
+      ret = 0;
+      return_position = StackArg();
+      int_count++;
+    }
 
     // params
     for (const auto& type : fn.param_types) {
-      if (type->is<Int>() || type->is<Bool>()) {
-        if (int_count < all_int_regs.size()) {
-          args.push_back(all_int_regs[int_count]);
-          int_regs.push_back(all_int_regs[int_count++]);
-        } else {
-          args.push_back(offset);
-          stack_args.push_back({offset, type});
-          offset += type->size(ctx);
-          total_stack += type->size(ctx);
-        }
-      } else if (type->is<Float>()) {
-        if (float_count < all_float_regs.size()) {
-          args.push_back(all_float_regs[float_count]);
-          float_regs.push_back(all_float_regs[float_count++]);
-        } else {
-          args.push_back(offset);
-          stack_args.push_back({offset, type});
-          offset += type->size(ctx);
-          total_stack += type->size(ctx);
-        }
-      } else if (type->is<Array>()) {
+      if ((type->is<Int>() || type->is<Bool>()) && int_count < all_int_regs.size()) {
+        args.push_back(all_int_regs[int_count]);
+        int_regs.push_back(all_int_regs[int_count++]);
+      } else if (type->is<Float>() && float_count < all_float_regs.size()) {
+        args.push_back(all_float_regs[float_count]);
+        float_regs.push_back(all_float_regs[float_count++]);
+      } else {
         args.push_back(offset);
         stack_args.push_back({offset, type});
         offset += type->size(ctx);
         total_stack += type->size(ctx);
       }
     }
-
-    // return
-    if (fn.return_type->is<Int>() || fn.return_type->is<Bool>()) {
-      ret = "rax";
-      return_position = "rax";
-    } else if (fn.return_type->is<Float>()) {
-      ret = "xmm0";
-      return_position = "xmm0";
-    } else if (fn.return_type->is<Array>()) {
-      ret = 0;                       // also idk
-      return_position = StackArg();  // idk
-    }
   }
 
  private:
@@ -197,7 +192,7 @@ class CallingConvention {
 
 class ASMGenVisitor : public ASTVisitor {
  public:
-  ASMGenVisitor(std::shared_ptr<Context> ctx, Logger& logger, int opt) : ctx(ctx), stack(ctx.get()), logger(logger), data_visitor(ctx, opt), fn_visitor(*this), opt(opt) {
+  ASMGenVisitor(std::shared_ptr<Context> ctx, Logger& logger, int opt, bool avx2 = false, bool reassociate = false) : ctx(ctx), stack(ctx.get()), logger(logger), data_visitor(ctx, opt), fn_visitor(*this), opt(opt), vector_width(avx2 ? 4 : 2), reassociate(reassociate) {
   }
 
   void align(int size) {
@@ -216,6 +211,18 @@ class ASMGenVisitor : public ASTVisitor {
 
   void push(std::string reg, std::shared_ptr<ResolvedType> type, std::string comment = "") {
     print("; pushing ", type->to_string(), " to stack");
+    if (cacheable(type)) {
+      // the value stays where it is until that register is needed
+      auto slot = cache_slot(xmm(reg));
+      cached.push_back({slot, slot == reg ? "" : reg, comment});
+      stack.push(type);
+      return;
+    }
+    push_memory(reg, type, comment);
+  }
+
+  // pushes to memory right away, as frames are set up
+  void push_memory(std::string reg, std::shared_ptr<ResolvedType> type, std::string comment = "") {
     if (type->is<Float>()) {
       print("sub rsp, 8");
       print("movsd [rsp], ", reg);
@@ -230,6 +237,19 @@ class ASMGenVisitor : public ASTVisitor {
   }
 
   void pop(std::string reg, std::string comment = "") {
+    if (!cached.empty()) {
+      auto top = cached.back();
+      auto from = top.source.empty() ? top.reg : top.source;
+      cached.pop_back();
+      if (holds(reg)) {
+        cached.push_back(top);
+        flush();
+      } else {
+        if (reg != from) move(reg, from);
+        stack.pop();
+        return;
+      }
+    }
     auto type = stack.pop();
     if (type->is<Float>()) {
       print("movsd ", reg, ", [rsp]");
@@ -245,6 +265,18 @@ class ASMGenVisitor : public ASTVisitor {
 
   void push_const(asmval val, std::shared_ptr<ResolvedType> type) {
     print("; pushing const ", type->to_string(), " to stack");
+    if (cacheable(type)) {
+      auto slot = cache_slot(type->is<Float>());
+      auto int_const = std::get_if<int64_t>(&val);
+      if (int_const && *int_const >= INT32_MIN && *int_const <= INT32_MAX) {
+        emit("mov ", slot, ", ", *int_const);
+      } else {
+        emit(xmm(slot) ? "movsd " : "mov ", slot, ", [rel ", const_map[val], "]");
+      }
+      cached.push_back({slot});
+      stack.push(type);
+      return;
+    }
     stack.push(type);
     if (auto int_const = std::get_if<int64_t>(&val)) {
       // if (opt > 0 && (*int_const & (1l << 31) - 1) == *int_const) {
@@ -261,11 +293,26 @@ class ASMGenVisitor : public ASTVisitor {
     print("lea ", reg, ", [rel ", const_map[val], "]");
   }
 
+  // copies from the top down, so the regions may overlap when to lies
+  // above from; at -O1 the bulk moves 16 bytes at a time through xmm1
   void copy(int size, std::string from, std::string to) {
-    for (int i = size - 8; i >= 0; i -= 8) {
+    auto i = size;
+    if (opt == 0 || size % 16) {
+      i -= 8;
       print("mov r10, [", from, " + ", i, "]");
       print("mov [", to, " + ", i, "], r10");
     }
+    while (i > 0) {
+      if (opt > 0) {
+        i -= 16;
+        print("movupd xmm1, [", from, " + ", i, "]");
+        print("movupd [", to, " + ", i, "], xmm1");
+      } else {
+        i -= 8;
+        print("mov r10, [", from, " + ", i, "]");
+        print("mov [", to, " + ", i, "], r10");
+      }
+    }
   }
 
   void asm_alloc(std::shared_ptr<ResolvedType> type) {
@@ -274,6 +321,11 @@ class ASMGenVisitor : public ASTVisitor {
   }
 
   void asm_free(std::shared_ptr<ResolvedType> type) {
+    if (!cached.empty() && cacheable(type)) {
+      cached.pop_back();
+      stack.pop(type);
+      return;
+    }
     print("add rsp, ", type->size(ctx.get()));
     stack.pop(type);
   }
@@ -298,22 +350,33 @@ class ASMGenVisitor : public ASTVisitor {
   }
 
   virtual void visit(const Program& program) override {
+    // at -O1 the code is collected for the peephole pass
+    std::stringstream text;
+    std::optional<Capture> capture;
+    if (opt > 0) capture.emplace(std::cout, text.rdbuf());
     stack.variables["argnum"] = -16;
     stack.variables["args"] = -16;
     std::cout << header;
     data_visitor.visit(program);
     const_map = data_visitor.const_map;
     fn_visitor.visit(program);
+    if (opt > 0) {
+      registers.allocate(program);
+    }
     std::cout << "jpl_main:\n_jpl_main:\n";
     // print("push rbp");
-    push("rbp", Int::shared);
+    push_memory("rbp", Int::shared);
     print("mov rbp, rsp");
     // print("push r12");
-    push("r12", Int::shared);
+    push_memory("r12", Int::shared);
     print("mov r12, rbp");
+    auto saved = save_registers();
+    stack.local_var_size += saved.size() * 8;
+    reserve_frame(program.frame_size);
     // stack.size = 16;
     print("; === END OF PRELUDE ===\n");
     ASTVisitor::visit(program);
+    restore_registers(saved);
     print("; local var size ", stack.local_var_size);
     if (stack.local_var_size) {
       print("add rsp, ", stack.local_var_size, " ; local vars");
@@ -324,6 +387,25 @@ class ASMGenVisitor : public ASTVisitor {
     print("pop r12");
     print("pop rbp");
     print("ret");
+    if (capture) {
+      capture.reset();
+      Peephole peephole(text);
+      auto removed = peephole.optimize();
+      peephole.emit(std::cout);
+      std::cout << "; peephole removed " << removed << " instructions\n";
+    }
+    if (!packed_constants.empty()) {
+      std::cout << "section .data\n";
+      for (const auto& [label, values] : packed_constants) {
+        std::cout << "align 32\n" << label << ": dq ";
+        for (size_t k = 0; k < values.size(); k++) {
+          uint64_t bits;
+          std::memcpy(&bits, &values[k], sizeof(bits));
+          std::cout << (k ? ", " : "") << "0x" << std::hex << bits << std::dec;
+        }
+        std::cout << "\n";
+      }
+    }
   }
 
   virtual void visit(const FnCmd& fn) override {}
@@ -339,15 +421,20 @@ class ASMGenVisitor : public ASTVisitor {
     std::cout << "_" << fn.identifier << ":\n";
 
     // save and udpate rbp
-    push("rbp", Int::shared);
+    push_memory("rbp", Int::shared);
     print("mov rbp, rsp");
+    if (opt > 0) {
+      registers.allocate(fn);
+    }
+    auto saved = save_registers();
+    reserve_frame(fn.frame_size);
     print("; === END OF PRELUDE ===\n");
 
     // if return val goes on stack
     std::cout << "; ret reg " << ret_reg << '\n';
     std::cout << "; doing return val\n";
     if (ret_reg) {
-      push("rdi", Int::shared);
+      push_memory("rdi", Int::shared);
       stack.variables["$return"] = stack.size - 8;
     }
 
@@ -365,16 +452,14 @@ class ASMGenVisitor : public ASTVisitor {
         print("; position ", pos);
       }
       if (auto arg_offset = std::get_if<int>(&position)) {
-        // stack arg
-        // TODO: this doesn't work
-        auto ret_size = fn.return_type->type->size(ctx.get());
-        auto offset = stack.size - *arg_offset + 16 + ret_size;
-        stack.add_lvalue(fn.params[i]->lvalue.get(), -offset);
+        // stack arg, above the saved rbp and the return address
+        stack.add_lvalue(fn.params[i]->lvalue.get(), -(16 + *arg_offset));
       } else if (auto reg = std::get_if<std::string>(&position)) {
         // register
-        push(*reg, type);
+        push_memory(*reg, type);
         stack.add_lvalue(fn.params[i]->lvalue.get());
       }
+      bind(fn.params[i]->lvalue->identifier, identifier);
     }
 
     // process stmts
@@ -384,6 +469,7 @@ class ASMGenVisitor : public ASTVisitor {
     // add implicit return, if needed
 
     // this is some return stuff, idk if it should go here
+    restore_registers(saved);
     print("add rsp, ", stack.size - 8, " ; local variables");
     // pop("rbp");
     stack.pop();
@@ -395,8 +481,15 @@ class ASMGenVisitor : public ASTVisitor {
   }
 
   virtual void visit(const ReturnStmt& stmt) override {
-    ASTVisitor::visit(stmt);
     auto type = stmt.expr->type;
+    auto var = dynamic_cast<const VarExpr*>(stmt.expr.get());
+    if (opt > 0 && var && !cacheable(type) && !registers.of(*var)) {
+      // a variable goes straight from its slot to the caller's
+      print("mov rax, [rbp - ", stack.variables["$return"], "]");
+      copy(type->size(ctx.get()), "rbp - " + std::to_string(stack.variables[var->identifier]), "rax");
+      return;
+    }
+    ASTVisitor::visit(stmt);
     if (type->is<Int>() || type->is<Bool>()) {
       pop("rax");
     } else if (type->is<Float>()) {
@@ -487,10 +580,14 @@ class ASMGenVisitor : public ASTVisitor {
         push("rax", expr.left->type);
       }
       return;
-    } else {
-      ASTVisitor::visit(expr);
+    } else if (opt > 0 && (expr.op == "/" || expr.op == "%") && right_int_const && magic_divisor(right_int_const->value)) {
+      expr.left->accept(*this);
       pop("rax");
-      pop("r10");
+      divide_by_constant(expr.op, right_int_const->value);
+      push("rax", expr.type);
+      return;
+    } else {
+      operands(expr, "rax", "r10");
     }
 
     if (bool_ops.find(expr.op) != bool_ops.end()) {
@@ -508,29 +605,33 @@ class ASMGenVisitor : public ASTVisitor {
         print("imul rax, r10");
       }
     } else if (expr.op == "/") {
-      print("cmp r10, 0");
-      print("; begin assert call");
-      auto label = genlabel();
-      print("jne ", label);
-      align(8);  // idk
-      read_const("rdi", "divide by zero");
-      print("call _fail_assertion");
-      unalign();
-      print(label, ":");
-      print("; end assert call");
+      if (!expr.divisor_safe) {
+        print("cmp r10, 0");
+        print("; begin assert call");
+        auto label = genlabel();
+        print("jne ", label);
+        align(8);  // idk
+        read_const("rdi", "divide by zero");
+        print("call _fail_assertion");
+        unalign();
+        print(label, ":");
+        print("; end assert call");
+      }
       print("cqo");
       print("idiv r10");
     } else if (expr.op == "%") {
-      print("cmp r10, 0");
-      print("; begin assert call");
-      auto label = genlabel();
-      print("jne ", label);
-      align(8);  // idk
-      read_const("rdi", "mod by zero");
-      print("call _fail_assertion");
-      unalign();
-      print(label, ":");
-      print("; end assert call");
+      if (!expr.divisor_safe) {
+        print("cmp r10, 0");
+        print("; begin assert call");
+        auto label = genlabel();
+        print("jne ", label);
+        align(8);  // idk
+        read_const("rdi", "mod by zero");
+        print("call _fail_assertion");
+        unalign();
+        print(label, ":");
+        print("; end assert call");
+      }
       print("cqo");
       print("idiv r10");
       print("mov rax, rdx");
@@ -538,13 +639,138 @@ class ASMGenVisitor : public ASTVisitor {
     push("rax", expr.type);
   }
 
+  // divisors that cannot fail, leaving 0 to the assert and -1 and INT64_MIN,
+  // whose quotients overflow or do not fit a magic number, to idiv
+  static bool magic_divisor(int64_t d) {
+    return d != 0 && d != -1 && d != INT64_MIN;
+  }
+
+  // x / d or x % d of the x in rax for a constant d, rounding toward zero as
+  // idiv does: shifts for a power of two, otherwise the high half of x times
+  // a magic number (Hacker's Delight, chapter 10)
+  void divide_by_constant(const std::string& op, int64_t d) {
+    uint64_t magnitude = d < 0 ? -(uint64_t)d : d;
+    if (auto k = log_2(magnitude); k >= 0) {
+      if (k == 0) {
+        if (op == "%") print("mov rax, 0");
+        return;
+      }
+      // a negative x is biased by 2^k - 1 so the shift rounds toward zero
+      print("mov r10, rax");
+      print("sar r10, 63");
+      print("shr r10, ", 64 - k);
+      if (op == "/") {
+        print("add rax, r10");
+        print("sar rax, ", k);
+        if (d < 0) print("neg rax");
+      } else {
+        print("add r10, rax");
+        print("sar r10, ", k);
+        print("shl r10, ", k);
+        print("sub rax, r10");
+      }
+      return;
+    }
+    auto [multiplier, shift] = magic(d);
+    print("mov r10, rax");
+    print("mov rdx, ", multiplier);
+    print("imul rdx");
+    if (d > 0 && multiplier < 0) print("add rdx, r10");
+    if (d < 0 && multiplier > 0) print("sub rdx, r10");
+    if (shift > 0) print("sar rdx, ", shift);
+    // add one to a negative quotient
+    print("mov rax, rdx");
+    print("shr rax, 63");
+    print("add rdx, rax");
+    if (op == "/") {
+      print("mov rax, rdx");
+      return;
+    }
+    if (d >= INT32_MIN && d <= INT32_MAX) {
+      print("imul rdx, ", d);
+    } else {
+      print("mov rax, ", d);
+      print("imul rdx, rax");
+    }
+    print("sub r10, rdx");
+    print("mov rax, r10");
+  }
+
+  // the multiplier and shift for a signed division by d, for |d| at least 2
+  // and not a power of two
+  static std::pair<int64_t, int> magic(int64_t d) {
+    const uint64_t two63 = uint64_t(1) << 63;
+    uint64_t magnitude = d < 0 ? -(uint64_t)d : d;
+    uint64_t t = two63 + ((uint64_t)d >> 63);
+    uint64_t anc = t - 1 - t % magnitude;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / magnitude, r2 = two63 - q2 * magnitude;
+    int p = 63;
+    uint64_t delta;
+    do {
+      p++;
+      q1 *= 2, r1 *= 2;
+      if (r1 >= anc) q1++, r1 -= anc;
+      q2 *= 2, r2 *= 2;
+      if (r2 >= magnitude) q2++, r2 -= magnitude;
+      delta = magnitude - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    uint64_t multiplier = q2 + 1;
+    if (d < 0) multiplier = -multiplier;
+    return {(int64_t)multiplier, p - 64};
+  }
+
+  // Operands are evaluated right to left, so a chain like ((a + b) + c) + d
+  // holds every right operand while the left one is computed. At -O1 a
+  // right operand that cannot fail goes last when the left one is deeper,
+  // which leaves the program's behaviour the same and keeps one value
+  // waiting.
+  void operands(const BinopExpr& expr, const std::string& left, const std::string& right) {
+    if (opt > 0 && quiet(*expr.right) && depth(*expr.left) > depth(*expr.right)) {
+      expr.left->accept(*this);
+      expr.right->accept(*this);
+      pop(right);
+      pop(left);
+      return;
+    }
+    ASTVisitor::visit(expr);
+    pop(left);
+    pop(right);
+  }
+
+  static int depth(const Expr& expr) {
+    int deepest = 0;
+    for (auto child : RewriteVisitor::children(expr)) {
+      deepest = std::max(deepest, depth(**child));
+    }
+    return deepest + 1;
+  }
+
+  // arithmetic over constants, variables and reads that cannot fail
+  static bool quiet(const Expr& expr) {
+    if (dynamic_cast<const IntExpr*>(&expr) || dynamic_cast<const FloatExpr*>(&expr) || dynamic_cast<const VarExpr*>(&expr)) {
+      return true;
+    }
+    if (auto read = dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      if (!dynamic_cast<const VarExpr*>(read->expr.get())) return false;
+      for (size_t k = 0; k < read->indices.size(); k++) {
+        if (k >= read->lower_safe.size() || !read->lower_safe[k] || !read->upper_safe[k] || !quiet(*read->indices[k])) return false;
+      }
+      return true;
+    }
+    if (auto dot = dynamic_cast<const DotExpr*>(&expr)) return quiet(*dot->expr);
+    if (auto unop = dynamic_cast<const UnopExpr*>(&expr)) return quiet(*unop->expr);
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    if (!binop || binop->op == "&&" || binop->op == "||") return false;
+    if ((binop->op == "/" || binop->op == "%") && !(binop->type->is<Float>() || binop->divisor_safe)) return false;
+    return quiet(*binop->left) && quiet(*binop->right);
+  }
+
   void float_binop(const BinopExpr& expr) {
     if (expr.op == "%") {
       align(8);
     }
-    ASTVisitor::visit(expr);
-    pop("xmm0");
-    pop("xmm1");
+    operands(expr, "xmm0", "xmm1");
     if (expr.op == "+") {
       print("addsd xmm0, xmm1");
     } else if (expr.op == "-") {
@@ -594,10 +820,14 @@ class ASMGenVisitor : public ASTVisitor {
     ASTVisitor::visit(expr);
     auto element_size = expr.type->as<Array>()->element_type->size(ctx.get());
     auto size = expr.elements.size() * element_size;
-    print("mov rdi, ", size);
-    align(8);
-    print("call _jpl_alloc");
-    unalign();
+    if (expr.frame >= 0) {
+      print("lea rax, [rbp - ", frame_arrays - expr.frame, "] ; in the frame");
+    } else {
+      print("mov rdi, ", size);
+      align(8);
+      print("call _jpl_alloc");
+      unalign();
+    }
     print("; copy data from rsp to rax");
     for (int i = size - 8; i >= 0; i -= 8) {
       print("mov r10, [rsp + ", i, "]");
@@ -618,16 +848,29 @@ class ASMGenVisitor : public ASTVisitor {
     ASTVisitor::visit(cmd);
     stack.local_var_size += cmd.expr->type->size(ctx.get());
     stack.add_lvalue(cmd.lvalue.get());
+    bind(cmd.lvalue->identifier, cmd.lvalue->identifier);
   }
 
   virtual void visit(const LetStmt& cmd) override {
     ASTVisitor::visit(cmd);
     stack.local_var_size += cmd.expr->type->size(ctx.get());
     stack.add_lvalue(cmd.lvalue.get());
+    bind(cmd.lvalue->identifier, cmd.lvalue->identifier);
   }
 
   virtual void visit(const VarExpr& expr) override {
+    if (auto reg = registers.of(expr)) {
+      push(*reg, expr.type, expr.identifier);
+      return;
+    }
     auto start = stack.variables[expr.identifier];
+    if (cacheable(expr.type)) {
+      auto slot = cache_slot(expr.type->is<Float>());
+      emit(xmm(slot) ? "movsd " : "mov ", slot, ", [rbp - ", start, "] ; ", expr.identifier);
+      cached.push_back({slot});
+      stack.push(expr.type);
+      return;
+    }
     // allocate type on stack
     stack.shadow.push(expr.type);
     stack.size += expr.type->size(ctx.get());
@@ -662,15 +905,8 @@ class ASMGenVisitor : public ASTVisitor {
     // prepare stack
     if (!ret_reg) {
       asm_alloc(info->return_type);
-      auto ret_offset = std::get<int>(convention.ret);
-      print("lea rdi, [rsp + 0]");  //, offset, "]");
-      // auto offset = stack.size - ret_offset + stack.padding.top();
-      // print("lea rdi, [rsp + ", offset, "]");
-    } else {
-      stack.shadow.push(info->return_type);
     }
-    std::cout << "; stack size is " << stack.size << '\n';
-    align(stack.size - info->return_type->size(ctx.get()));
+    align(convention.total_stack + 8);
 
     // generate code for args
     for (int i = expr.args.size() - 1; i >= 0; i--) {
@@ -678,28 +914,27 @@ class ASMGenVisitor : public ASTVisitor {
       if (std::get_if<int>(&convention.args[i])) {
         print("; generating expr for stack arg");
         expr.args[i]->accept(*this);
-        stack.size += expr.args[i]->type->size(ctx.get());
       }
     }
     for (int i = expr.args.size() - 1; i >= 0; i--) {
       // register args right to left
-      print("; generating expr for register arg");
       if (std::get_if<std::string>(&convention.args[i])) {
+        print("; generating expr for register arg");
         expr.args[i]->accept(*this);
       }
     }
     for (const auto& arg : convention.args) {
       // pop register args to their registers
-      print("; popping register arg to register");
       if (auto reg = std::get_if<std::string>(&arg)) {
+        print("; popping register arg to register");
         pop(*reg);
       }
     }
 
     // do call
-    // auto ret_offset = std::get<int>(convention.ret);
-    // auto offset = stack.size - ret_offset + stack.padding.top();
-    // print("lea rdi, [rsp + ", offset, "]");
+    if (!ret_reg) {
+      print("lea rdi, [rsp + ", convention.total_stack + stack.padding.top(), "] ; return value");
+    }
     print("call _", info->name);
 
     // free stack args one-by-one
@@ -721,7 +956,12 @@ class ASMGenVisitor : public ASTVisitor {
     if (opt > 0) {
       auto l = dynamic_cast<const IntExpr*>(expr.if_expr.get());
       auto r = dynamic_cast<const IntExpr*>(expr.else_expr.get());
-      if (l && r && l->value == 1 && r->value == 0) return;
+      // the condition's 0 or 1 already is the value
+      if (l && r && l->value == 1 && r->value == 0) {
+        stack.pop();
+        stack.push(expr.type);
+        return;
+      }
     }
     pop("rax");
     print("cmp rax, 0");
@@ -737,8 +977,37 @@ class ASMGenVisitor : public ASTVisitor {
   }
 
   virtual void visit(const ArrayIndexExpr& expr) override {
+    read_element(expr, 0, expr.expr->type->as<Array>()->element_type);
+  }
+
+  // pushes the part of an element of the given type at an offset into it,
+  // the whole element or one of its fields
+  void read_element(const ArrayIndexExpr& expr, int64_t offset, std::shared_ptr<ResolvedType> type) {
     print();
     print("; begin array index expr");
+    auto displacement = offset;
+    if (auto cursor = cursors.find(&expr); cursor != cursors.end()) {
+      print("mov rax, [rsp + ", stack.size - cursor->second.position, "] ; running pointer");
+      displacement += cursor->second.displacement;
+    } else {
+      address(expr);
+    }
+    if (cacheable(type)) {
+      auto slot = cache_slot(type->is<Float>());
+      auto element = displacement ? "[rax + " + std::to_string(displacement) + "]" : std::string("[rax]");
+      emit(xmm(slot) ? "movsd " : "mov ", slot, ", ", element);
+      cached.push_back({slot});
+      stack.push(type);
+      return;
+    }
+    if (displacement) print("add rax, ", displacement);
+    asm_alloc(type);
+    copy(type->size(ctx.get()), "rax", "rsp");
+    print("; stack.alloc(ELEM_TYPE)");
+  }
+
+  // leaves the address of the element in rax
+  void address(const ArrayIndexExpr& expr) {
     auto type = expr.expr->type->as<Array>();
 
     auto gap = 0;
@@ -758,11 +1027,18 @@ class ASMGenVisitor : public ASTVisitor {
 
     // for each IDX_K
     for (int k = 0; k < type->rank; k++) {
+      auto lower_safe = k < (int)expr.lower_safe.size() && expr.lower_safe[k];
+      auto upper_safe = k < (int)expr.upper_safe.size() && expr.upper_safe[k];
+      if (lower_safe && upper_safe) continue;
       print("mov rax, [rsp + ", k * 8, "] ; here");
-      print("cmp rax, 0");
-      asm_assert("jge", "negative array index");
-      print("cmp rax, [rsp + ", k * 8 + gap, "] ; here");
-      asm_assert("jl", "index too large");
+      if (!lower_safe) {
+        print("cmp rax, 0");
+        asm_assert("jge", "negative array index");
+      }
+      if (!upper_safe) {
+        print("cmp rax, [rsp + ", k * 8 + gap, "] ; here");
+        asm_assert("jl", "index too large");
+      }
     }
 
     // genereate indexing code
@@ -804,179 +1080,1109 @@ class ASMGenVisitor : public ASTVisitor {
       asm_free(expr.expr->type);
     }
     // stack.pop(expr.expr->type);  // free
-    asm_alloc(type->element_type);
-    copy(type->element_type->size(ctx.get()), "rax", "rsp");
-    print("; stack.alloc(ELEM_TYPE)");
   }
 
-  virtual void visit(const SumLoopExpr& expr) override {
-    print();
-    print("; begin sum loop expr");
+  // A read in the innermost axis of a loop whose indices are invariant
+  // except for one that is the axis's variable plus an invariant is done
+  // through a running pointer: it is computed where the row starts, while
+  // the variable is 0, and bumped by a fixed stride after every iteration.
+  //
+  // Reads of the same row of an array at var plus different constants, as
+  // the copies of an unrolled stencil make, share one running pointer: each
+  // one is at a fixed displacement from the first. The constant may also
+  // come from a let in the row, whose read could not start a pointer of its
+  // own before the let is evaluated.
+  struct Cursor {
+    int position;
+    std::optional<int64_t> stride;
+    int stride_position = 0;
+    int64_t displacement = 0;
+    // whether it is another read's pointer, bumped and freed by that read
+    bool shared = false;
+  };
+
+  typedef std::vector<std::pair<const ArrayIndexExpr*, size_t>> Reads;
+
+  // where a read moves with var, as var plus a constant
+  struct Offset {
+    size_t position;
+    int64_t offset;
+  };
+
+  struct RowScan {
+    std::multiset<std::string> bound;
+    // lets of the row with their values, innermost last
+    std::vector<std::pair<std::string, const Expr*>> values;
+    std::map<const ArrayIndexExpr*, Offset> offsets;
+    // reads whose index goes through a let of the row
+    Reads through_lets;
+  };
+
+  Reads strided_reads(const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis, const Expr& body,
+                      const std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>>& hoisted) {
+    Reads reads;
+    if (opt == 0) return reads;
+    RowScan scan;
+    // lets of the innermost axis are evaluated after the row starts
+    if (hoisted.size() >= axis.size()) {
+      for (const auto& [identifier, value] : hoisted.back()) scan.bound.insert(identifier);
+    }
+    find_reads(body, axis.back().first, scan, reads);
+    share_cursors(scan, reads);
+    return reads;
+  }
 
-    // 1/4
-    auto num_e = expr.axis.size();
-    asm_alloc(expr.type);
-    for (int i = num_e - 1; i >= 0; i--) {
-      expr.axis[i].second->accept(*this);
-      // check bounds step-by-step
-      print("mov rax, [rsp]");
-      print("cmp rax, 0");
-      asm_assert("jg", "non-positive loop bound");
+  void find_reads(const Expr& expr, const std::string& var, RowScan& scan, Reads& reads) {
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      find_reads(*let->value, var, scan, reads);
+      auto it = scan.bound.insert(let->identifier);
+      scan.values.emplace_back(let->identifier, let->value.get());
+      find_reads(*let->body, var, scan, reads);
+      scan.values.pop_back();
+      scan.bound.erase(it);
+      return;
     }
-    print("mov rax, 0 ; init sum");
-    print("mov [rsp + ", num_e * 8, "], rax ; move to pre-alloc");
-    for (int i = num_e - 1; i >= 0; i--) {
-      const auto& [identifier, e] = expr.axis[i];
-      print("mov rax, 0");
-      push("rax", Int::shared);
-      stack.add_lvalue(identifier);
+    // nested loops stride over their own innermost axis
+    if (auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr)) {
+      for (const auto& [_, bound_expr] : loop->axis) find_reads(*bound_expr, var, scan, reads);
+      return;
+    }
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(&expr)) {
+      for (const auto& [_, bound_expr] : loop->axis) find_reads(*bound_expr, var, scan, reads);
+      return;
     }
+    if (auto read = dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      auto position = strided(*read, var, scan.bound);
+      auto offset = constant_offset(*read, var, scan);
+      if (offset) scan.offsets[read] = *offset;
+      if (position) {
+        reads.emplace_back(read, *position);
+        return;
+      }
+      if (offset) {
+        scan.through_lets.emplace_back(read, offset->position);
+        return;
+      }
+    }
+    for (auto child : RewriteVisitor::children(expr)) {
+      find_reads(**child, var, scan, reads);
+    }
+  }
 
-    // 2/4
-    auto jump_label = genlabel();
-    print(jump_label, ":");
-    expr.expr->accept(*this);
-    if (expr.expr->type->is<Int>()) {
-      pop("rax");
-      print("add [rsp + ", 2 * num_e * 8, "], rax");
-    } else {
-      pop("xmm0");
-      print("addsd xmm0, [rsp + ", 2 * num_e * 8, "]");
-      print("movsd [rsp + ", 2 * num_e * 8, "], xmm0");
+  // the last index of a read as var plus a constant, when the others are
+  // invariant and every index is checked statically
+  std::optional<Offset> constant_offset(const ArrayIndexExpr& read, const std::string& var, const RowScan& scan) {
+    auto array = dynamic_cast<const VarExpr*>(read.expr.get());
+    if (!array || scan.bound.count(array->identifier)) return std::nullopt;
+    auto last = read.indices.size() - 1;
+    for (size_t k = 0; k < read.indices.size(); k++) {
+      if (k >= read.lower_safe.size() || !read.lower_safe[k] || !read.upper_safe[k]) return std::nullopt;
+      if (k != last && !invariant(*read.indices[k], var, scan.bound)) return std::nullopt;
     }
+    auto offset = moves_by(*read.indices[last], var, scan, scan.values.size());
+    if (!offset) return std::nullopt;
+    return Offset{last, *offset};
+  }
 
-    // 3/4
-    print("add qword [rsp + ", (num_e - 1) * 8, "], 1");
-    for (int i = num_e - 1; i >= 0; i--) {
-      print("mov rax, [rsp + ", i * 8, "]");
-      print("cmp rax, [rsp + ", (i + num_e) * 8, "]");
-      print("jl ", jump_label);
-      // if something
-      if (i > 0) {
-        print("mov qword [rsp + ", i * 8, "], 0");
-        print("add qword [rsp + ", (i - 1) * 8, "], 1");
+  // the constant an expression adds to var, looking through the lets of the
+  // row bound before the first visible ones
+  std::optional<int64_t> moves_by(const Expr& expr, const std::string& var, const RowScan& scan, size_t visible) {
+    if (auto v = dynamic_cast<const VarExpr*>(&expr)) {
+      for (size_t k = visible; k-- > 0;) {
+        if (scan.values[k].first == v->identifier) return moves_by(*scan.values[k].second, var, scan, k);
       }
+      if (v->identifier == var && !scan.bound.count(var)) return 0;
+      return std::nullopt;
     }
-
-    // 4/4
-    asm_free(num_e, Int::shared);
-    asm_free(num_e, Int::shared);
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    if (!binop || (binop->op != "+" && binop->op != "-")) return std::nullopt;
+    auto right = dynamic_cast<const IntExpr*>(binop->right.get());
+    if (right) {
+      auto offset = moves_by(*binop->left, var, scan, visible);
+      if (!offset) return std::nullopt;
+      return binop->op == "+" ? *offset + right->value : *offset - right->value;
+    }
+    auto left = dynamic_cast<const IntExpr*>(binop->left.get());
+    if (!left || binop->op != "+") return std::nullopt;
+    auto offset = moves_by(*binop->right, var, scan, visible);
+    if (!offset) return std::nullopt;
+    return left->value + *offset;
   }
 
-  virtual void visit(const ShowCmd& cmd) override {
-    auto type = cmd.expr->type;
-    align(type->size(ctx.get()) + 8);  // call pushes return address
-    ASTVisitor::visit(cmd);
-    read_const("rdi", type->show_type(ctx.get()));
-    print("lea rsi, [rsp]");
-    print("call _show");
-    // free self.stack by sizeof EXPR_TYPE
-    print("add rsp, ", type->size(ctx.get()), " ; free stack by sizeof expr");
-    // stack.size -= type->size();
-    stack.pop();
-    unalign();
+  // points reads at the running pointer of the first read of the same row
+  void share_cursors(const RowScan& scan, Reads& reads) {
+    auto candidates = reads;
+    candidates.insert(candidates.end(), scan.through_lets.begin(), scan.through_lets.end());
+    for (const auto& [read, position] : candidates) {
+      auto offset = scan.offsets.find(read);
+      if (offset == scan.offsets.end() || offset->second.position != position) continue;
+      for (const auto& [leader, _] : reads) {
+        if (leader == read) break;
+        if (anchors.count(leader) || !same_row(*leader, *read, position)) continue;
+        auto from = scan.offsets.find(leader);
+        if (from == scan.offsets.end() || from->second.position != position) continue;
+        auto element_size = read->type->size(ctx.get());
+        anchors[read] = {leader, (offset->second.offset - from->second.offset) * element_size};
+        break;
+      }
+    }
+    for (const auto& [read, position] : scan.through_lets) {
+      if (anchors.count(read)) reads.emplace_back(read, position);
+    }
   }
 
-  virtual void visit(const ArrayLoopExpr& expr) override {
-    print();
-    print("; begin array loop expr");
+  static bool same_row(const ArrayIndexExpr& a, const ArrayIndexExpr& b, size_t position) {
+    if (!same_tree(*a.expr, *b.expr) || a.indices.size() != b.indices.size()) return false;
+    for (size_t k = 0; k < a.indices.size(); k++) {
+      if (k != position && !same_tree(*a.indices[k], *b.indices[k])) return false;
+    }
+    return true;
+  }
 
-    // 1/4
-    auto num_e = expr.axis.size();
-    asm_alloc(Int::shared);
-    for (int i = num_e - 1; i >= 0; i--) {
-      expr.axis[i].second->accept(*this);
-      // check bounds step-by-step
-      print("mov rax, [rsp]");
-      print("cmp rax, 0");
-      asm_assert("jg", "non-positive loop bound");
+  // structural equality of integer arithmetic over variables
+  static bool same_tree(const Expr& a, const Expr& b) {
+    if (auto x = dynamic_cast<const IntExpr*>(&a)) {
+      auto y = dynamic_cast<const IntExpr*>(&b);
+      return y && x->value == y->value;
     }
-    print("mov rdi, ", expr.expr->type->size(ctx.get()));
-    for (int i = 0; i < num_e; i++) {
-      print("imul rdi, [rsp + ", i * 8, "]");
-      asm_assert("jno", "overflow computing array size");
+    if (auto x = dynamic_cast<const VarExpr*>(&a)) {
+      auto y = dynamic_cast<const VarExpr*>(&b);
+      return y && x->identifier == y->identifier;
     }
-    align(8);
-    print("call _jpl_alloc");
-    unalign();
-    print("mov [rsp + ", num_e * 8, "], rax ; move to pre-alloc");
-    for (int i = num_e - 1; i >= 0; i--) {
-      const auto& [identifier, e] = expr.axis[i];
-      print("mov rax, 0");
-      push("rax", Int::shared);
-      stack.add_lvalue(identifier);
+    auto x = dynamic_cast<const BinopExpr*>(&a);
+    auto y = dynamic_cast<const BinopExpr*>(&b);
+    return x && y && x->op == y->op && same_tree(*x->left, *y->left) && same_tree(*x->right, *y->right);
+  }
+
+  // the index that moves with var, when the read is checked statically and
+  // all the other indices are invariant
+  std::optional<size_t> strided(const ArrayIndexExpr& read, const std::string& var, const std::multiset<std::string>& bound) {
+    auto array = dynamic_cast<const VarExpr*>(read.expr.get());
+    if (!array || bound.count(array->identifier)) return std::nullopt;
+    std::optional<size_t> position;
+    for (size_t k = 0; k < read.indices.size(); k++) {
+      if (k >= read.lower_safe.size() || !read.lower_safe[k] || !read.upper_safe[k]) return std::nullopt;
+      if (invariant(*read.indices[k], var, bound)) continue;
+      if (position || !moves(*read.indices[k], var, bound)) return std::nullopt;
+      position = k;
     }
+    return position;
+  }
 
-    // 2/4
-    auto jump_label = genlabel();
-    print(jump_label, ":");
-    expr.expr->accept(*this);
-    auto offset = expr.expr->type->size(ctx.get());
+  // integer arithmetic that cannot fail over variables bound before the row
+  bool invariant(const Expr& expr, const std::string& var, const std::multiset<std::string>& bound) {
+    if (dynamic_cast<const IntExpr*>(&expr)) return true;
+    if (auto v = dynamic_cast<const VarExpr*>(&expr)) return v->identifier != var && !bound.count(v->identifier);
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    if (!binop || (binop->op != "+" && binop->op != "-" && binop->op != "*")) return false;
+    return invariant(*binop->left, var, bound) && invariant(*binop->right, var, bound);
+  }
 
-    // generate index for result
-    if (opt == 0) {
-      print("mov rax, 0");
-    } else {
-      print("mov rax, [rsp + ", offset, "]");
-    }
-    for (int i = opt > 0; i < num_e; i++) {
-      auto int_expr = dynamic_cast<const IntExpr*>(expr.axis[i].second.get());
-      if (opt > 0 && int_expr) {
-        if (log_2(int_expr->value) >= 0) {
-          print("shl rax, ", log_2(int_expr->value));
-        } else {
-          print("imul rax, ", int_expr->value, ";here??1");
-        }
+  // var plus or minus invariant terms
+  bool moves(const Expr& expr, const std::string& var, const std::multiset<std::string>& bound) {
+    if (auto v = dynamic_cast<const VarExpr*>(&expr)) return v->identifier == var && !bound.count(var);
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    if (!binop || (binop->op != "+" && binop->op != "-")) return false;
+    if (moves(*binop->left, var, bound)) return invariant(*binop->right, var, bound);
+    return binop->op == "+" && invariant(*binop->left, var, bound) && moves(*binop->right, var, bound);
+  }
+
+  void open_cursors(const Reads& reads) {
+    for (const auto& [read, position] : reads) {
+      if (auto anchor = anchors.find(read); anchor != anchors.end()) {
+        auto cursor = cursors[anchor->second.first];
+        cursor.displacement = anchor->second.second;
+        cursor.shared = true;
+        cursors[read] = cursor;
+        continue;
+      }
+      auto type = read->expr->type->as<Array>();
+      auto element_size = type->element_type->size(ctx.get());
+      Cursor cursor;
+      if (position + 1 == read->indices.size()) {
+        cursor.stride = element_size;
       } else {
-        print("imul rax, [rsp + ", offset + (num_e + i) * 8, "]");
+        // the array's dimensions lie below its variable's offset
+        auto& array = static_cast<const VarExpr&>(*read->expr);
+        auto dims = stack.size - stack.variables[array.identifier] - 8;
+        print("mov rax, ", element_size, " ; stride of ", array.identifier);
+        for (size_t k = position + 1; k < read->indices.size(); k++) {
+          print("imul rax, [rsp + ", dims + k * 8, "]");
+        }
+        push("rax", Int::shared);
+        cursor.stride_position = stack.size;
       }
-      print("add rax, [rsp + ", offset + i * 8, "]");
-    }
-    if (log_2(offset) >= 0 && opt > 0) {
-      print("shl rax, ", log_2(offset));
-    } else {
-      print("imul rax, ", offset, ";here??2");
+      address(*read);
+      push("rax", Int::shared, "running pointer");
+      cursor.position = stack.size;
+      cursors[read] = cursor;
     }
-    print("add rax, [rsp + ", offset + 2 * num_e * 8, "]");
-
-    copy(offset, "rsp", "rax");
-    asm_free(expr.expr->type);
+  }
 
-    // 3/4
-    print("add qword [rsp + ", (num_e - 1) * 8, "], 1");
-    for (int i = num_e - 1; i >= 0; i--) {
-      print("mov rax, [rsp + ", i * 8, "]");
-      print("cmp rax, [rsp + ", (i + num_e) * 8, "]");
-      print("jl ", jump_label);
-      // if something
-      if (i > 0) {
-        print("mov qword [rsp + ", i * 8, "], 0");
-        print("add qword [rsp + ", (i - 1) * 8, "], 1");
+  void bump_cursors(const Reads& reads) {
+    for (const auto& [read, position] : reads) {
+      auto& cursor = cursors[read];
+      if (cursor.shared) continue;
+      if (cursor.stride) {
+        print("add qword [rsp + ", stack.size - cursor.position, "], ", *cursor.stride);
+      } else {
+        print("mov rax, [rsp + ", stack.size - cursor.stride_position, "]");
+        print("add [rsp + ", stack.size - cursor.position, "], rax");
       }
     }
+  }
 
-    // 4/4
-    asm_free(num_e, Int::shared);
-    stack.recharacterize(num_e + 1, expr.type);
+  void close_cursors(const Reads& reads) {
+    for (auto it = reads.rbegin(); it != reads.rend(); it++) {
+      auto& cursor = cursors[it->first];
+      if (!cursor.shared) {
+        asm_free(Int::shared);
+        if (!cursor.stride) asm_free(Int::shared);
+      }
+      cursors.erase(it->first);
+    }
   }
 
-  virtual void visit(const AssertCmd& cmd) override {
-    ASTVisitor::visit(cmd);
-    pop("rax");
-    print("cmp rax, 0");
-    asm_assert("jne", cmd.string);
+  // labels[k] starts an iteration of axis k, evaluating its hoisted lets;
+  // the running pointers start with the innermost axis, after row_start
+  std::vector<std::string> enter_axes(int num_e, const std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>>& hoisted,
+                                      const Reads& reads, std::function<void()> row_start = nullptr) {
+    std::vector<std::string> labels;
+    if (num_e == 1) open_cursors(reads);
+    for (int k = 0; k < num_e; k++) {
+      labels.push_back(genlabel());
+      print(labels.back(), ":");
+      if (k < (int)hoisted.size()) {
+        for (const auto& [identifier, value] : hoisted[k]) {
+          print("; hoisted let ", identifier);
+          value->accept(*this);
+          stack.add_lvalue(identifier);
+          bind(identifier, identifier);
+        }
+      }
+      if (k == num_e - 2) {
+        if (row_start) row_start();
+        open_cursors(reads);
+      }
+    }
+    return labels;
   }
 
-  virtual void visit(const AssertStmt& stmt) override {
-    ASTVisitor::visit(stmt);
-    pop("rax");
-    print("cmp rax, 0");
-    asm_assert("jne", stmt.string);
+  // the loop variable of axis i, whose values lie at stack position counters
+  std::string counter(const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis, int counters, int i) {
+    auto reg = registers.of(&axis[i].first);
+    return reg ? *reg : "qword [rsp + " + std::to_string(stack.size - counters + i * 8) + "]";
   }
 
-  virtual void visit(const ReadCmd& cmd) override {
-    auto rgba = std::make_shared<Struct>("rgba");
-    auto type = std::make_shared<Array>(rgba, 2);
+  // advances the loop variables, innermost first, whose values lie at
+  // stack position counters; an axis's hoisted lets are freed as it
+  // advances and evaluated again from its label. The innermost variable
+  // restarts from the value at stack position first, if given, or from 0
+  void step(const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis, int counters, const std::vector<std::string>& labels,
+            const std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>>& hoisted, const Reads& reads, int first = 0,
+            const std::string& row_end = "") {
+    int num_e = axis.size();
+    auto counter = [&](int i) { return this->counter(axis, counters, i); };
+    bump_cursors(reads);
+    for (int i = num_e - 1; i >= 0; i--) {
+      if (i == num_e - 2) close_cursors(reads);
+      if (i < (int)hoisted.size()) {
+        for (auto it = hoisted[i].rbegin(); it != hoisted[i].rend(); it++) {
+          asm_free(it->second->type);
+        }
+      }
+      auto live = stack.size - counters;
+      if (i == num_e - 1) {
+        print("add ", counter(i), ", 1");
+      }
+      if (auto reg = registers.of(&axis[i].first)) {
+        print("cmp ", *reg, ", [rsp + ", live + (i + num_e) * 8, "]");
+      } else {
+        print("mov rax, [rsp + ", live + i * 8, "]");
+        print("cmp rax, [rsp + ", live + (i + num_e) * 8, "]");
+      }
+      print("jl ", labels[i]);
+      if (i == num_e - 1 && !row_end.empty()) print(row_end, ":");
+      if (i > 0 && first && i == num_e - 1) {
+        print("mov rax, [rsp + ", stack.size - first, "]");
+        print("mov ", counter(i), ", rax");
+        print("add ", counter(i - 1), ", 1");
+      } else if (i > 0) {
+        print("mov ", counter(i), ", 0");
+        print("add ", counter(i - 1), ", 1");
+      }
+    }
+    if (num_e == 1) close_cursors(reads);
+  }
+
+  // Vectorization of the innermost axis of an array loop. A body built from
+  // float arithmetic, or integer + and -, over unit-stride running pointer
+  // reads, constants and variables bound outside the row is computed for
+  // width elements at once in packed registers: xmm with SSE2, ymm with
+  // AVX2. Invariant leaves are broadcast once per entry, into registers
+  // from the top of xmm0-xmm8, and the tree is evaluated from the bottom.
+  struct Vector {
+    int width;
+    const std::string* var;
+    // broadcast invariants, by their first occurrence
+    std::vector<const Expr*> invariants = {};
+    std::map<std::string, int> resident = {};
+    int registers = 0;
+    // bytes past the running pointers, for unrolled copies of the body
+    int offset = 0;
+  };
+
+  inline static const int vector_registers = 9;
+  inline static const int max_accumulators = 4;
+
+  // whether a body can be vectorized, collecting its invariants
+  bool vectorizable(const Expr& expr, Vector& vector, std::set<std::string>& lets) {
+    if (!expr.type || (!expr.type->is<Float>() && !expr.type->is<Int>())) return false;
+    if (dynamic_cast<const FloatExpr*>(&expr) || dynamic_cast<const IntExpr*>(&expr)) {
+      vector.invariants.push_back(&expr);
+      return true;
+    }
+    if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+      if (lets.count(var->identifier)) return true;
+      if (var->identifier == *vector.var) return false;
+      vector.invariants.push_back(&expr);
+      return true;
+    }
+    if (auto read = dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      auto cursor = cursors.find(read);
+      return cursor != cursors.end() && cursor->second.stride == 8;
+    }
+    if (auto unop = dynamic_cast<const UnopExpr*>(&expr)) {
+      return unop->op == "-" && vectorizable(*unop->expr, vector, lets);
+    }
+    if (auto binop = dynamic_cast<const BinopExpr*>(&expr)) {
+      auto ops = expr.type->is<Float>() ? std::set<std::string>{"+", "-", "*", "/"} : std::set<std::string>{"+", "-"};
+      if (!ops.count(binop->op)) return false;
+      return vectorizable(*binop->left, vector, lets) && vectorizable(*binop->right, vector, lets);
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      if (!vectorizable(*let->value, vector, lets)) return false;
+      auto inner = lets;
+      inner.insert(let->identifier);
+      return vectorizable(*let->body, vector, inner);
+    }
+    return false;
+  }
+
+  // the registers evaluating an expression into one takes, above it
+  static int vector_need(const Expr& expr, const std::set<std::string>& resident) {
+    if (auto unop = dynamic_cast<const UnopExpr*>(&expr)) {
+      return resident_operand(*unop->expr, resident) ? 1 : vector_need(*unop->expr, resident) + 1;
+    }
+    if (auto binop = dynamic_cast<const BinopExpr*>(&expr)) {
+      auto right = resident_operand(*binop->right, resident) ? 1 : vector_need(*binop->right, resident) + 1;
+      return std::max(vector_need(*binop->left, resident), right);
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      auto inner = resident;
+      inner.insert(let->identifier);
+      return std::max(vector_need(*let->value, resident), 1 + vector_need(*let->body, inner));
+    }
+    return 1;
+  }
+
+  // invariants and let-bound values already sit in a register
+  static bool resident_operand(const Expr& expr, const std::set<std::string>& resident) {
+    if (dynamic_cast<const FloatExpr*>(&expr) || dynamic_cast<const IntExpr*>(&expr)) return true;
+    auto var = dynamic_cast<const VarExpr*>(&expr);
+    return var && resident.count(var->identifier);
+  }
+
+  std::string vreg(const Vector& vector, int n) {
+    return (vector.width == 4 ? "ymm" : "xmm") + std::to_string(n);
+  }
+
+  // the register holding an invariant or a let-bound value
+  std::optional<int> resident_register(const Expr& expr, const Vector& vector) {
+    if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+      if (auto it = vector.resident.find(var->identifier); it != vector.resident.end()) return it->second;
+    }
+    for (size_t k = 0; k < vector.invariants.size(); k++) {
+      if (same_invariant(*vector.invariants[k], expr)) return vector_registers - 1 - k;
+    }
+    return std::nullopt;
+  }
+
+  static bool same_invariant(const Expr& a, const Expr& b) {
+    if (auto x = dynamic_cast<const FloatExpr*>(&a)) {
+      auto y = dynamic_cast<const FloatExpr*>(&b);
+      return y && y->value == x->value;
+    }
+    if (auto x = dynamic_cast<const IntExpr*>(&a)) {
+      auto y = dynamic_cast<const IntExpr*>(&b);
+      return y && y->value == x->value;
+    }
+    auto x = dynamic_cast<const VarExpr*>(&a);
+    auto y = dynamic_cast<const VarExpr*>(&b);
+    return x && y && x->identifier == y->identifier;
+  }
+
+  // fills every lane of register n with the value of an invariant
+  void broadcast(const Expr& expr, const Vector& vector, int n) {
+    auto wide = vector.width == 4;
+    auto xmm = "xmm" + std::to_string(n);
+    std::string source;
+    if (auto constant = dynamic_cast<const FloatExpr*>(&expr)) {
+      source = "qword [rel " + const_map[constant->value] + "]";
+    } else if (auto constant = dynamic_cast<const IntExpr*>(&expr)) {
+      if (constant->value >= INT32_MIN && constant->value <= INT32_MAX) {
+        print("mov rax, ", constant->value);
+        source = "rax";
+      } else {
+        source = "qword [rel " + const_map[constant->value] + "]";
+      }
+    } else {
+      auto& var = static_cast<const VarExpr&>(expr);
+      auto reg = registers.of(var);
+      source = reg ? *reg : "qword [rbp - " + std::to_string(stack.variables[var.identifier]) + "]";
+    }
+    if (expr.type->is<Float>()) {
+      if (wide) {
+        print("vbroadcastsd ", vreg(vector, n), ", ", source);
+      } else {
+        print(source.rfind("xmm", 0) == 0 ? "movapd " : "movsd ", xmm, ", ", source);
+        print("unpcklpd ", xmm, ", ", xmm);
+      }
+      return;
+    }
+    if (source.rfind("qword", 0) != 0) {
+      print("movq ", xmm, ", ", source);
+      source = xmm;
+    }
+    if (wide) {
+      print("vpbroadcastq ", vreg(vector, n), ", ", source);
+    } else {
+      if (source != xmm) print("movq ", xmm, ", ", source);
+      print("punpcklqdq ", xmm, ", ", xmm);
+    }
+  }
+
+  // evaluates a vectorizable expression into register n
+  void vector_eval(const Expr& expr, Vector& vector, int n) {
+    auto wide = vector.width == 4;
+    auto dst = vreg(vector, n);
+    auto is_float = expr.type->is<Float>();
+    // operand register of a child, evaluating it into n + 1 when needed
+    auto operand = [&](const Expr& child) {
+      if (auto reg = resident_register(child, vector)) return vreg(vector, *reg);
+      vector_eval(child, vector, n + 1);
+      return vreg(vector, n + 1);
+    };
+    auto apply = [&](const std::string& op, const std::string& src) {
+      if (wide) {
+        print("v", op, " ", dst, ", ", dst, ", ", src);
+      } else {
+        print(op, " ", dst, ", ", src);
+      }
+    };
+    if (auto reg = resident_register(expr, vector)) {
+      print(wide ? "vmovapd " : "movapd ", dst, ", ", vreg(vector, *reg));
+    } else if (auto read = dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      print("mov rax, [rsp + ", stack.size - cursors[read].position, "] ; running pointer");
+      auto displacement = cursors[read].displacement + vector.offset;
+      auto at = displacement ? "[rax + " + std::to_string(displacement) + "]" : "[rax]";
+      print(wide ? "vmovupd " : "movupd ", dst, ", ", at);
+    } else if (auto unop = dynamic_cast<const UnopExpr*>(&expr)) {
+      auto src = operand(*unop->expr);
+      apply(is_float ? "xorpd" : "pxor", dst);
+      apply(is_float ? "subpd" : "psubq", src);
+    } else if (auto binop = dynamic_cast<const BinopExpr*>(&expr)) {
+      static const std::map<std::string, std::string> float_ops = {{"+", "addpd"}, {"-", "subpd"}, {"*", "mulpd"}, {"/", "divpd"}};
+      static const std::map<std::string, std::string> int_ops = {{"+", "paddq"}, {"-", "psubq"}};
+      vector_eval(*binop->left, vector, n);
+      auto src = operand(*binop->right);
+      apply((is_float ? float_ops : int_ops).at(binop->op), src);
+    } else if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      vector_eval(*let->value, vector, n);
+      auto outer = vector.resident;
+      vector.resident[let->identifier] = n;
+      vector_eval(*let->body, vector, n + 1);
+      vector.resident = outer;
+      print(wide ? "vmovapd " : "movapd ", dst, ", ", vreg(vector, n + 1));
+    }
+  }
+
+  // the registers a vectorizable body takes with its invariants, which are
+  // collected once each; more than there are when it cannot be vectorized
+  int vector_plan(const Expr& body, Vector& vector) {
+    std::set<std::string> lets;
+    if (!vectorizable(body, vector, lets)) return vector_registers + 1;
+    std::vector<const Expr*> invariants;
+    for (auto invariant : vector.invariants) {
+      auto seen = std::find_if(invariants.begin(), invariants.end(), [&](auto other) { return same_invariant(*other, *invariant); });
+      if (seen == invariants.end()) invariants.push_back(invariant);
+    }
+    vector.invariants = invariants;
+    std::set<std::string> resident;
+    for (auto invariant : invariants) {
+      if (auto var = dynamic_cast<const VarExpr*>(invariant)) resident.insert(var->identifier);
+    }
+    return vector_need(body, resident) + invariants.size();
+  }
+
+  // emits a loop over the innermost axis that stores width elements at a
+  // time through the output pointer, for as long as that many are left; the
+  // scalar body that follows finishes the row, and row_end is where the
+  // innermost axis is done
+  bool vectorize(const ArrayLoopExpr& expr, const Expr& body, int counters, int output, const Reads& reads, const std::string& row_end) {
+    auto num_e = expr.axis.size();
+    if (opt == 0 || !output || (expr.hoisted.size() >= num_e && !expr.hoisted.back().empty())) return false;
+    Vector vector{vector_width, &expr.axis.back().first};
+    if (vector_registers - vector_plan(body, vector) < 0) return false;
+
+    flush();
+    auto width = vector.width;
+    auto counter = this->counter(expr.axis, counters, num_e - 1);
+    auto bound = [&]() { return "[rsp + " + std::to_string(stack.size - counters + (2 * num_e - 1) * 8) + "]"; };
+    print("; ", width, " elements at a time");
+    for (size_t k = 0; k < vector.invariants.size(); k++) {
+      broadcast(*vector.invariants[k], vector, vector_registers - 1 - k);
+    }
+    auto head = genlabel(), scalar = genlabel();
+    print(head, ":");
+    print("mov rax, ", counter);
+    print("add rax, ", width);
+    print("cmp rax, ", bound());
+    print("jg ", scalar);
+    vector_eval(body, vector, 0);
+    print("mov rax, [rsp + ", stack.size - output, "]");
+    print(width == 4 ? "vmovupd [rax], " : "movupd [rax], ", vreg(vector, 0));
+    print("add qword [rsp + ", stack.size - output, "], ", width * 8);
+    for (const auto& [read, _] : reads) {
+      if (cursors[read].shared) continue;
+      print("add qword [rsp + ", stack.size - cursors[read].position, "], ", width * 8);
+    }
+    print("add ", counter, ", ", width);
+    if (counter.rfind("qword", 0) == 0) {
+      print("mov rax, ", counter);
+      counter = "rax";
+    }
+    print("cmp ", counter, ", ", bound());
+    print("jl ", head);
+    if (width == 4) print("vzeroupper");
+    print("jmp ", row_end);
+    print(scalar, ":");
+    if (width == 4) print("vzeroupper");
+    return true;
+  }
+
+  // Sums over the innermost axis keep several packed accumulators, each
+  // adding its own width elements per iteration, so the adds do not wait on
+  // one another. The accumulators are folded into the sum once the row has
+  // fewer than accumulators * width elements left, and the scalar body
+  // finishes the row. Integer sums are always reassociated; float sums only
+  // when the reassociate flag allows their rounding to change.
+  bool vector_sum(const SumLoopExpr& expr, int counters, const Reads& reads, const std::string& row_end) {
+    auto num_e = expr.axis.size();
+    auto is_float = expr.type->is<Float>();
+    if (opt == 0 || (is_float && !reassociate) || (!is_float && !expr.type->is<Int>())) return false;
+    if (expr.hoisted.size() >= num_e && !expr.hoisted.back().empty()) return false;
+    Vector vector{vector_width, &expr.axis.back().first};
+    auto free = vector_registers - vector_plan(*expr.expr, vector);
+    if (free < 1) return false;
+    auto accumulators = std::min(free, max_accumulators);
+
+    flush();
+    auto width = vector.width;
+    auto wide = width == 4;
+    auto counter = this->counter(expr.axis, counters, num_e - 1);
+    auto bound = "[rsp + " + std::to_string(stack.size - counters + (2 * num_e - 1) * 8) + "]";
+    auto sum = "[rsp + " + std::to_string(stack.size - counters + 2 * num_e * 8) + "]";
+    auto apply = [&](const std::string& op, int dst, int src) {
+      if (wide) {
+        print("v", op, " ", vreg(vector, dst), ", ", vreg(vector, dst), ", ", vreg(vector, src));
+      } else {
+        print(op, " ", vreg(vector, dst), ", ", vreg(vector, src));
+      }
+    };
+    auto add = is_float ? "addpd" : "paddq";
+    print("; ", accumulators, " accumulators of ", width, " elements");
+    for (int k = 0; k < accumulators; k++) apply(is_float ? "xorpd" : "pxor", k, k);
+    for (size_t k = 0; k < vector.invariants.size(); k++) {
+      broadcast(*vector.invariants[k], vector, vector_registers - 1 - k);
+    }
+    auto head = genlabel(), fold = genlabel();
+    auto step = accumulators * width;
+    print(head, ":");
+    print("mov rax, ", counter);
+    print("add rax, ", step);
+    print("cmp rax, ", bound);
+    print("jg ", fold);
+    for (int k = 0; k < accumulators; k++) {
+      vector.offset = k * width * 8;
+      vector_eval(*expr.expr, vector, accumulators);
+      apply(add, k, accumulators);
+    }
+    for (const auto& [read, _] : reads) {
+      if (cursors[read].shared) continue;
+      print("add qword [rsp + ", stack.size - cursors[read].position, "], ", step * 8);
+    }
+    print("add ", counter, ", ", step);
+    print("jmp ", head);
+
+    print(fold, ":");
+    for (int span = 1; span < accumulators; span *= 2) {
+      for (int k = 0; k + span < accumulators; k += 2 * span) apply(add, k, k + span);
+    }
+    if (wide) {
+      print(is_float ? "vextractf128" : "vextracti128", " xmm1, ymm0, 1");
+      print(is_float ? "vaddpd" : "vpaddq", " xmm0, xmm0, xmm1");
+      print("vzeroupper");
+    }
+    print("pshufd xmm1, xmm0, 0x4e");
+    if (is_float) {
+      print("addsd xmm0, xmm1");
+      print("addsd xmm0, ", sum);
+      print("movsd ", sum, ", xmm0");
+    } else {
+      print("paddq xmm0, xmm1");
+      print("movq rax, xmm0");
+      print("add ", sum, ", rax");
+    }
+    if (counter.rfind("qword", 0) == 0) {
+      print("mov rax, ", counter);
+      counter = "rax";
+    }
+    print("cmp ", counter, ", ", bound);
+    print("jge ", row_end);
+    return true;
+  }
+
+  virtual void visit(const SumLoopExpr& expr) override {
+    print();
+    print("; begin sum loop expr");
+
+    // 1/4
+    auto num_e = expr.axis.size();
+    asm_alloc(expr.type);
+    for (int i = num_e - 1; i >= 0; i--) {
+      expr.axis[i].second->accept(*this);
+      // check bounds step-by-step
+      if (i >= (int)expr.bound_safe.size() || !expr.bound_safe[i]) {
+        print("mov rax, [rsp]");
+        print("cmp rax, 0");
+        asm_assert("jg", "non-positive loop bound");
+      }
+    }
+    // a struct sum (from fused loops) accumulates every field
+    auto sum_size = expr.type->size(ctx.get());
+    print("mov rax, 0 ; init sum");
+    for (int k = 0; k < sum_size; k += 8) {
+      print("mov [rsp + ", num_e * 8 + k, "], rax ; move to pre-alloc");
+    }
+    auto outer = stack.variables;  // loop variables may shadow outer names
+    for (int i = num_e - 1; i >= 0; i--) {
+      const auto& [identifier, e] = expr.axis[i];
+      print("mov rax, 0");
+      push("rax", Int::shared);
+      stack.add_lvalue(identifier);
+      bind(identifier, identifier);
+    }
+
+    // 2/4
+    auto counters = stack.size;
+    auto reads = strided_reads(expr.axis, *expr.expr, expr.hoisted);
+    auto labels = enter_axes(num_e, expr.hoisted, reads);
+    auto row_end = genlabel();
+    if (vector_sum(expr, counters, reads, row_end)) {
+      // the rest of the row repeats only the scalar body
+      labels.back() = genlabel();
+      print(labels.back(), ":");
+    } else {
+      row_end.clear();
+    }
+    expr.expr->accept(*this);
+    auto acc = stack.size - counters + 2 * num_e * 8;
+    if (cacheable(expr.expr->type)) {
+      // the body's value may still be in a register
+      acc -= 8;
+      if (expr.expr->type->is<Int>()) {
+        pop("rax");
+        print("add [rsp + ", acc, "], rax");
+      } else {
+        pop("xmm0");
+        print("addsd xmm0, [rsp + ", acc, "]");
+        print("movsd [rsp + ", acc, "], xmm0");
+      }
+    } else {
+      auto offset = 0;
+      for (const auto& type : field_types(expr.expr->type)) {
+        if (type->is<Int>()) {
+          print("mov rax, [rsp + ", offset, "]");
+          print("add [rsp + ", acc + offset, "], rax");
+        } else {
+          print("movsd xmm0, [rsp + ", offset, "]");
+          print("addsd xmm0, [rsp + ", acc + offset, "]");
+          print("movsd [rsp + ", acc + offset, "], xmm0");
+        }
+        offset += 8;
+      }
+      asm_free(expr.expr->type);
+    }
+
+    // 3/4
+    step(expr.axis, counters, labels, expr.hoisted, reads, 0, row_end);
+
+    // 4/4
+    asm_free(num_e, Int::shared);
+    asm_free(num_e, Int::shared);
+    stack.variables = outer;
+  }
+
+  virtual void visit(const LetExpr& expr) override {
+    if (opt > 0 && expr.value->type->is<Float>()) {
+      // float lets around a struct literal become part of its packed lanes
+      PackLets lets;
+      const Expr* body = &expr;
+      while (auto let = dynamic_cast<const LetExpr*>(body)) {
+        // only values built from what the lanes can hold, so none is dropped
+        if (!let->value->type->is<Float>() || !unify({let->value.get()}, lets)) break;
+        lets[let->identifier] = let->value.get();
+        body = let->body.get();
+      }
+      auto literal = dynamic_cast<const StructLiteralExpr*>(body);
+      if (literal && slp(*literal, lets)) return;
+    }
+    print("; let ", expr.identifier);
+    expr.value->accept(*this);
+    auto outer = stack.variables;
+    stack.add_lvalue(expr.identifier);
+    bind(expr.identifier, expr.identifier);
+    expr.body->accept(*this);
+    stack.variables = outer;
+
+    if (cacheable(expr.body->type)) {
+      auto reg = expr.body->type->is<Float>() ? "xmm0" : "rax";
+      pop(reg);
+      asm_free(expr.value->type);
+      push(reg, expr.body->type);
+      return;
+    }
+    // slide the body's value down over the binding
+    auto size = expr.body->type->size(ctx.get());
+    auto binding_size = expr.value->type->size(ctx.get());
+    copy(size, "rsp", "rsp + " + std::to_string(binding_size));
+    print("add rsp, ", binding_size, " ; free let ", expr.identifier);
+    auto type = stack.pop();
+    stack.pop();
+    stack.push(type);
+  }
+
+  virtual void visit(const ShowCmd& cmd) override {
+    auto type = cmd.expr->type;
+    align(type->size(ctx.get()) + 8);  // call pushes return address
+    ASTVisitor::visit(cmd);
+    read_const("rdi", type->show_type(ctx.get()));
+    print("lea rsi, [rsp]");
+    print("call _show");
+    // free self.stack by sizeof EXPR_TYPE
+    print("add rsp, ", type->size(ctx.get()), " ; free stack by sizeof expr");
+    // stack.size -= type->size();
+    stack.pop();
+    unalign();
+  }
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    print();
+    print("; begin array loop expr");
+
+    // 1/4
+    auto num_e = expr.axis.size();
+    asm_alloc(Int::shared);
+    for (int i = num_e - 1; i >= 0; i--) {
+      expr.axis[i].second->accept(*this);
+      // check bounds step-by-step
+      if (i >= (int)expr.bound_safe.size() || !expr.bound_safe[i]) {
+        print("mov rax, [rsp]");
+        print("cmp rax, 0");
+        asm_assert("jg", "non-positive loop bound");
+      }
+    }
+    if (expr.frame >= 0) {
+      // constant bounds, small enough for the frame
+      print("lea rax, [rbp - ", frame_arrays - expr.frame, "] ; in the frame");
+    } else {
+      print("mov rdi, ", expr.expr->type->size(ctx.get()));
+      for (int i = 0; i < (int)num_e; i++) {
+        print("imul rdi, [rsp + ", i * 8, "]");
+        if (!expr.size_safe) {
+          asm_assert("jno", "overflow computing array size");
+        }
+      }
+      align(8);
+      print("call _jpl_alloc");
+      unalign();
+    }
+    print("mov [rsp + ", num_e * 8, "], rax ; move to pre-alloc");
+    auto outer = stack.variables;  // loop variables may shadow outer names
+    for (int i = num_e - 1; i >= 0; i--) {
+      const auto& [identifier, e] = expr.axis[i];
+      print("mov rax, 0");
+      push("rax", Int::shared);
+      stack.add_lvalue(identifier);
+      bind(identifier, identifier);
+    }
+
+    auto counters = stack.size;
+    // a tiled loop runs the inner axis from the start of a strip to the end
+    // kept in its bound's slot, with the number of columns saved below
+    auto tile = opt > 0 && num_e == 2 ? expr.tile : 0;
+    auto bound = [&](int i) { return stack.size - counters + (num_e + i) * 8; };
+    int columns = 0, strip = 0;
+    if (tile) {
+      print("mov rax, [rsp + ", bound(1), "]");
+      push("rax", Int::shared, "columns");
+      columns = stack.size;
+      print("mov rax, 0");
+      push("rax", Int::shared, "strip start");
+      strip = stack.size;
+      strip_end(tile, bound(1), columns);
+    }
+    // the element goes through a running pointer at -O1, unless the axes
+    // were reordered and it is no longer stored in order
+    auto in_order = expr.dims.empty();
+    int output = 0;
+    if (opt > 0 && in_order) {
+      print("mov rax, [rsp + ", stack.size - counters + 2 * num_e * 8, "]");
+      push("rax", Int::shared, "output pointer");
+      output = stack.size;
+    }
+    // a split loop runs the border first, then the interior in the bound
+    // slots, with the extents of the array saved below the cut: the column
+    // where a row of the border jumps over the interior, or -1
+    auto split = output && !tile && expr.interior;
+    int extents = 0, cut = 0;
+    auto extent = [&](int i) { return stack.size - extents + i * 8; };
+    if (split) {
+      for (int i = num_e - 1; i >= 0; i--) {
+        print("mov rax, [rsp + ", bound(i), "]");
+        push("rax", Int::shared, "extent");
+      }
+      extents = stack.size;
+      print("mov rax, -1");
+      push("rax", Int::shared, "cut");
+      cut = stack.size;
+    }
+
+    // 2/4
+    auto reads = strided_reads(expr.axis, *expr.expr, expr.hoisted);
+    std::function<void()> row_start = nullptr;
+    if (tile) {
+      // rows of a strip are not contiguous in the output
+      row_start = [&]() {
+        auto reg = registers.of(&expr.axis[0].first);
+        print("mov rax, ", reg ? *reg : "[rsp + " + std::to_string(stack.size - counters) + "]");
+        print("imul rax, [rsp + ", stack.size - columns, "]");
+        print("add rax, [rsp + ", stack.size - strip, "]");
+        print("imul rax, ", expr.expr->type->size(ctx.get()));
+        print("add rax, [rsp + ", stack.size - counters + 2 * num_e * 8, "]");
+        print("mov [rsp + ", stack.size - output, "], rax");
+      };
+    }
+    if (split) {
+      // only rows between the margins of the outer axis have an interior
+      row_start = [&]() {
+        auto border = genlabel();
+        auto [low, high] = expr.margins.back();
+        print("mov qword [rsp + ", stack.size - cut, "], -1");
+        if (num_e == 2) {
+          auto row = counter(expr.axis, counters, 0);
+          print("cmp ", row, ", ", expr.margins[0].first);
+          print("jl ", border);
+          print("mov rax, [rsp + ", extent(0), "]");
+          print("sub rax, ", expr.margins[0].second);
+          print("cmp ", row, ", rax");
+          print("jge ", border);
+        }
+        print("mov rax, [rsp + ", extent(num_e - 1), "]");
+        print("sub rax, ", high);
+        print("cmp rax, ", low);
+        print("jle ", border);
+        print("mov qword [rsp + ", stack.size - cut, "], ", low);
+        print(border, ":");
+      };
+      if (num_e == 1) row_start();
+    }
+    auto labels = enter_axes(num_e, expr.hoisted, reads, row_start);
+    auto row_end = genlabel();
+    if (split) {
+      skip_interior(expr, counters, output, extents, cut, reads, row_end);
+    } else if (!vectorize(expr, *expr.expr, counters, output, reads, row_end)) {
+      row_end.clear();
+    }
+    expr.expr->accept(*this);
+    auto offset = expr.expr->type->size(ctx.get());
+
+    auto store = [&]() {
+      if (output && cacheable(expr.expr->type)) {
+        auto reg = expr.expr->type->is<Float>() ? "xmm0" : "r10";
+        pop(reg);
+        print("mov rax, [rsp + ", stack.size - output, "]");
+        print(expr.expr->type->is<Float>() ? "movsd" : "mov", " [rax], ", reg);
+        print("add qword [rsp + ", stack.size - output, "], ", offset);
+      } else if (output) {
+        print("mov rax, [rsp + ", stack.size - output, "]");
+        copy(offset, "rsp", "rax");
+        asm_free(expr.expr->type);
+        print("add qword [rsp + ", stack.size - output, "], ", offset);
+      } else {
+        // generate index for result
+        auto base = stack.size - counters;
+        print("mov rax, 0");
+        for (int d = 0; d < (int)num_e; d++) {
+          auto i = in_order ? d : axis_of(expr.dims, d);
+          print("imul rax, [rsp + ", base + (num_e + i) * 8, "]");
+          print("add rax, ", counter(expr.axis, counters, i));
+        }
+        print("imul rax, ", offset, ";here??2");
+        print("add rax, [rsp + ", base + 2 * num_e * 8, "]");
+        copy(offset, "rsp", "rax");
+        asm_free(expr.expr->type);
+      }
+    };
+    store();
+
+    // 3/4
+    step(expr.axis, counters, labels, expr.hoisted, reads, strip, row_end);
+    if (tile) {
+      // the next strip starts where this one ended, from the first row
+      auto done = genlabel();
+      print("mov rax, [rsp + ", bound(1), "]");
+      print("cmp rax, [rsp + ", stack.size - columns, "]");
+      print("jge ", done);
+      print("mov [rsp + ", stack.size - strip, "], rax");
+      strip_end(tile, bound(1), columns);
+      print("mov ", counter(expr.axis, counters, 0), ", 0");
+      print("mov rax, [rsp + ", stack.size - strip, "]");
+      print("mov ", counter(expr.axis, counters, 1), ", rax");
+      print("jmp ", labels[0]);
+      print(done, ":");
+      print("mov rax, [rsp + ", stack.size - columns, "]");
+      print("mov [rsp + ", bound(1), "], rax");
+    }
+    if (split) {
+      // the interior runs from the margins to the bounds it is given, and
+      // each of its rows starts at an offset into the output
+      auto done = genlabel();
+      for (int i = 0; i < (int)num_e; i++) {
+        auto [low, high] = expr.margins[i];
+        print("mov rax, [rsp + ", extent(i), "]");
+        print("sub rax, ", high);
+        print("cmp rax, ", low);
+        print("jle ", done);
+        print("mov [rsp + ", bound(i), "], rax");
+        print("mov ", counter(expr.axis, counters, i), ", ", low);
+      }
+      print("mov qword [rsp + ", stack.size - cut, "], ", expr.margins.back().first);
+      row_start = [&]() {
+        print("mov rax, ", counter(expr.axis, counters, 0));
+        if (num_e == 2) {
+          print("imul rax, [rsp + ", extent(1), "]");
+          print("add rax, ", counter(expr.axis, counters, 1));
+        }
+        print("imul rax, ", offset);
+        print("add rax, [rsp + ", stack.size - counters + 2 * num_e * 8, "]");
+        print("mov [rsp + ", stack.size - output, "], rax");
+      };
+      if (num_e == 1) row_start();
+      auto inner_reads = strided_reads(expr.axis, *expr.interior, expr.hoisted);
+      auto inner_labels = enter_axes(num_e, expr.hoisted, inner_reads, row_start);
+      auto inner_end = genlabel();
+      if (!vectorize(expr, *expr.interior, counters, output, inner_reads, inner_end)) inner_end.clear();
+      expr.interior->accept(*this);
+      store();
+      step(expr.axis, counters, inner_labels, expr.hoisted, inner_reads, cut, inner_end);
+      print(done, ":");
+      for (int i = 0; i < (int)num_e; i++) {
+        print("mov rax, [rsp + ", extent(i), "]");
+        print("mov [rsp + ", bound(i), "], rax");
+      }
+    }
+
+    // 4/4
+    if (split) {
+      asm_free(num_e + 1, Int::shared);
+    }
+    if (output) {
+      asm_free(Int::shared);
+    }
+    if (tile) {
+      asm_free(2, Int::shared);
+    }
+    if (!in_order) {
+      // put the bounds in dimension order, through the spent counters
+      for (int d = 0; d < (int)num_e; d++) {
+        print("mov rax, [rsp + ", bound(axis_of(expr.dims, d)), "]");
+        print("mov [rsp + ", stack.size - counters + d * 8, "], rax");
+      }
+      copy(num_e * 8, "rsp + " + std::to_string(stack.size - counters), "rsp + " + std::to_string(bound(0)));
+    }
+    asm_free(num_e, Int::shared);
+    stack.recharacterize(num_e + 1, expr.type);
+    stack.variables = outer;
+  }
+
+  // where a row of the border reaches the cut, it jumps over the interior:
+  // the output and the running pointers move to the high margin, or the
+  // row ends there
+  void skip_interior(const ArrayLoopExpr& expr, int counters, int output, int extents, int cut, const Reads& reads,
+                     const std::string& row_end) {
+    auto num_e = expr.axis.size();
+    auto column = counter(expr.axis, counters, num_e - 1);
+    auto body = genlabel();
+    print("mov rax, ", column);
+    print("cmp rax, [rsp + ", stack.size - cut, "]");
+    print("jne ", body);
+    print("mov r10, [rsp + ", stack.size - extents + (num_e - 1) * 8, "]");
+    print("sub r10, ", expr.margins.back().second);
+    print("mov ", column, ", r10");
+    print("sub r10, rax");
+    print("imul r10, ", expr.expr->type->size(ctx.get()));
+    print("add [rsp + ", stack.size - output, "], r10");
+    close_cursors(reads);
+    open_cursors(reads);
+    print("mov rax, ", column);
+    print("cmp rax, [rsp + ", stack.size - counters + (2 * num_e - 1) * 8, "]");
+    print("jge ", row_end);
+    print(body, ":");
+  }
+
+  // the axis that runs over dimension d of a reordered array loop
+  static int axis_of(const std::vector<size_t>& dims, size_t d) {
+    return std::find(dims.begin(), dims.end(), d) - dims.begin();
+  }
+
+  // sets the end of the strip starting at the value in rax, clamped to the
+  // number of columns
+  void strip_end(int64_t tile, int end, int columns) {
+    print("add rax, ", tile);
+    print("cmp rax, [rsp + ", stack.size - columns, "]");
+    print("cmovg rax, [rsp + ", stack.size - columns, "]");
+    print("mov [rsp + ", end, "], rax");
+  }
+
+  virtual void visit(const AssertCmd& cmd) override {
+    ASTVisitor::visit(cmd);
+    pop("rax");
+    print("cmp rax, 0");
+    asm_assert("jne", cmd.string);
+  }
+
+  virtual void visit(const AssertStmt& stmt) override {
+    ASTVisitor::visit(stmt);
+    pop("rax");
+    print("cmp rax, 0");
+    asm_assert("jne", stmt.string);
+  }
+
+  virtual void visit(const ReadCmd& cmd) override {
+    auto rgba = std::make_shared<Struct>("rgba");
+    auto type = std::make_shared<Array>(rgba, 2);
     print("; rgba size ", type->size(ctx.get()));
     asm_alloc(type);
     print("lea rdi, [rsp]");
@@ -991,13 +2197,28 @@ class ASMGenVisitor : public ASTVisitor {
   virtual void visit(const WriteCmd& cmd) override {
     auto rgba = std::make_shared<Struct>("rgba");
     auto type = std::make_shared<Array>(rgba, 2);
-    stack.align(type->size(ctx.get()));
+    align(type->size(ctx.get()) + 8);  // call pushes return address
     cmd.expr->accept(*this);
-    ASTVisitor::visit(cmd);
     read_const("rdi", cmd.stripped_string());
     print("call _write_image");
     asm_free(cmd.expr->type);
-    stack.unalign();
+    unalign();
+  }
+
+  virtual void visit(const TimeCmd& cmd) override {
+    align(8);
+    print("call _get_time");
+    unalign();
+    // the start time stays below any binding the command makes
+    push_memory("xmm0", Float::shared);
+    auto start = stack.size;
+    stack.local_var_size += 8;
+    cmd.cmd->accept(*this);
+    align(8);
+    print("call _get_time");
+    print("subsd xmm0, [rsp + ", stack.size - start, "]");
+    print("call _print_time");
+    unalign();
   }
 
   virtual void visit(const PrintCmd& cmd) override {
@@ -1011,41 +2232,481 @@ class ASMGenVisitor : public ASTVisitor {
     push_const(1, Void::shared);
   }
 
+  // Superword-level parallelism for struct literals of floats, like rgba.
+  // The fields' expressions are unified lane by lane into one tree whose
+  // nodes are the same arithmetic op in every lane, or a min or max from
+  // if x > c then c else x. The leaves, constants, fields of struct
+  // variables and float variables, are loaded as one packed value: a
+  // constant from the data section, a run of fields in one move, or lanes
+  // gathered one by one. Lanes whose field is a leaf while the others are
+  // not are left out of the tree and blended in at the end. Float lets
+  // enclosing the literal are folded into the tree. The lanes are computed
+  // four at a time in ymm registers with AVX2, two at a time otherwise.
+  struct Pack {
+    // "" for a leaf, an arithmetic op, "min" or "max"
+    std::string op;
+    // the leaf of each lane, or nullptr where the lane is unused
+    std::vector<const Expr*> lanes;
+    std::unique_ptr<Pack> left, right;
+  };
+
+  typedef std::map<std::string, const Expr*> PackLets;
+
+  static const Expr* pack_resolve(const Expr* expr, const PackLets& lets) {
+    while (auto var = dynamic_cast<const VarExpr*>(expr)) {
+      auto it = lets.find(var->identifier);
+      if (it == lets.end()) break;
+      expr = it->second;
+    }
+    return expr;
+  }
+
+  static bool pack_leaf(const Expr& expr) {
+    if (!expr.type || !expr.type->is<Float>()) return false;
+    if (dynamic_cast<const FloatExpr*>(&expr) || dynamic_cast<const VarExpr*>(&expr)) return true;
+    auto dot = dynamic_cast<const DotExpr*>(&expr);
+    return dot && dynamic_cast<const VarExpr*>(dot->expr.get());
+  }
+
+  static bool same_leaf(const Expr& a, const Expr& b) {
+    if (auto x = dynamic_cast<const DotExpr*>(&a)) {
+      auto y = dynamic_cast<const DotExpr*>(&b);
+      return y && x->field == y->field && same_invariant(*x->expr, *y->expr);
+    }
+    return same_invariant(a, b);
+  }
+
+  // the condition of if P < Q then P else Q, as "min", or then Q else P, as
+  // "max", which minpd and maxpd compute exactly
+  static std::optional<std::string> min_max(const IfExpr& expr, const Expr*& first, const Expr*& second) {
+    auto cond = dynamic_cast<const BinopExpr*>(expr.condition.get());
+    if (!cond || (cond->op != "<" && cond->op != ">") || !cond->left->type->is<Float>()) return std::nullopt;
+    auto p = cond->op == "<" ? cond->left.get() : cond->right.get();
+    auto q = cond->op == "<" ? cond->right.get() : cond->left.get();
+    if (!pack_leaf(*p) || !pack_leaf(*q)) return std::nullopt;
+    if (same_leaf(*expr.if_expr, *p) && same_leaf(*expr.else_expr, *q)) {
+      first = p, second = q;
+      return "min";
+    }
+    if (same_leaf(*expr.if_expr, *q) && same_leaf(*expr.else_expr, *p)) {
+      first = q, second = p;
+      return "max";
+    }
+    return std::nullopt;
+  }
+
+  std::unique_ptr<Pack> unify(std::vector<const Expr*> lanes, const PackLets& lets) {
+    auto pack = std::make_unique<Pack>();
+    std::vector<const Expr*> lefts(lanes.size()), rights(lanes.size());
+    bool first = true;
+    for (size_t k = 0; k < lanes.size(); k++) {
+      if (!lanes[k]) continue;
+      auto lane = lanes[k] = pack_resolve(lanes[k], lets);
+      std::string op;
+      if (pack_leaf(*lane)) {
+        op = "";
+      } else if (auto binop = dynamic_cast<const BinopExpr*>(lane)) {
+        if (!binop->type->is<Float>() || std::string("+-*/").find(binop->op) == std::string::npos) return nullptr;
+        op = binop->op;
+        lefts[k] = binop->left.get(), rights[k] = binop->right.get();
+      } else if (auto branch = dynamic_cast<const IfExpr*>(lane)) {
+        auto kind = min_max(*branch, lefts[k], rights[k]);
+        if (!kind) return nullptr;
+        op = *kind;
+      } else {
+        return nullptr;
+      }
+      if (!first && op != pack->op) return nullptr;
+      pack->op = op;
+      first = false;
+    }
+    if (pack->op.empty()) {
+      pack->lanes = lanes;
+      return pack;
+    }
+    pack->left = unify(lefts, lets);
+    pack->right = unify(rights, lets);
+    if (!pack->left || !pack->right) return nullptr;
+    return pack;
+  }
+
+  struct Slice {
+    size_t first, count;
+    bool vex;
+  };
+
+  std::string pack_reg(const Slice& slice, int n) {
+    return (slice.count == 4 ? "ymm" : "xmm") + std::to_string(n);
+  }
+
+  // the operand reading one lane's leaf
+  std::string lane_source(const Expr& leaf) {
+    if (auto constant = dynamic_cast<const FloatExpr*>(&leaf)) {
+      return "qword [rel " + const_map[constant->value] + "]";
+    }
+    if (auto var = dynamic_cast<const VarExpr*>(&leaf)) {
+      if (auto reg = registers.of(*var)) return *reg;
+      return "qword " + frame_slot(var->identifier, 0);
+    }
+    auto& dot = static_cast<const DotExpr&>(leaf);
+    auto& var = static_cast<const VarExpr&>(*dot.expr);
+    return "qword " + frame_slot(var.identifier, field_offset(*var.type->as<Struct>(), dot.field));
+  }
+
+  std::string frame_slot(const std::string& identifier, int offset) {
+    auto displacement = offset - stack.variables[identifier];
+    return displacement < 0 ? "[rbp - " + std::to_string(-displacement) + "]" : "[rbp + " + std::to_string(displacement) + "]";
+  }
+
+  int field_offset(const Struct& type, const std::string& field) {
+    auto offset = 0;
+    auto info = ctx->lookup<StructInfo>(type.name);
+    for (const auto& [name, field_type] : info->fields) {
+      if (name == field) break;
+      offset += field_type->size(ctx.get());
+    }
+    return offset;
+  }
+
+  // the memory operand of a leaf all of whose lanes are constants, laid
+  // out in the data section
+  std::optional<std::string> packed_constant(const Pack& pack, const Slice& slice) {
+    if (!pack.op.empty()) return std::nullopt;
+    std::vector<double> values;
+    for (size_t k = slice.first; k < slice.first + slice.count; k++) {
+      auto constant = dynamic_cast<const FloatExpr*>(pack.lanes[k]);
+      if (pack.lanes[k] && !constant) return std::nullopt;
+      values.push_back(constant ? constant->value : 0.0);
+    }
+    for (const auto& [label, existing] : packed_constants) {
+      if (existing == values) return "[rel " + label + "]";
+    }
+    auto label = "vconst" + std::to_string(packed_constants.size());
+    packed_constants.emplace_back(label, values);
+    return "[rel " + label + "]";
+  }
+
+  // the registers loading a leaf into register n takes
+  int leaf_need(const Pack& pack, const Slice& slice) {
+    return slice.vex ? 2 : 1;
+  }
+
+  int pack_need(const Pack& pack, const Slice& slice) {
+    if (pack.op.empty()) return leaf_need(pack, slice);
+    auto left = pack_need(*pack.left, slice);
+    auto right = packed_constant(*pack.right, slice) ? 0 : pack_need(*pack.right, slice);
+    if ((pack.op == "+" || pack.op == "*") && right > left) return std::max(right, 1 + left);
+    return std::max(left, 1 + right);
+  }
+
+  // whether a commutative operation computes its deeper right operand
+  // first, as in the t2 + (t1 + t0) of an unrolled sum
+  bool pack_swapped(const Pack& pack, const Slice& slice) {
+    if (pack.op != "+" && pack.op != "*") return false;
+    if (packed_constant(*pack.right, slice)) return false;
+    return pack_need(*pack.right, slice) > pack_need(*pack.left, slice);
+  }
+
+  void load_leaf(const Pack& pack, const Slice& slice, int n) {
+    auto dst = pack_reg(slice, n);
+    auto v = slice.vex ? "v" : "";
+    std::vector<const Expr*> active;
+    for (size_t k = slice.first; k < slice.first + slice.count; k++) {
+      if (pack.lanes[k]) active.push_back(pack.lanes[k]);
+    }
+    if (active.empty()) return;
+    if (auto constant = packed_constant(pack, slice)) {
+      print(v, "movapd ", dst, ", ", *constant);
+      return;
+    }
+    // every lane the same value
+    if (std::all_of(active.begin(), active.end(), [&](auto leaf) { return same_leaf(*leaf, *active[0]); })) {
+      auto source = lane_source(*active[0]);
+      if (slice.vex) {
+        print("vbroadcastsd ", dst, ", ", source);
+      } else {
+        print(xmm(source) ? "movapd " : "movsd ", dst, ", ", source);
+        print("unpcklpd ", dst, ", ", dst);
+      }
+      return;
+    }
+    // consecutive fields of one struct, in lane order
+    if (auto run = field_run(pack, slice)) {
+      if (slice.vex) {
+        // by halves, as struct copies store them, so the loads forward
+        auto upper = run->substr(0, run->size() - 1) + " + 16]";
+        print("vmovupd xmm", n, ", ", *run);
+        print("vinsertf128 ", dst, ", ", dst, ", ", upper, ", 1");
+      } else {
+        print("movupd ", dst, ", ", *run);
+      }
+      return;
+    }
+    // gathered a lane at a time, by halves
+    for (size_t half = 0; half < slice.count / 2; half++) {
+      auto reg = "xmm" + std::to_string(n + half);
+      auto lane = [&](size_t k) {
+        auto leaf = pack.lanes[slice.first + 2 * half + k];
+        return leaf ? leaf : active[0];
+      };
+      auto low = lane_source(*lane(0)), high = lane_source(*lane(1));
+      if (xmm(low)) {
+        print(v, "movapd ", reg, ", ", low);
+      } else {
+        print(v, "movsd ", reg, ", ", low);
+      }
+      if (xmm(high)) {
+        print(slice.vex ? "vunpcklpd " + reg + ", " + reg : "unpcklpd " + reg, ", ", high);
+      } else {
+        print(slice.vex ? "vmovhpd " + reg + ", " + reg : "movhpd " + reg, ", ", high);
+      }
+    }
+    if (slice.count == 4) {
+      print("vinsertf128 ", dst, ", ", dst, ", xmm", n + 1, ", 1");
+    }
+  }
+
+  // the memory operand covering the slice when its lanes are fields of one
+  // struct variable at consecutive offsets
+  std::optional<std::string> field_run(const Pack& pack, const Slice& slice) {
+    const VarExpr* base = nullptr;
+    std::optional<int> start;
+    for (size_t k = slice.first; k < slice.first + slice.count; k++) {
+      if (!pack.lanes[k]) continue;
+      auto dot = dynamic_cast<const DotExpr*>(pack.lanes[k]);
+      if (!dot) return std::nullopt;
+      auto var = static_cast<const VarExpr*>(dot->expr.get());
+      if (base && base->identifier != var->identifier) return std::nullopt;
+      base = var;
+      auto offset = field_offset(*var->type->as<Struct>(), dot->field) - 8 * (int)(k - slice.first);
+      if (start && *start != offset) return std::nullopt;
+      start = offset;
+    }
+    auto size = base->type->size(ctx.get());
+    if (*start < 0 || *start + 8 * (int)slice.count > size) return std::nullopt;
+    return frame_slot(base->identifier, *start);
+  }
+
+  // evaluates a pack over a slice of its lanes into register n
+  void pack_eval(const Pack& pack, const Slice& slice, int n) {
+    if (pack.op.empty()) {
+      load_leaf(pack, slice, n);
+      return;
+    }
+    static const std::map<std::string, std::string> ops = {{"+", "addpd"}, {"-", "subpd"}, {"*", "mulpd"}, {"/", "divpd"}, {"min", "minpd"}, {"max", "maxpd"}};
+    auto first = pack.left.get(), second = pack.right.get();
+    if (pack_swapped(pack, slice)) std::swap(first, second);
+    pack_eval(*first, slice, n);
+    auto source = packed_constant(*second, slice);
+    if (!source) {
+      pack_eval(*second, slice, n + 1);
+      source = pack_reg(slice, n + 1);
+    }
+    auto dst = pack_reg(slice, n);
+    if (slice.vex) {
+      print("v", ops.at(pack.op), " ", dst, ", ", dst, ", ", *source);
+    } else {
+      print(ops.at(pack.op), " ", dst, ", ", *source);
+    }
+  }
+
+  // computes a struct literal of floats with packed operations and pushes
+  // it, if its lanes unify
+  bool slp(const StructLiteralExpr& expr, const PackLets& lets) {
+    auto lanes_count = expr.fields.size();
+    std::vector<const Expr*> lanes;
+    for (const auto& field : expr.fields) {
+      if (!field->type->is<Float>()) return false;
+      lanes.push_back(field.get());
+    }
+    if (lanes_count % 2) return false;
+    auto root = unify(lanes, lets);
+    // leaf lanes among computed ones are blended in afterwards
+    std::unique_ptr<Pack> fixed;
+    if (!root) {
+      fixed = std::make_unique<Pack>();
+      fixed->lanes.resize(lanes_count);
+      for (size_t k = 0; k < lanes_count; k++) {
+        auto lane = pack_resolve(lanes[k], lets);
+        if (pack_leaf(*lane)) {
+          fixed->lanes[k] = lane;
+          lanes[k] = nullptr;
+        }
+      }
+      root = unify(lanes, lets);
+      if (!root) return false;
+    }
+    auto width = vector_width == 4 && lanes_count % 4 == 0 ? 4 : 2;
+    std::vector<Slice> slices;
+    for (size_t first = 0; first < lanes_count; first += width) {
+      slices.push_back({first, (size_t)width, width == 4});
+    }
+    for (size_t k = 0; k < slices.size(); k++) {
+      auto need = std::max(pack_need(*root, slices[k]), fixed ? 1 + leaf_need(*fixed, slices[k]) : 0);
+      if ((int)k + need > vector_registers) return false;
+    }
+
+    flush();
+    print("; packed ", expr.type->to_string(), ", ", width, " lanes at a time");
+    for (size_t k = 0; k < slices.size(); k++) {
+      auto& slice = slices[k];
+      pack_eval(*root, slice, k);
+      if (fixed) blend(*fixed, slice, k);
+    }
+    asm_alloc(expr.type);
+    for (size_t k = 0; k < slices.size(); k++) {
+      auto& slice = slices[k];
+      print(slice.vex ? "vmovupd" : "movupd", " [rsp + ", slice.first * 8, "], ", pack_reg(slice, k));
+    }
+    if (width == 4) print("vzeroupper");
+    return true;
+  }
+
+  // replaces the lanes of register n that are fixed leaves
+  void blend(const Pack& fixed, const Slice& slice, int n) {
+    int mask = 0;
+    for (size_t k = 0; k < slice.count; k++) {
+      if (fixed.lanes[slice.first + k]) mask |= 1 << k;
+    }
+    if (!mask) return;
+    load_leaf(fixed, slice, n + 1);
+    auto dst = pack_reg(slice, n), src = pack_reg(slice, n + 1);
+    if (slice.vex) {
+      print("vblendpd ", dst, ", ", dst, ", ", src, ", ", mask);
+    } else if (mask == 3) {
+      print("movapd ", dst, ", ", src);
+    } else if (mask == 1) {
+      print("movsd ", dst, ", ", src);
+    } else {
+      print("shufpd ", dst, ", ", src, ", 2");
+    }
+  }
+
   virtual void visit(const StructLiteralExpr& expr) override {
-    ASTVisitor::visit(expr);
+    if (opt > 0 && slp(expr, {})) return;
+    // in reverse, so the first field ends up at the lowest address like in memory
+    for (int i = expr.fields.size() - 1; i >= 0; i--) {
+      expr.fields[i]->accept(*this);
+    }
     stack.recharacterize(expr.fields.size(), expr.type);
   }
 
   virtual void visit(const DotExpr& expr) override {
+    auto start = field_offset(*expr.expr->type->as<Struct>(), expr.field);
+    // a field of a variable or of an array element, through any number of
+    // nested structs, is read on its own rather than with the whole struct
+    const Expr* base = expr.expr.get();
+    auto offset = start;
+    while (auto dot = dynamic_cast<const DotExpr*>(base)) {
+      offset += field_offset(*dot->expr->type->as<Struct>(), dot->field);
+      base = dot->expr.get();
+    }
+    if (auto read = dynamic_cast<const ArrayIndexExpr*>(base); opt > 0 && read) {
+      read_element(*read, offset, expr.type);
+      return;
+    }
+    if (auto var = dynamic_cast<const VarExpr*>(base); opt > 0 && var && !registers.of(*var)) {
+      if (cacheable(expr.type)) {
+        auto reg = cache_slot(expr.type->is<Float>());
+        emit(xmm(reg) ? "movsd " : "mov ", reg, ", ", frame_slot(var->identifier, offset), " ; ", var->identifier, ".", expr.field);
+        cached.push_back({reg});
+        stack.push(expr.type);
+        return;
+      }
+      auto size = expr.type->size(ctx.get());
+      stack.shadow.push(expr.type);
+      stack.size += size;
+      print("sub rsp, ", size);
+      for (int i = size - 8; i >= 0; i -= 8) {
+        print("mov r10, ", frame_slot(var->identifier, offset + i));
+        print("mov [rsp + ", i, "], r10");
+      }
+      return;
+    }
     ASTVisitor::visit(expr);
-    auto start = 0;  // TODO: calc offset
-    // for (auto field : ctx->lookup<StructInfo>(expr.symbol)->fields) {
-    //   if (field.first == expr.field) break;
-    //   start += field.second->size(ctx.get());
-    // }
     auto size = expr.type->size(ctx.get());
     auto end = expr.expr->type->size(ctx.get()) - size;
-    copy(size, "rsp + " + start, "rsp + " + end);
+    copy(size, "rsp + " + std::to_string(start), "rsp + " + std::to_string(end));
     print("add rsp, ", end);
-    stack.recharacterize(1, expr.type);
-    // stack.decrement(end);
-    // asm_free(end);
+    stack.pop();
+    stack.push(expr.type);
   }
 
  private:
   int jump_ctr = 0;
   int opt = 0;
+  // elements per packed register: 2 with SSE2, 4 with AVX2
+  int vector_width = 2;
+  // whether float sums may be added in another order than written
+  bool reassociate = false;
+  // packed constants, emitted after the code
+  std::vector<std::pair<std::string, std::vector<double>>> packed_constants;
   const std::shared_ptr<Context> ctx;
   const Logger& logger;
   ASMDataVisitor data_visitor;
   ASMFnVisitor fn_visitor;
   std::map<asmval, std::string> const_map;
   Stack stack;
+  std::map<const ArrayIndexExpr*, Cursor> cursors;
+  // reads sharing another read's running pointer, at a displacement
+  std::map<const ArrayIndexExpr*, std::pair<const ArrayIndexExpr*, int64_t>> anchors;
+  RegisterAllocator registers;
+  // where the frame's arrays start, below rbp
+  int frame_arrays = 0;
 
   std::string genlabel() {
     return ".jump" + std::to_string(++jump_ctr);
   }
 
+  // loads a binding just added to the stack into its register, if it has one
+  void bind(const std::string& binding, const std::string& name) {
+    flush();
+    if (auto reg = registers.of(&binding)) {
+      auto slot = stack.variables[name];
+      print(reg->rfind("xmm", 0) == 0 ? "movsd " : "mov ", *reg, ", [rbp - ", slot, "] ; ", name);
+    }
+  }
+
+  // callee-saved registers are kept below rbp for the frame's lifetime
+  std::vector<std::pair<std::string, int>> save_registers() {
+    std::vector<std::pair<std::string, int>> saved;
+    for (const auto& reg : registers.saved()) {
+      push_memory(reg, Int::shared, "callee-saved");
+      saved.emplace_back(reg, stack.size - 8);
+    }
+    return saved;
+  }
+
+  // arrays that do not outlive their let are kept below the saved
+  // registers, 16-byte aligned like rbp
+  void reserve_frame(int64_t size) {
+    if (!size) return;
+    size += (16 - (stack.size - 8 + size) % 16) % 16;
+    print("sub rsp, ", size, " ; arrays in the frame");
+    stack.size += size;
+    stack.local_var_size += size;
+    frame_arrays = stack.size - 8;
+  }
+
+  void restore_registers(const std::vector<std::pair<std::string, int>>& saved) {
+    for (const auto& [reg, slot] : saved) {
+      print("mov ", reg, ", [rbp - ", slot, "]");
+    }
+  }
+
+  // the scalar fields of a struct, or the type itself for a scalar
+  std::vector<std::shared_ptr<ResolvedType>> field_types(std::shared_ptr<ResolvedType> type) {
+    if (auto st = type->as<Struct>()) {
+      std::vector<std::shared_ptr<ResolvedType>> types;
+      auto info = ctx->lookup<StructInfo>(st->name);
+      for (const auto& [field, field_type] : info->fields) {
+        types.push_back(field_type);
+      }
+      return types;
+    }
+    return {type};
+  }
+
   int log_2(int64_t x) {
     if (x > 0 && (x & (x - 1)) == 0) {
       return (int64_t)log2(x);
@@ -1055,11 +2716,178 @@ class ASMGenVisitor : public ASTVisitor {
 
   template <typename... Args>
   void print(Args&&... args) {
+    std::ostringstream line;
+    (line << ... << args);
+    auto text = line.str();
+    if (!cached.empty() && disturbs(text)) flush();
+    if (!cached.empty()) text = relocate(text);
+    emit(text);
+  }
+
+  template <typename... Args>
+  void emit(Args&&... args) {
     std::cout << "    ";
     (std::cout << ... << args);
     std::cout << '\n';
   }
 
+  // At -O1 the top scalar entries of the stack may live in registers
+  // instead of memory. They are counted by the Stack as usual and pushed,
+  // bottom first, before any instruction that could tell the difference:
+  // one that touches the stack, uses a cache register, calls, or transfers
+  // control, which also makes both sides of every branch agree on what is
+  // in memory. Bindings are flushed as they are made, so frame slots read
+  // through rbp are always in memory. A value pushed from a register is
+  // only moved into its cache register once that register is about to be
+  // overwritten, so a push and a pop usually become one move.
+  struct Cached {
+    std::string reg;
+    std::string source = "";
+    std::string comment = "";
+  };
+  inline static const std::vector<std::string> cache_gprs = {"r8", "r9", "r11"};
+  inline static const std::vector<std::string> cache_xmms = {"xmm2", "xmm3", "xmm4", "xmm5"};
+  std::vector<Cached> cached;
+
+  bool cacheable(std::shared_ptr<ResolvedType> type) {
+    return opt > 0 && (type->is<Int>() || type->is<Bool>() || type->is<Float>());
+  }
+
+  static bool xmm(const std::string& reg) {
+    return reg.rfind("xmm", 0) == 0;
+  }
+
+  bool holds(const std::string& reg) {
+    for (const auto& entry : cached) {
+      if (entry.reg == reg || entry.source == reg) return true;
+    }
+    return false;
+  }
+
+  // a free cache register of the class, spilling the bottom entry if needed
+  std::string cache_slot(bool xmm_class) {
+    auto& pool = xmm_class ? cache_xmms : cache_gprs;
+    while (true) {
+      for (const auto& reg : pool) {
+        if (!holds(reg)) return reg;
+      }
+      spill(cached.front());
+      cached.erase(cached.begin());
+    }
+  }
+
+  void spill(const Cached& entry, bool keep_flags = false) {
+    auto reg = entry.source.empty() ? entry.reg : entry.source;
+    if (xmm(reg)) {
+      emit(keep_flags ? "lea rsp, [rsp - 8]" : "sub rsp, 8");
+      emit("movsd [rsp], ", reg);
+    } else {
+      emit("push ", reg, entry.comment.empty() ? "" : " ; " + entry.comment);
+    }
+  }
+
+  void flush(bool keep_flags = false) {
+    for (const auto& entry : cached) spill(entry, keep_flags);
+    cached.clear();
+  }
+
+  void move(const std::string& to, const std::string& from) {
+    if (xmm(to) && xmm(from)) {
+      emit("movsd ", to, ", ", from);
+    } else if (xmm(to) || xmm(from)) {
+      emit("movq ", to, ", ", from);
+    } else {
+      emit("mov ", to, ", ", from);
+    }
+  }
+
+  // registers an instruction reads or writes without naming them
+  static std::vector<std::string> implicit(const std::string& op, size_t operands) {
+    if (op == "cqo" || op == "idiv" || op == "div" || op == "mul") return {"rax", "rdx"};
+    if (op == "imul" && operands == 1) return {"rax", "rdx"};
+    return {};
+  }
+
+  static std::vector<std::string> aliases(const std::string& reg) {
+    if (reg == "rax") return {"rax", "eax", "ax", "al"};
+    if (reg == "rdx") return {"rdx", "edx", "dx", "dl"};
+    if (reg == "rdi") return {"rdi", "edi", "di", "dil"};
+    if (reg == "rsi") return {"rsi", "esi", "si", "sil"};
+    if (reg == "rcx") return {"rcx", "ecx", "cx", "cl"};
+    return {reg};
+  }
+
+  bool disturbs(const std::string& line) {
+    auto code = line.substr(0, line.find(';'));
+    std::vector<std::string> words;
+    std::string word;
+    bool memory = false;
+    for (char c : code + " ") {
+      if (isalnum(c) || c == '_' || c == '.' || c == ':') {
+        word += c;
+        continue;
+      }
+      // stack slots are relocated rather than flushed for
+      if (!word.empty() && !(memory && word == "rsp")) words.push_back(word);
+      word.clear();
+      if (c == '[') memory = true;
+      if (c == ']') memory = false;
+    }
+    if (words.empty()) return false;
+    auto& op = words[0];
+    if (op.back() == ':' || op == "jmp" || op == "push" || op == "pop" || op == "call" || op == "ret") return true;
+    if (op[0] == 'j') {
+      // keep the flags the jump reads
+      flush(true);
+      return false;
+    }
+    // values still waiting in a register the instruction uses move out
+    auto used = implicit(op, words.size() - 1);
+    used.insert(used.end(), words.begin() + 1, words.end());
+    for (auto& entry : cached) {
+      if (entry.source.empty()) continue;
+      for (const auto& alias : aliases(entry.source)) {
+        if (std::find(used.begin(), used.end(), alias) != used.end()) {
+          move(entry.reg, entry.source);
+          entry.source.clear();
+          break;
+        }
+      }
+    }
+    for (const auto& w : words) {
+      if (w == "rsp" || w == "r12") return true;
+      for (const auto& entry : cached) {
+        if (entry.reg == w) return true;
+      }
+    }
+    return false;
+  }
+
+  // moves stack slot operands below the cached entries up by their size,
+  // flushing instead when one refers to a cached entry
+  std::string relocate(const std::string& line) {
+    auto cached_size = 8 * (int)cached.size();
+    std::string out;
+    size_t at = 0;
+    while (true) {
+      auto start = line.find("[rsp", at);
+      if (start == std::string::npos) break;
+      auto end = line.find(']', start);
+      int offset = 0;
+      std::stringstream terms(line.substr(start + 4, end - start - 4));
+      std::string plus;
+      int term;
+      while (terms >> plus >> term) offset += term;
+      if (offset < cached_size) {
+        flush();
+        return line;
+      }
+      out += line.substr(at, start - at) + "[rsp + " + std::to_string(offset - cached_size) + "]";
+      at = end + 1;
+    }
+    return out + line.substr(at);
+  }
+
   std::string header =
       "global jpl_main\n"
       "global _jpl_main\n"
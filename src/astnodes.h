@@ -44,6 +44,9 @@ class LValue : public ASTNode {
 class Program : public ASTNode {
  public:
   std::vector<std::unique_ptr<Cmd>> cmds;
+  // set by the optimizer: bytes of arrays the top-level code keeps in its
+  // frame
+  mutable int64_t frame_size = 0;
   Program(std::vector<std::unique_ptr<Cmd>> cmds) : cmds(std::move(cmds)) {}
   void accept(ASTVisitor &visitor) override { visitor.visit(*this); }
 };
@@ -155,6 +158,8 @@ class FnCmd : public Cmd {
   std::vector<std::unique_ptr<Binding>> params;
   std::unique_ptr<Type> return_type;
   std::vector<std::unique_ptr<Stmt>> stmts;
+  // set by the optimizer: bytes of arrays the function keeps in its frame
+  mutable int64_t frame_size = 0;
   FnCmd(std::string identifier, std::vector<std::unique_ptr<Binding>> params,
         std::unique_ptr<Type> return_type,
         std::vector<std::unique_ptr<Stmt>> stmts)
@@ -241,6 +246,9 @@ class VoidExpr : public Expr {
 class ArrayLiteralExpr : public Expr {
  public:
   std::vector<std::unique_ptr<Expr>> elements;
+  // set by the optimizer for an array that does not outlive its let: the
+  // elements go this many bytes into the frame's arrays instead of the heap
+  mutable int64_t frame = -1;
   ArrayLiteralExpr(std::vector<std::unique_ptr<Expr>> elements)
       : elements(std::move(elements)) {}
   void accept(ASTVisitor &visitor) override { visitor.visit(*this); }
@@ -269,6 +277,8 @@ class ArrayIndexExpr : public Expr {
  public:
   std::unique_ptr<Expr> expr;
   std::vector<std::unique_ptr<Expr>> indices;
+  // set by the optimizer for index checks that cannot fail
+  mutable std::vector<bool> lower_safe, upper_safe;
   ArrayIndexExpr(std::unique_ptr<Expr> expr,
                  std::vector<std::unique_ptr<Expr>> indices)
       : expr(std::move(expr)), indices(std::move(indices)) {}
@@ -297,6 +307,8 @@ class BinopExpr : public Expr {
   std::unique_ptr<Expr> left;
   std::string op;
   std::unique_ptr<Expr> right;
+  // set by the optimizer when an integer divisor cannot be zero
+  mutable bool divisor_safe = false;
   BinopExpr(std::unique_ptr<Expr> left, std::string op, std::unique_ptr<Expr> right) : left(std::move(left)), op(std::move(op)), right(std::move(right)) {}
   void accept(ASTVisitor &visitor) override { visitor.visit(*this); }
 };
@@ -314,6 +326,27 @@ class ArrayLoopExpr : public Expr {
  public:
   std::vector<std::pair<std::string, std::unique_ptr<Expr>>> axis;
   std::unique_ptr<Expr> expr;
+  // set by the optimizer for bounds that are always positive, and when the
+  // size of the array cannot overflow
+  mutable std::vector<bool> bound_safe;
+  mutable bool size_safe = false;
+  // lets hoisted by the optimizer: hoisted[k] is evaluated once per
+  // iteration of axis k, in order and before the inner axes, and is in
+  // scope from there on
+  mutable std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>> hoisted;
+  // set by the optimizer to run a two-axis loop in strips of this many
+  // columns, or 0 to run it row by row
+  mutable int64_t tile = 0;
+  // set by the optimizer when it reorders the axes: axis k runs over
+  // dimension dims[k] of the array, or over dimension k when empty
+  mutable std::vector<size_t> dims;
+  // set by the optimizer when the body simplifies away from the edges of
+  // the array: interior is evaluated instead wherever every variable k lies
+  // in [margins[k].first, bound k - margins[k].second)
+  mutable std::unique_ptr<Expr> interior;
+  mutable std::vector<std::pair<int64_t, int64_t>> margins;
+  // as for ArrayLiteralExpr
+  mutable int64_t frame = -1;
   ArrayLoopExpr(std::vector<std::pair<std::string, std::unique_ptr<Expr>>> axis, std::unique_ptr<Expr> expr) : axis(std::move(axis)), expr(std::move(expr)) {}
   void accept(ASTVisitor &visitor) override { visitor.visit(*this); }
 };
@@ -322,10 +355,25 @@ class SumLoopExpr : public Expr {
  public:
   std::vector<std::pair<std::string, std::unique_ptr<Expr>>> axis;
   std::unique_ptr<Expr> expr;
+  // set by the optimizer for bounds that are always positive
+  mutable std::vector<bool> bound_safe;
+  // lets hoisted by the optimizer, as in ArrayLoopExpr
+  mutable std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>> hoisted;
   SumLoopExpr(std::vector<std::pair<std::string, std::unique_ptr<Expr>>> axis, std::unique_ptr<Expr> expr) : axis(std::move(axis)), expr(std::move(expr)) {}
   void accept(ASTVisitor &visitor) override { visitor.visit(*this); }
 };
 
+// Only created by the optimizer: binds the value of an expression for the
+// evaluation of its body.
+class LetExpr : public Expr {
+ public:
+  std::string identifier;
+  std::unique_ptr<Expr> value;
+  std::unique_ptr<Expr> body;
+  LetExpr(std::string identifier, std::unique_ptr<Expr> value, std::unique_ptr<Expr> body) : identifier(std::move(identifier)), value(std::move(value)), body(std::move(body)) {}
+  void accept(ASTVisitor &visitor) override { visitor.visit(*this); }
+};
+
 /* ========== LValues ========== */
 class VarLValue : public LValue {
  public:
@@ -110,6 +110,11 @@ void ASTVisitor::visit(const SumLoopExpr &node) {
   for (const auto &[variable, expr] : node.axis) {
     expr->accept(*this);
   }
+  for (const auto &lets : node.hoisted) {
+    for (const auto &[variable, expr] : lets) {
+      expr->accept(*this);
+    }
+  }
   node.expr->accept(*this);
 }
 
@@ -117,7 +122,18 @@ void ASTVisitor::visit(const ArrayLoopExpr &node) {
   for (const auto &[variable, expr] : node.axis) {
     expr->accept(*this);
   }
+  for (const auto &lets : node.hoisted) {
+    for (const auto &[variable, expr] : lets) {
+      expr->accept(*this);
+    }
+  }
   node.expr->accept(*this);
+  if (node.interior) node.interior->accept(*this);
+}
+
+void ASTVisitor::visit(const LetExpr &node) {
+  node.value->accept(*this);
+  node.body->accept(*this);
 }
 
 void ASTVisitor::visit(const IfExpr &node) {
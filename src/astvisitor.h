@@ -46,6 +46,7 @@ class BinopExpr;
 class IfExpr;
 class ArrayLoopExpr;
 class SumLoopExpr;
+class LetExpr;
 
 class LValue;
 class VarLValue;
@@ -99,6 +100,7 @@ class ASTVisitor {
   virtual void visit(const IfExpr &node);
   virtual void visit(const ArrayLoopExpr &node);
   virtual void visit(const SumLoopExpr &node);
+  virtual void visit(const LetExpr &node);
 
   // LValues
   virtual void visit(const VarLValue &node);
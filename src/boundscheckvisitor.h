@@ -0,0 +1,498 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "affine.h"
+#include "astnodes.h"
+#include "context.h"
+#include "rewritevisitor.h"
+
+// Bounds check elimination. Loop variables range over [0, bound - 1] and
+// array dimensions are known from ArrayLValues and from the bounds of the
+// array loops that built an array, so an index like a[i + 1] inside
+// array[i : N - 1] over a[N] is shown never to fail, check by check. The
+// same ranges drop zero-divisor checks, non-positive loop bound checks, and
+// array size overflow checks for loops with constant bounds or no larger
+// than an array that already exists.
+//
+// An unconditional read whose checks remain is hoisted out of the loops it
+// sits in when its indices are affine in their variables: the smallest and
+// largest index over the loops are read once before the outermost of them,
+// which fails exactly when some read in the loop would. The failure is then
+// reported before the loop runs rather than at the failing iteration.
+//
+// Later passes may move the marked nodes but must not rebuild them, since
+// the marks on ArrayIndexExpr describe the final tree.
+class BoundsCheckVisitor : public RewriteVisitor {
+ public:
+  BoundsCheckVisitor(std::shared_ptr<Context> ctx) : ctx(ctx) {}
+
+  virtual void visit(const Program& program) override {
+    Scope scope;
+    for (const auto& cmd : program.cmds) {
+      if (dynamic_cast<const FnCmd*>(cmd.get())) {
+        cmd->accept(*this);
+      } else {
+        statement(*cmd, scope);
+      }
+    }
+  }
+
+  virtual void visit(const FnCmd& fn) override {
+    Scope scope;
+    for (const auto& param : fn.params) {
+      declare(*param->lvalue, nullptr, param->type->type, scope);
+    }
+    for (const auto& stmt : fn.stmts) {
+      statement(*stmt, scope);
+    }
+  }
+
+ private:
+  struct Scope {
+    AffineRanges ranges;
+    std::unordered_map<std::string, std::vector<Affine>> dims;
+    // bytes per element of the arrays in dims
+    std::unordered_map<std::string, int64_t> sizes;
+  };
+
+  // the checks of some reads, as reads of the extreme indices
+  struct Pending {
+    std::string array;
+    std::shared_ptr<ResolvedType> type;
+    std::vector<Affine> lowest, highest;
+    std::vector<const ArrayIndexExpr*> covered;
+    // the outermost loop it has been lifted out of
+    const std::unique_ptr<Expr>* target = nullptr;
+  };
+
+  std::shared_ptr<Context> ctx;
+  int ctr = 0;
+
+  void statement(const ASTNode& node, Scope& scope) {
+    if (auto cmd = dynamic_cast<const TimeCmd*>(&node)) return statement(*cmd->cmd, scope);
+    if (auto cmd = dynamic_cast<const ReadCmd*>(&node)) {
+      auto image = std::make_shared<Array>(std::make_shared<Struct>("rgba"), 2);
+      return declare(*cmd->lvalue, nullptr, image, scope);
+    }
+    const std::unique_ptr<Expr>* root = nullptr;
+    const LValue* lvalue = nullptr;
+    if (auto cmd = dynamic_cast<const LetCmd*>(&node)) root = &cmd->expr, lvalue = cmd->lvalue.get();
+    if (auto cmd = dynamic_cast<const ShowCmd*>(&node)) root = &cmd->expr;
+    if (auto cmd = dynamic_cast<const AssertCmd*>(&node)) root = &cmd->expr;
+    if (auto cmd = dynamic_cast<const WriteCmd*>(&node)) root = &cmd->expr;
+    if (auto stmt = dynamic_cast<const LetStmt*>(&node)) root = &stmt->expr, lvalue = stmt->lvalue.get();
+    if (auto stmt = dynamic_cast<const AssertStmt*>(&node)) root = &stmt->expr;
+    if (auto stmt = dynamic_cast<const ReturnStmt*>(&node)) root = &stmt->expr;
+    if (!root) return;
+    std::vector<Pending> pending;
+    walk(*root, scope, true, pending);
+    for (auto& p : pending) {
+      emit(p);
+    }
+    if (lvalue) declare(*lvalue, root->get(), (*root)->type, scope);
+  }
+
+  void declare(const LValue& lvalue, const Expr* value, std::shared_ptr<ResolvedType> type, Scope& scope) {
+    bind(scope, lvalue.identifier);
+    if (auto array = dynamic_cast<const ArrayLValue*>(&lvalue)) {
+      std::vector<Affine> dims;
+      for (const auto& dim : array->indices) {
+        bind(scope, dim);
+        scope.ranges.positive.insert(dim);
+        dims.push_back(Affine::var(dim));
+      }
+      set_dims(scope, lvalue.identifier, dims, type);
+    } else if (value) {
+      if (auto dims = dims_of(*value, scope)) {
+        set_dims(scope, lvalue.identifier, *dims, type);
+      }
+    }
+  }
+
+  void set_dims(Scope& scope, const std::string& name, const std::vector<Affine>& dims, std::shared_ptr<ResolvedType> type) {
+    scope.dims[name] = dims;
+    if (auto array = type->as<Array>()) {
+      scope.sizes[name] = array->element_type->size(ctx.get());
+    }
+  }
+
+  std::optional<std::vector<Affine>> dims_of(const Expr& value, const Scope& scope) {
+    if (auto var = dynamic_cast<const VarExpr*>(&value)) {
+      auto it = scope.dims.find(var->identifier);
+      if (it != scope.dims.end()) return it->second;
+      return std::nullopt;
+    }
+    auto loop = dynamic_cast<const ArrayLoopExpr*>(&value);
+    if (!loop) return std::nullopt;
+    std::vector<Affine> dims;
+    for (const auto& [variable, bound] : loop->axis) {
+      auto affine = Affine::of(*bound);
+      if (!affine) return std::nullopt;
+      dims.push_back(*affine);
+    }
+    return dims;
+  }
+
+  // facts stated in terms of a name no longer hold once it is rebound
+  static void bind(Scope& scope, const std::string& name) {
+    scope.ranges.positive.erase(name);
+    for (auto* ranges : {&scope.ranges.loops, &scope.ranges.lower}) {
+      for (auto it = ranges->begin(); it != ranges->end();) {
+        if (it->first == name || it->second.coefficient(name)) {
+          it = ranges->erase(it);
+        } else {
+          it++;
+        }
+      }
+    }
+    for (auto it = scope.dims.begin(); it != scope.dims.end();) {
+      bool stale = it->first == name;
+      for (const auto& dim : it->second) {
+        stale |= dim.coefficient(name) != 0;
+      }
+      if (stale) scope.sizes.erase(it->first);
+      it = stale ? scope.dims.erase(it) : std::next(it);
+    }
+  }
+
+  static std::vector<bool> positive_bounds(const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis, const Scope& scope) {
+    std::vector<bool> safe;
+    for (const auto& [variable, bound] : axis) {
+      auto affine = Affine::of(*bound);
+      safe.push_back(affine && scope.ranges.positive_bound(*affine));
+    }
+    return safe;
+  }
+
+  static bool nonzero(const Expr& expr, const Scope& scope) {
+    auto affine = Affine::of(expr);
+    if (!affine) return false;
+    auto least = scope.ranges.extreme(*affine, false);
+    auto above = least ? least->add(Affine(-1)) : std::nullopt;
+    if (above && scope.ranges.nonnegative(*above)) return true;
+    auto most = scope.ranges.extreme(*affine, true);
+    auto below = most ? Affine(-1).add(*most, -1) : std::nullopt;
+    return below && scope.ranges.nonnegative(*below);
+  }
+
+  // whether the byte size of the array fits in 64 bits: every bound has a
+  // constant maximum, or the array is no larger than one that already exists
+  bool fits(const ArrayLoopExpr& loop, const Scope& scope) {
+    int64_t element = loop.expr->type->size(ctx.get());
+    std::vector<Affine> most;
+    for (const auto& [variable, bound] : loop.axis) {
+      auto affine = Affine::of(*bound);
+      auto largest = affine ? scope.ranges.extreme(*affine, true) : std::nullopt;
+      if (!largest) return false;
+      most.push_back(*largest);
+    }
+    int64_t bytes = element;
+    bool constant = true;
+    for (const auto& bound : most) {
+      constant &= bound.is_constant() && !__builtin_mul_overflow(bytes, bound.constant, &bytes);
+    }
+    if (constant) return true;
+    for (const auto& [name, dims] : scope.dims) {
+      auto size = scope.sizes.find(name);
+      if (size == scope.sizes.end() || size->second < element || dims.size() != most.size()) continue;
+      bool smaller = true;
+      for (size_t i = 0; i < dims.size(); i++) {
+        auto slack = dims[i].add(most[i], -1);
+        smaller &= slack && scope.ranges.nonnegative(*slack);
+      }
+      if (smaller) return true;
+    }
+    return false;
+  }
+
+  // narrows the ranges of loop variables compared against in a condition
+  // that is known to be true (or false)
+  static void assume(const Expr& condition, bool truth, Scope& scope) {
+    if (auto unop = dynamic_cast<const UnopExpr*>(&condition); unop && unop->op == "!") {
+      return assume(*unop->expr, !truth, scope);
+    }
+    auto binop = dynamic_cast<const BinopExpr*>(&condition);
+    if (!binop) return;
+    if ((binop->op == "&&" && truth) || (binop->op == "||" && !truth)) {
+      assume(*binop->left, truth, scope);
+      return assume(*binop->right, truth, scope);
+    }
+    static const std::map<std::string, std::string> negated = {{"<", ">="}, {"<=", ">"}, {">", "<="}, {">=", "<"}, {"==", "!="}, {"!=", "=="}};
+    static const std::map<std::string, std::string> swapped = {{"<", ">"}, {"<=", ">="}, {">", "<"}, {">=", "<="}, {"==", "=="}, {"!=", "!="}};
+    if (!negated.count(binop->op) || !binop->left->type->is<Int>()) return;
+    auto op = truth ? binop->op : negated.at(binop->op);
+    auto left = Affine::of(*binop->left), right = Affine::of(*binop->right);
+    if (!left || !right) return;
+    for (int side = 0; side < 2; side++) {
+      if (left->terms.size() == 1 && left->constant == 0 && left->terms.begin()->second == 1) {
+        auto variable = left->terms.begin()->first;
+        if (scope.ranges.loops.count(variable) && !right->coefficient(variable)) {
+          narrow(variable, op, *right, scope.ranges);
+        }
+      }
+      std::swap(left, right);
+      op = swapped.at(op);
+    }
+  }
+
+  // x op e for a loop variable x
+  static void narrow(const std::string& x, const std::string& op, const Affine& e, AffineRanges& ranges) {
+    auto& bound = ranges.loops[x];
+    auto least = ranges.lower.count(x) ? ranges.lower[x] : Affine(0);
+    auto tighten_bound = [&](std::optional<Affine> candidate) {
+      auto slack = candidate ? bound.add(*candidate, -1) : std::nullopt;
+      if (slack && ranges.nonnegative(*slack)) bound = *candidate;
+    };
+    auto tighten_lower = [&](std::optional<Affine> candidate) {
+      auto slack = candidate ? candidate->add(least, -1) : std::nullopt;
+      if (slack && ranges.nonnegative(*slack)) ranges.lower[x] = *candidate;
+    };
+    if (op == "<") tighten_bound(e);
+    if (op == "<=" || op == "==") tighten_bound(e.add(Affine(1)));
+    if (op == ">") tighten_lower(e.add(Affine(1)));
+    if (op == ">=" || op == "==") tighten_lower(e);
+    if (op == "!=") {
+      if (e == least) tighten_lower(e.add(Affine(1)));
+      if (auto last = bound.add(Affine(-1)); last && e == *last) tighten_bound(e);
+    }
+  }
+
+  static bool mentions(const Pending& p, const std::string& name) {
+    if (p.array == name) return true;
+    for (size_t i = 0; i < p.lowest.size(); i++) {
+      if (p.lowest[i].coefficient(name) || p.highest[i].coefficient(name)) return true;
+    }
+    return false;
+  }
+
+  void walk(const std::unique_ptr<Expr>& expr, const Scope& scope, bool unconditional, std::vector<Pending>& pending) {
+    if (auto index = dynamic_cast<const ArrayIndexExpr*>(expr.get())) {
+      for (auto child : children(*expr)) {
+        walk(*child, scope, unconditional, pending);
+      }
+      return access(*index, scope, unconditional, pending);
+    }
+    if (auto binop = dynamic_cast<const BinopExpr*>(expr.get()); binop && (binop->op == "&&" || binop->op == "||")) {
+      walk(binop->left, scope, unconditional, pending);
+      auto inner = scope;
+      assume(*binop->left, binop->op == "&&", inner);
+      return walk(binop->right, inner, false, pending);
+    }
+    if (auto if_expr = dynamic_cast<const IfExpr*>(expr.get())) {
+      walk(if_expr->condition, scope, unconditional, pending);
+      auto then_scope = scope, else_scope = scope;
+      assume(*if_expr->condition, true, then_scope);
+      assume(*if_expr->condition, false, else_scope);
+      walk(if_expr->if_expr, then_scope, false, pending);
+      return walk(if_expr->else_expr, else_scope, false, pending);
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(expr.get())) {
+      walk(let->value, scope, unconditional, pending);
+      auto inner = scope;
+      bind(inner, let->identifier);
+      // an affine let, like the offsets CSE pulls out of unrolled loops,
+      // ranges over just its value
+      auto affine = let->value->type->is<Int>() ? Affine::of(*let->value) : std::nullopt;
+      auto bound = affine ? affine->add(Affine(1)) : std::nullopt;
+      if (bound && !affine->coefficient(let->identifier)) {
+        inner.ranges.lower[let->identifier] = *affine;
+        inner.ranges.loops[let->identifier] = *bound;
+      }
+      if (auto dims = dims_of(*let->value, scope)) {
+        set_dims(inner, let->identifier, *dims, let->value->type);
+      }
+      std::vector<Pending> body;
+      walk(let->body, inner, unconditional, body);
+      for (auto& p : body) {
+        if (mentions(p, let->identifier)) {
+          emit(p);
+        } else {
+          pending.push_back(std::move(p));
+        }
+      }
+      return;
+    }
+    if (auto loop = dynamic_cast<const ArrayLoopExpr*>(expr.get())) {
+      loop->bound_safe = positive_bounds(loop->axis, scope);
+      loop->size_safe = fits(*loop, scope);
+      auto checked = loop->size_safe && std::all_of(loop->bound_safe.begin(), loop->bound_safe.end(), [](bool safe) { return safe; });
+      return this->loop(expr, loop->axis, loop->expr, scope, unconditional, checked, pending);
+    }
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(expr.get())) {
+      loop->bound_safe = positive_bounds(loop->axis, scope);
+      auto checked = std::all_of(loop->bound_safe.begin(), loop->bound_safe.end(), [](bool safe) { return safe; });
+      return this->loop(expr, loop->axis, loop->expr, scope, unconditional, checked, pending);
+    }
+    if (auto binop = dynamic_cast<const BinopExpr*>(expr.get()); binop && (binop->op == "/" || binop->op == "%")) {
+      binop->divisor_safe = binop->type->is<Int>() && nonzero(*binop->right, scope);
+    }
+    for (auto child : children(*expr)) {
+      walk(*child, scope, unconditional, pending);
+    }
+  }
+
+  // checked is false for a loop whose bounds or size are checked as it
+  // starts
+  void loop(const std::unique_ptr<Expr>& slot, const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis,
+            const std::unique_ptr<Expr>& body, const Scope& scope, bool unconditional, bool checked, std::vector<Pending>& pending) {
+    for (const auto& [variable, bound] : axis) {
+      walk(bound, scope, unconditional, pending);
+    }
+    auto inner = scope;
+    for (const auto& [variable, bound] : axis) {
+      bind(inner, variable);
+    }
+    // bounds are evaluated outside the loop, so they never mention its variables
+    AffineRanges own;
+    for (const auto& [variable, bound] : axis) {
+      auto affine = Affine::of(*bound);
+      bool outer = affine.has_value();
+      for (const auto& [other, _] : axis) {
+        outer &= affine && !affine->coefficient(other);
+      }
+      if (outer) {
+        inner.ranges.loops[variable] = *affine;
+        own.loops[variable] = *affine;
+      }
+    }
+
+    // the body runs at least once whenever the loop is reached, since
+    // non-positive bounds fail
+    std::vector<Pending> inside;
+    walk(body, inner, true, inside);
+    // the reads run before the loop, so nothing the loop would do before
+    // them may fail: its bounds, and the rest of its body
+    auto lifted = inside;
+    auto hoistable = unconditional && checked;
+    for (const auto& [variable, bound] : axis) {
+      hoistable &= !can_fail(*bound);
+    }
+    for (auto& p : lifted) {
+      hoistable &= lift(p, own, axis);
+    }
+    hoistable = hoistable && !fails_besides(*body, inside);
+    for (auto& p : hoistable ? lifted : inside) {
+      if (!hoistable) {
+        emit(p);
+        continue;
+      }
+      p.target = &slot;
+      auto same = std::find_if(pending.begin(), pending.end(), [&](const Pending& other) {
+        return other.target == &slot && other.array == p.array && other.lowest == p.lowest && other.highest == p.highest;
+      });
+      if (same != pending.end()) {
+        same->covered.insert(same->covered.end(), p.covered.begin(), p.covered.end());
+      } else {
+        pending.push_back(std::move(p));
+      }
+    }
+  }
+
+  // whether anything but the given reads can fail in an expression
+  static bool fails_besides(const Expr& expr, const std::vector<Pending>& reads) {
+    std::vector<std::pair<std::vector<bool>, std::vector<bool>>> marks;
+    for (const auto& p : reads) {
+      for (auto index : p.covered) {
+        marks.emplace_back(index->lower_safe, index->upper_safe);
+        index->lower_safe.assign(index->indices.size(), true);
+        index->upper_safe.assign(index->indices.size(), true);
+      }
+    }
+    auto fails = can_fail(expr);
+    auto mark = marks.begin();
+    for (const auto& p : reads) {
+      for (auto index : p.covered) {
+        index->lower_safe = mark->first;
+        index->upper_safe = mark++->second;
+      }
+    }
+    return fails;
+  }
+
+  // restates the extremes outside the loop; false if they depend on it, or
+  // if an index falls as the loop runs, so that the lowest read would not
+  // be the first to fail
+  bool lift(Pending& p, const AffineRanges& own, const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis) {
+    auto lowest = p.lowest, highest = p.highest;
+    for (size_t i = 0; i < lowest.size(); i++) {
+      for (const auto& [variable, _] : axis) {
+        if (lowest[i].coefficient(variable) < 0) return false;
+      }
+      auto low = own.extreme(lowest[i], false);
+      auto high = own.extreme(highest[i], true);
+      if (!low || !high) return false;
+      lowest[i] = *low, highest[i] = *high;
+    }
+    Pending lifted = p;
+    lifted.lowest = lowest, lifted.highest = highest;
+    for (const auto& [variable, _] : axis) {
+      if (mentions(lifted, variable)) return false;
+    }
+    p = lifted;
+    return true;
+  }
+
+  void access(const ArrayIndexExpr& index, const Scope& scope, bool unconditional, std::vector<Pending>& pending) {
+    auto size = index.indices.size();
+    index.lower_safe.assign(size, false);
+    index.upper_safe.assign(size, false);
+    auto var = dynamic_cast<const VarExpr*>(index.expr.get());
+    auto dims = var ? scope.dims.find(var->identifier) : scope.dims.end();
+    std::vector<Affine> indices;
+    bool safe = true;
+    for (size_t i = 0; i < size; i++) {
+      auto affine = Affine::of(*index.indices[i]);
+      if (!affine) {
+        safe = false;
+        continue;
+      }
+      indices.push_back(*affine);
+      auto least = scope.ranges.extreme(*affine, false);
+      index.lower_safe[i] = least && scope.ranges.nonnegative(*least);
+      if (dims != scope.dims.end()) {
+        auto most = scope.ranges.extreme(*affine, true);
+        auto slack = most ? dims->second[i].add(*most, -1) : std::nullopt;
+        if (slack) slack = slack->add(Affine(-1));
+        index.upper_safe[i] = slack && scope.ranges.nonnegative(*slack);
+      }
+      safe &= index.lower_safe[i] && index.upper_safe[i];
+    }
+    if (safe || !var || !unconditional || indices.size() != size) return;
+    pending.push_back({var->identifier, index.expr->type, indices, indices, {&index}});
+  }
+
+  // let _bc0 = a[lowest...] in let _bc1 = a[highest...] in loop
+  void emit(Pending& p) {
+    if (!p.target) return;
+    auto& slot = *p.target;
+    auto type = slot->type;
+    std::set<std::vector<std::pair<std::map<std::string, int64_t>, int64_t>>> seen;
+    for (const auto* extremes : {&p.highest, &p.lowest}) {
+      std::vector<std::pair<std::map<std::string, int64_t>, int64_t>> key;
+      std::vector<std::unique_ptr<Expr>> indices;
+      for (const auto& affine : *extremes) {
+        key.emplace_back(affine.terms, affine.constant);
+        indices.push_back(affine.to_expr());
+      }
+      if (!seen.insert(key).second) continue;
+      auto array = std::make_unique<VarExpr>(p.array);
+      array->type = p.type;
+      auto read = std::make_unique<ArrayIndexExpr>(std::move(array), std::move(indices));
+      read->type = p.type->as<Array>()->element_type;
+      auto let = std::make_unique<LetExpr>("_bc" + std::to_string(ctr++), std::move(read), take(slot));
+      let->type = type;
+      edit(slot) = std::move(let);
+    }
+    for (auto index : p.covered) {
+      index->lower_safe.assign(index->indices.size(), true);
+      index->upper_safe.assign(index->indices.size(), true);
+    }
+    p.target = nullptr;
+  }
+};
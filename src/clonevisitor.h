@@ -0,0 +1,193 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "astnodes.h"
+#include "astvisitor.h"
+
+// Deep copies a typechecked expression or function, keeping the resolved
+// types, for passes that duplicate code (inlining, fusion, unrolling,
+// specialization). A pass that runs after the optimizer has marked the
+// tree asks for the marks to be copied too.
+class CloneVisitor : public ASTVisitor {
+ public:
+  static std::unique_ptr<Expr> clone(const Expr& expr, bool marks = false) {
+    CloneVisitor visitor;
+    visitor.marks = marks;
+    return visitor.copy(expr);
+  }
+
+  // a copy of a function under another name, for specializing it
+  static std::unique_ptr<FnCmd> clone(const FnCmd& fn, const std::string& identifier) {
+    CloneVisitor visitor;
+    std::vector<std::unique_ptr<Binding>> params;
+    for (const auto& param : fn.params) {
+      params.push_back(std::make_unique<Binding>(copy(*param->lvalue), copy(*param->type)));
+    }
+    std::vector<std::unique_ptr<Stmt>> stmts;
+    for (const auto& stmt : fn.stmts) {
+      stmts.push_back(visitor.copy(*stmt));
+    }
+    return std::make_unique<FnCmd>(identifier, std::move(params), copy(*fn.return_type), std::move(stmts));
+  }
+
+  virtual void visit(const IntExpr& expr) override {
+    result = std::make_unique<IntExpr>(expr.value);
+  }
+
+  virtual void visit(const FloatExpr& expr) override {
+    result = std::make_unique<FloatExpr>(expr.value);
+  }
+
+  virtual void visit(const TrueExpr& expr) override {
+    result = std::make_unique<TrueExpr>();
+  }
+
+  virtual void visit(const FalseExpr& expr) override {
+    result = std::make_unique<FalseExpr>();
+  }
+
+  virtual void visit(const VarExpr& expr) override {
+    result = std::make_unique<VarExpr>(expr.identifier);
+  }
+
+  virtual void visit(const VoidExpr& expr) override {
+    result = std::make_unique<VoidExpr>();
+  }
+
+  virtual void visit(const ArrayLiteralExpr& expr) override {
+    result = std::make_unique<ArrayLiteralExpr>(copy(expr.elements));
+  }
+
+  virtual void visit(const StructLiteralExpr& expr) override {
+    result = std::make_unique<StructLiteralExpr>(expr.identifier, copy(expr.fields));
+  }
+
+  virtual void visit(const DotExpr& expr) override {
+    result = std::make_unique<DotExpr>(copy(*expr.expr), expr.field);
+  }
+
+  virtual void visit(const ArrayIndexExpr& expr) override {
+    auto array = copy(*expr.expr);
+    auto read = std::make_unique<ArrayIndexExpr>(std::move(array), copy(expr.indices));
+    if (marks) {
+      read->lower_safe = expr.lower_safe;
+      read->upper_safe = expr.upper_safe;
+    }
+    result = std::move(read);
+  }
+
+  virtual void visit(const CallExpr& expr) override {
+    result = std::make_unique<CallExpr>(expr.identifier, copy(expr.args));
+  }
+
+  virtual void visit(const UnopExpr& expr) override {
+    result = std::make_unique<UnopExpr>(expr.op, copy(*expr.expr));
+  }
+
+  virtual void visit(const BinopExpr& expr) override {
+    auto left = copy(*expr.left);
+    auto binop = std::make_unique<BinopExpr>(std::move(left), expr.op, copy(*expr.right));
+    if (marks) binop->divisor_safe = expr.divisor_safe;
+    result = std::move(binop);
+  }
+
+  virtual void visit(const IfExpr& expr) override {
+    auto condition = copy(*expr.condition);
+    auto if_expr = copy(*expr.if_expr);
+    result = std::make_unique<IfExpr>(std::move(condition), std::move(if_expr), copy(*expr.else_expr));
+  }
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    auto axis = copy(expr.axis);
+    auto loop = std::make_unique<ArrayLoopExpr>(std::move(axis), copy(*expr.expr));
+    for (const auto& lets : expr.hoisted) {
+      loop->hoisted.push_back(copy(lets));
+    }
+    if (marks) {
+      loop->bound_safe = expr.bound_safe;
+      loop->size_safe = expr.size_safe;
+      loop->tile = expr.tile;
+      loop->dims = expr.dims;
+      if (expr.interior) loop->interior = copy(*expr.interior);
+      loop->margins = expr.margins;
+    }
+    result = std::move(loop);
+  }
+
+  virtual void visit(const SumLoopExpr& expr) override {
+    auto axis = copy(expr.axis);
+    auto loop = std::make_unique<SumLoopExpr>(std::move(axis), copy(*expr.expr));
+    for (const auto& lets : expr.hoisted) {
+      loop->hoisted.push_back(copy(lets));
+    }
+    if (marks) loop->bound_safe = expr.bound_safe;
+    result = std::move(loop);
+  }
+
+  virtual void visit(const LetExpr& expr) override {
+    auto value = copy(*expr.value);
+    result = std::make_unique<LetExpr>(expr.identifier, std::move(value), copy(*expr.body));
+  }
+
+ private:
+  std::unique_ptr<Expr> result;
+  bool marks = false;
+
+  std::unique_ptr<Expr> copy(const Expr& expr) {
+    const_cast<Expr&>(expr).accept(*this);
+    auto copied = std::move(result);
+    copied->type = expr.type;
+    return copied;
+  }
+
+  std::vector<std::unique_ptr<Expr>> copy(const std::vector<std::unique_ptr<Expr>>& exprs) {
+    std::vector<std::unique_ptr<Expr>> copies;
+    for (const auto& expr : exprs) {
+      copies.push_back(copy(*expr));
+    }
+    return copies;
+  }
+
+  std::vector<std::pair<std::string, std::unique_ptr<Expr>>> copy(const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis) {
+    std::vector<std::pair<std::string, std::unique_ptr<Expr>>> copies;
+    for (const auto& [variable, bound] : axis) {
+      copies.emplace_back(variable, copy(*bound));
+    }
+    return copies;
+  }
+
+  std::unique_ptr<Stmt> copy(const Stmt& stmt) {
+    if (auto let = dynamic_cast<const LetStmt*>(&stmt)) {
+      return std::make_unique<LetStmt>(copy(*let->lvalue), copy(*let->expr));
+    }
+    if (auto assert = dynamic_cast<const AssertStmt*>(&stmt)) {
+      return std::make_unique<AssertStmt>(copy(*assert->expr), assert->string);
+    }
+    auto ret = dynamic_cast<const ReturnStmt*>(&stmt);
+    return std::make_unique<ReturnStmt>(copy(*ret->expr));
+  }
+
+  static std::unique_ptr<LValue> copy(const LValue& lvalue) {
+    if (auto array = dynamic_cast<const ArrayLValue*>(&lvalue)) {
+      return std::make_unique<ArrayLValue>(array->identifier, array->indices);
+    }
+    return std::make_unique<VarLValue>(lvalue.identifier);
+  }
+
+  static std::unique_ptr<Type> copy(const Type& type) {
+    std::unique_ptr<Type> copied;
+    if (dynamic_cast<const IntType*>(&type)) copied = std::make_unique<IntType>();
+    if (dynamic_cast<const BoolType*>(&type)) copied = std::make_unique<BoolType>();
+    if (dynamic_cast<const FloatType*>(&type)) copied = std::make_unique<FloatType>();
+    if (dynamic_cast<const VoidType*>(&type)) copied = std::make_unique<VoidType>();
+    if (auto st = dynamic_cast<const StructType*>(&type)) copied = std::make_unique<StructType>(st->identifier);
+    if (auto array = dynamic_cast<const ArrayType*>(&type)) {
+      copied = std::make_unique<ArrayType>(copy(*array->element_type), array->rank);
+    }
+    copied->type = type.type;
+    return copied;
+  }
+};
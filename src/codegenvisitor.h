@@ -170,16 +170,20 @@ class CodeGenVisitor : public ASTVisitor {
     }
     for (int i = 0; i < expr.indices.size(); i++) {
       auto& index = expr.indices[i];
-      auto label = genlabel();
-      println("if (" + index->symbol + " >= 0)");
-      println("goto " + label + ";");
-      println("fail_assertion(\"negative array index\");");
-      println(label + ":;");
-      label = genlabel();
-      println("if (" + index->symbol + " < " + expr.expr->symbol + ".d" + std::to_string(i) + ")");
-      println("goto " + label + ";");
-      println("fail_assertion(\"index too large\");");
-      println(label + ":;");
+      if (i >= (int)expr.lower_safe.size() || !expr.lower_safe[i]) {
+        auto label = genlabel();
+        println("if (" + index->symbol + " >= 0)");
+        println("goto " + label + ";");
+        println("fail_assertion(\"negative array index\");");
+        println(label + ":;");
+      }
+      if (i >= (int)expr.upper_safe.size() || !expr.upper_safe[i]) {
+        auto label = genlabel();
+        println("if (" + index->symbol + " < " + expr.expr->symbol + ".d" + std::to_string(i) + ")");
+        println("goto " + label + ";");
+        println("fail_assertion(\"index too large\");");
+        println(label + ":;");
+      }
     }
     auto index = gensym();
     println("int64_t " + index + " = 0;");
@@ -214,22 +218,29 @@ class CodeGenVisitor : public ASTVisitor {
   virtual void visit(const ArrayLoopExpr& expr) override {
     auto symbol = expr.symbol = gensym();
     println(expr.type->c_type() + " " + symbol + ";");
-    for (const auto& [name, limit] : expr.axis) {
+    for (size_t i = 0; i < expr.axis.size(); i++) {
+      auto& limit = expr.axis[i].second;
       limit->accept(*this);
+      if (i < expr.bound_safe.size() && expr.bound_safe[i]) continue;
       println("if (" + limit->symbol + " > 0)");
       auto label = genlabel();
       println("goto " + label + ";");
       println("fail_assertion(\"non-positive loop bound\");");
       println(label + ":;");
     }
+    // axis k fills dimension dims[k] once the optimizer reorders the axes
+    std::vector<size_t> axis_of(expr.axis.size());
+    for (size_t k = 0; k < expr.axis.size(); k++) {
+      axis_of[expr.dims.empty() ? k : expr.dims[k]] = k;
+    }
     auto size = gensym();
     println("int64_t " + size + " = 1;");
-    println(size + " *= 1;");
-    if (expr.expr->type->is<Int>()) {
-      println(size + " *= sizeof(int64_t);");
-    } else {
-      println(size + " *= sizeof(double);");
+    for (size_t d = 0; d < expr.axis.size(); d++) {
+      auto& limit = expr.axis[axis_of[d]].second;
+      println(symbol + ".d" + std::to_string(d) + " = " + limit->symbol + ";");
+      println(size + " *= " + limit->symbol + ";");
     }
+    println(size + " *= sizeof(" + expr.expr->type->c_type() + ");");
     println(symbol + ".data = jpl_alloc(" + size + ");");
 
     std::vector<std::string> symbols{};
@@ -239,36 +250,65 @@ class CodeGenVisitor : public ASTVisitor {
       println("int64_t " + symbol + " = 0;");
       var_map.insert({expr.axis[i].first, symbol});
     }
-    auto loop = genlabel();
-    println(loop + ":; // loop start");
+    auto labels = enter_axes(expr.axis.size(), expr.hoisted);
     expr.expr->accept(*this);
-    println(symbol + " += " + expr.expr->symbol + ";");
+    auto index = gensym();
+    println("int64_t " + index + " = 0;");
+    for (size_t d = 0; d < expr.axis.size(); d++) {
+      println(index + " *= " + symbol + ".d" + std::to_string(d) + ";");
+      println(index + " += " + symbols[axis_of[d]] + ";");
+    }
+    println(symbol + ".data[" + index + "] = " + expr.expr->symbol + ";");
     for (int i = expr.axis.size() - 1; i >= 0; --i) {
       println(symbols[i] + "++;");
       println("if (" + symbols[i] + " < " + expr.axis[i].second->symbol + ")");
-      println("goto " + loop + ";");
+      println("goto " + labels[i] + ";");
       if (i > 0) {
         println(symbols[i] + " = 0;");
       }
     }
   }
 
+  // labels[k] starts an iteration of axis k, evaluating its hoisted lets
+  std::vector<std::string> enter_axes(size_t axes, const std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>>& hoisted) {
+    std::vector<std::string> labels;
+    for (size_t k = 0; k < axes; k++) {
+      labels.push_back(genlabel());
+      println(labels.back() + ":; // loop start");
+      if (k >= hoisted.size()) continue;
+      for (const auto& [identifier, value] : hoisted[k]) {
+        value->accept(*this);
+        var_map[identifier] = value->symbol;
+      }
+    }
+    return labels;
+  }
+
   virtual void visit(const SumLoopExpr& expr) override {
     auto symbol = expr.symbol = gensym();
-    if (expr.expr->type->is<Int>()) {
-      println("int64_t " + symbol + ";");
-    } else {
-      println("double " + symbol + ";");
-    }
-    for (const auto& [name, limit] : expr.axis) {
+    println(expr.type->c_type() + " " + symbol + ";");
+    for (size_t i = 0; i < expr.axis.size(); i++) {
+      auto& limit = expr.axis[i].second;
       limit->accept(*this);
+      if (i < expr.bound_safe.size() && expr.bound_safe[i]) continue;
       println("if (" + limit->symbol + " > 0)");
       auto label = genlabel();
       println("goto " + label + ";");
       println("fail_assertion(\"non-positive loop bound\");");
       println(label + ":;");
     }
-    println(symbol + " = 0;");
+    // a struct sum (from fused loops) accumulates every field
+    std::vector<std::string> fields{""};
+    if (auto st = expr.type->as<Struct>()) {
+      fields.clear();
+      auto info = ctx->lookup<StructInfo>(st->name);
+      for (const auto& [field, type] : info->fields) {
+        fields.push_back("." + field);
+      }
+    }
+    for (const auto& field : fields) {
+      println(symbol + field + " = 0;");
+    }
     std::vector<std::string> symbols{};
     for (int i = expr.axis.size() - 1; i >= 0; --i) {
       auto symbol = gensym();
@@ -276,20 +316,28 @@ class CodeGenVisitor : public ASTVisitor {
       println("int64_t " + symbol + " = 0;");
       var_map.insert({expr.axis[i].first, symbol});
     }
-    auto loop = genlabel();
-    println(loop + ":; // loop start");
+    auto labels = enter_axes(expr.axis.size(), expr.hoisted);
     expr.expr->accept(*this);
-    println(symbol + " += " + expr.expr->symbol + ";");
+    for (const auto& field : fields) {
+      println(symbol + field + " += " + expr.expr->symbol + field + ";");
+    }
     for (int i = expr.axis.size() - 1; i >= 0; --i) {
       println(symbols[i] + "++;");
       println("if (" + symbols[i] + " < " + expr.axis[i].second->symbol + ")");
-      println("goto " + loop + ";");
+      println("goto " + labels[i] + ";");
       if (i > 0) {
         println(symbols[i] + " = 0;");
       }
     }
   }
 
+  virtual void visit(const LetExpr& expr) override {
+    expr.value->accept(*this);
+    var_map[expr.identifier] = expr.value->symbol;
+    expr.body->accept(*this);
+    expr.symbol = expr.body->symbol;
+  }
+
   // expr here
 
   virtual void
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <math.h>
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <variant>
+
+#include "astnodes.h"
+#include "rewritevisitor.h"
+
+typedef std::variant<int64_t, double, bool> constval;
+
+// Folds operators, builtin math calls and ifs whose operands are literals,
+// integer additions of 0 and multiplications by 1, and propagates lets bound
+// to literals into their uses. Anything that would
+// fail at runtime (division by zero, non-finite floats) is left unfolded so
+// the generated code still reports it.
+class ConstFoldVisitor : public RewriteVisitor {
+ public:
+  virtual void visit(const ReadCmd& cmd) override {
+    forget(*cmd.lvalue);
+  }
+
+  virtual void visit(const LetCmd& cmd) override {
+    rewrite(cmd.expr);
+    bind(*cmd.lvalue, *cmd.expr);
+  }
+
+  virtual void visit(const LetStmt& stmt) override {
+    rewrite(stmt.expr);
+    bind(*stmt.lvalue, *stmt.expr);
+  }
+
+  virtual void visit(const FnCmd& fn) override {
+    auto outer = constants;
+    RewriteVisitor::visit(fn);
+    constants = outer;
+  }
+
+  virtual void visit(const Binding& binding) override {
+    forget(*binding.lvalue);
+  }
+
+  virtual void visit(const VarExpr& expr) override {
+    if (auto it = constants.find(expr.identifier); it != constants.end()) {
+      replace(make_const(it->second));
+    }
+  }
+
+  virtual void visit(const UnopExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    auto value = value_of(*expr.expr);
+    if (!value) return;
+    if (auto b = std::get_if<bool>(&*value)) {
+      replace(make_const(!*b));
+    } else if (auto i = std::get_if<int64_t>(&*value)) {
+      replace(make_const(int64_t(0 - uint64_t(*i))));
+    } else if (auto result = checked(-std::get<double>(*value))) {
+      replace(make_const(*result));
+    }
+  }
+
+  virtual void visit(const BinopExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    auto left = value_of(*expr.left);
+    auto right = value_of(*expr.right);
+    if (expr.op == "&&" || expr.op == "||") {
+      // a constant left operand decides whether the right one matters
+      if (left) {
+        auto l = std::get<bool>(*left);
+        if (l == (expr.op == "||")) {
+          replace(make_const(l));
+        } else {
+          replace(take(expr.right));
+        }
+      }
+      return;
+    }
+    // adding 0 or multiplying by 1 leaves an integer as it is, as in the
+    // offsets of unrolled loops
+    auto is = [](const std::optional<constval>& value, int64_t n) {
+      return value && std::holds_alternative<int64_t>(*value) && std::get<int64_t>(*value) == n;
+    };
+    if (((expr.op == "+" || expr.op == "-") && is(right, 0)) || (expr.op == "*" && is(right, 1))) {
+      replace(take(expr.left));
+      return;
+    }
+    if ((expr.op == "+" && is(left, 0)) || (expr.op == "*" && is(left, 1))) {
+      replace(take(expr.right));
+      return;
+    }
+    if (!left || !right) return;
+    std::optional<constval> result;
+    if (auto l = std::get_if<int64_t>(&*left)) {
+      result = fold(expr.op, *l, std::get<int64_t>(*right));
+    } else if (auto l = std::get_if<double>(&*left)) {
+      result = fold(expr.op, *l, std::get<double>(*right));
+    } else if (expr.op == "==") {
+      result = *left == *right;
+    } else if (expr.op == "!=") {
+      result = *left != *right;
+    }
+    if (result) {
+      replace(make_const(*result));
+    }
+  }
+
+  virtual void visit(const IfExpr& expr) override {
+    rewrite(expr.condition);
+    auto condition = value_of(*expr.condition);
+    if (!condition) {
+      rewrite(expr.if_expr);
+      rewrite(expr.else_expr);
+      return;
+    }
+    const auto& branch = std::get<bool>(*condition) ? expr.if_expr : expr.else_expr;
+    rewrite(branch);
+    replace(take(branch));
+  }
+
+  virtual void visit(const CallExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    std::vector<constval> args;
+    for (const auto& arg : expr.args) {
+      auto value = value_of(*arg);
+      if (!value) return;
+      args.push_back(*value);
+    }
+    std::optional<constval> result;
+    if (auto fn = unary_builtins.find(expr.identifier); fn != unary_builtins.end()) {
+      result = checked(fn->second(std::get<double>(args[0])));
+    } else if (auto fn = binary_builtins.find(expr.identifier); fn != binary_builtins.end()) {
+      result = checked(fn->second(std::get<double>(args[0]), std::get<double>(args[1])));
+    } else if (expr.identifier == "to_float") {
+      result = double(std::get<int64_t>(args[0]));
+    } else if (expr.identifier == "to_int") {
+      // out of range and nan conversions are up to the runtime
+      auto value = std::get<double>(args[0]);
+      if (value > -9223372036854775808.0 && value < 9223372036854775808.0) {
+        result = int64_t(value);
+      }
+    }
+    if (result) {
+      replace(make_const(*result));
+    }
+  }
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    for (const auto& [variable, bound] : expr.axis) {
+      rewrite(bound);
+    }
+    auto outer = constants;
+    for (const auto& [variable, bound] : expr.axis) {
+      constants.erase(variable);
+    }
+    rewrite(expr.expr);
+    constants = outer;
+  }
+
+  virtual void visit(const SumLoopExpr& expr) override {
+    for (const auto& [variable, bound] : expr.axis) {
+      rewrite(bound);
+    }
+    auto outer = constants;
+    for (const auto& [variable, bound] : expr.axis) {
+      constants.erase(variable);
+    }
+    rewrite(expr.expr);
+    constants = outer;
+  }
+
+  virtual void visit(const LetExpr& expr) override {
+    rewrite(expr.value);
+    auto outer = constants;
+    constants.erase(expr.identifier);
+    if (auto value = value_of(*expr.value)) {
+      constants[expr.identifier] = *value;
+    }
+    rewrite(expr.body);
+    constants = outer;
+  }
+
+  static std::optional<constval> value_of(const Expr& expr) {
+    if (auto int_expr = dynamic_cast<const IntExpr*>(&expr)) {
+      return int_expr->value;
+    } else if (auto float_expr = dynamic_cast<const FloatExpr*>(&expr)) {
+      return float_expr->value;
+    } else if (dynamic_cast<const TrueExpr*>(&expr)) {
+      return true;
+    } else if (dynamic_cast<const FalseExpr*>(&expr)) {
+      return false;
+    }
+    return std::nullopt;
+  }
+
+  static std::unique_ptr<Expr> make_const(constval value) {
+    std::unique_ptr<Expr> expr;
+    if (auto i = std::get_if<int64_t>(&value)) {
+      expr = std::make_unique<IntExpr>(*i);
+      expr->type = Int::shared;
+    } else if (auto f = std::get_if<double>(&value)) {
+      expr = std::make_unique<FloatExpr>(*f);
+      expr->type = Float::shared;
+    } else {
+      expr = std::get<bool>(value) ? std::unique_ptr<Expr>(std::make_unique<TrueExpr>())
+                                   : std::unique_ptr<Expr>(std::make_unique<FalseExpr>());
+      expr->type = Bool::shared;
+    }
+    return expr;
+  }
+
+ private:
+  std::unordered_map<std::string, constval> constants;
+
+  inline static const std::map<std::string, double (*)(double)> unary_builtins = {
+      {"sqrt", sqrt}, {"exp", exp}, {"sin", sin}, {"cos", cos}, {"tan", tan}, {"asin", asin}, {"acos", acos}, {"atan", atan}, {"log", log}};
+  inline static const std::map<std::string, double (*)(double, double)> binary_builtins = {
+      {"pow", pow}, {"atan2", atan2}};
+
+  void bind(const LValue& lvalue, const Expr& expr) {
+    forget(lvalue);
+    if (auto value = value_of(expr)) {
+      constants[lvalue.identifier] = *value;
+    } else if (auto array_lvalue = dynamic_cast<const ArrayLValue*>(&lvalue)) {
+      // the length of an array literal is known even if its elements are not
+      if (auto literal = dynamic_cast<const ArrayLiteralExpr*>(&expr)) {
+        constants[array_lvalue->indices[0]] = int64_t(literal->elements.size());
+      }
+    }
+  }
+
+  void forget(const LValue& lvalue) {
+    constants.erase(lvalue.identifier);
+    if (auto array_lvalue = dynamic_cast<const ArrayLValue*>(&lvalue)) {
+      for (const auto& index : array_lvalue->indices) {
+        constants.erase(index);
+      }
+    }
+  }
+
+  // non-finite results and negative zero are left for the runtime to produce
+  std::optional<constval> checked(double value) {
+    if (!isfinite(value) || (value == 0.0 && signbit(value))) {
+      return std::nullopt;
+    }
+    return value;
+  }
+
+  std::optional<constval> fold(const std::string& op, int64_t l, int64_t r) {
+    // ints wrap on overflow, so do the arithmetic unsigned
+    auto ul = uint64_t(l), ur = uint64_t(r);
+    if (op == "+") return int64_t(ul + ur);
+    if (op == "-") return int64_t(ul - ur);
+    if (op == "*") return int64_t(ul * ur);
+    if (op == "/" || op == "%") {
+      // division by zero and INT64_MIN / -1 must still fail at runtime
+      if (r == 0 || (l == INT64_MIN && r == -1)) return std::nullopt;
+      return op == "/" ? l / r : l % r;
+    }
+    if (op == "<") return l < r;
+    if (op == ">") return l > r;
+    if (op == "<=") return l <= r;
+    if (op == ">=") return l >= r;
+    if (op == "==") return l == r;
+    if (op == "!=") return l != r;
+    return std::nullopt;
+  }
+
+  std::optional<constval> fold(const std::string& op, double l, double r) {
+    if (op == "+") return checked(l + r);
+    if (op == "-") return checked(l - r);
+    if (op == "*") return checked(l * r);
+    if (op == "/") return checked(l / r);
+    if (op == "%") return checked(fmod(l, r));
+    if (op == "<") return l < r;
+    if (op == ">") return l > r;
+    if (op == "<=") return l <= r;
+    if (op == ">=") return l >= r;
+    if (op == "==") return l == r;
+    if (op == "!=") return l != r;
+    return std::nullopt;
+  }
+};
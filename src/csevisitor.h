@@ -0,0 +1,442 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "astnodes.h"
+#include "rewritevisitor.h"
+
+// Value numbering over pure expressions. Expressions built from the same
+// operators over the same bindings get the same number, whether they are
+// arithmetic, builtin calls, struct fields or indexes into (immutable)
+// arrays. A number computed more than once is bound to a fresh variable at
+// its first unconditional occurrence: a let before that statement in a
+// function or at the top level, or a LetExpr around a loop body. Only
+// unconditional occurrences are hoisted, so no new failures are introduced.
+// A value that can fail is only hoisted there when nothing the statement
+// evaluates before its first occurrence can fail, so the failure reported
+// stays the same; otherwise it is bound by a LetExpr around just its
+// occurrences in that statement, when the same holds within them.
+class CSEVisitor : public RewriteVisitor {
+ public:
+  virtual void visit(const Program& program) override {
+    auto roots = [&]() {
+      std::vector<Root> roots;
+      for (size_t i = 0; i < program.cmds.size(); i++) {
+        if (auto expr = root_of(*program.cmds[i])) {
+          roots.push_back({expr, i});
+        }
+      }
+      return roots;
+    };
+    auto bind = [&](size_t position, std::string name, std::unique_ptr<Expr> value) {
+      auto& cmds = edit(program.cmds);
+      auto let = std::make_unique<LetCmd>(std::make_unique<VarLValue>(name), std::move(value));
+      cmds.insert(cmds.begin() + position, std::move(let));
+    };
+    eliminate(roots, bind, Scope());
+    for (const auto& cmd : program.cmds) {
+      if (dynamic_cast<const FnCmd*>(cmd.get())) {
+        cmd->accept(*this);
+      }
+    }
+  }
+
+  virtual void visit(const FnCmd& fn) override {
+    auto roots = [&]() {
+      std::vector<Root> roots;
+      for (size_t i = 0; i < fn.stmts.size(); i++) {
+        if (auto expr = root_of(*fn.stmts[i])) {
+          roots.push_back({expr, i});
+        }
+      }
+      return roots;
+    };
+    auto bind = [&](size_t position, std::string name, std::unique_ptr<Expr> value) {
+      auto& stmts = edit(fn.stmts);
+      auto let = std::make_unique<LetStmt>(std::make_unique<VarLValue>(name), std::move(value));
+      stmts.insert(stmts.begin() + position, std::move(let));
+    };
+    eliminate(roots, bind, Scope());
+  }
+
+  virtual void visit(const IntExpr& expr) override {
+    result = leaf("i" + std::to_string(expr.value));
+  }
+
+  virtual void visit(const FloatExpr& expr) override {
+    uint64_t bits;
+    std::memcpy(&bits, &expr.value, sizeof(bits));
+    result = leaf("f" + std::to_string(bits));
+  }
+
+  virtual void visit(const TrueExpr& expr) override {
+    result = leaf("true");
+  }
+
+  virtual void visit(const FalseExpr& expr) override {
+    result = leaf("false");
+  }
+
+  virtual void visit(const VoidExpr& expr) override {
+    result = leaf("void");
+  }
+
+  virtual void visit(const VarExpr& expr) override {
+    auto binder = expr.identifier;
+    if (auto it = scope.binders.find(binder); it != scope.binders.end()) {
+      binder = it->second;
+    }
+    result = leaf("x" + binder);
+    result.local = local.count(binder) > 0;
+  }
+
+  virtual void visit(const UnopExpr& expr) override {
+    result = combine("u" + expr.op, {walk(expr.expr)});
+  }
+
+  virtual void visit(const BinopExpr& expr) override {
+    auto left = walk(expr.left);
+    auto outer = unconditional;
+    if (expr.op == "&&" || expr.op == "||") {
+      unconditional = false;
+    }
+    auto right = walk(expr.right);
+    unconditional = outer;
+    result = combine("b" + expr.op, {left, right});
+  }
+
+  virtual void visit(const IfExpr& expr) override {
+    auto condition = walk(expr.condition);
+    auto outer = unconditional;
+    unconditional = false;
+    auto if_value = walk(expr.if_expr);
+    auto else_value = walk(expr.else_expr);
+    unconditional = outer;
+    result = combine("if", {condition, if_value, else_value});
+  }
+
+  virtual void visit(const CallExpr& expr) override {
+    std::vector<Value> args;
+    for (const auto& arg : expr.args) {
+      args.push_back(walk(arg));
+    }
+    result = combine("call " + expr.identifier, args);
+    if (!builtins.count(expr.identifier)) {
+      result.number = -1;
+    }
+  }
+
+  virtual void visit(const ArrayIndexExpr& expr) override {
+    std::vector<Value> values{walk(expr.expr)};
+    for (const auto& index : expr.indices) {
+      values.push_back(walk(index));
+    }
+    result = combine("index", values);
+  }
+
+  virtual void visit(const DotExpr& expr) override {
+    result = combine("." + expr.field, {walk(expr.expr)});
+  }
+
+  virtual void visit(const StructLiteralExpr& expr) override {
+    std::vector<Value> fields;
+    for (const auto& field : expr.fields) {
+      fields.push_back(walk(field));
+    }
+    result = combine("struct " + expr.identifier, fields);
+  }
+
+  virtual void visit(const ArrayLiteralExpr& expr) override {
+    std::vector<Value> elements;
+    for (const auto& element : expr.elements) {
+      elements.push_back(walk(element));
+    }
+    result = combine("array", elements);
+  }
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    result = loop("array", expr.axis, expr.expr);
+  }
+
+  virtual void visit(const SumLoopExpr& expr) override {
+    result = loop("sum", expr.axis, expr.expr);
+  }
+
+  virtual void visit(const LetExpr& expr) override {
+    auto value = walk(expr.value);
+    auto outer = scope.binders;
+    scope.binders[expr.identifier] = expr.identifier;
+    local.insert(expr.identifier);
+    auto body = walk(expr.body);
+    scope.binders = outer;
+    result = combine("let " + expr.identifier, {value, body});
+  }
+
+ private:
+  struct Value {
+    int number;
+    int size;
+    bool local;
+  };
+
+  struct Root {
+    const std::unique_ptr<Expr>* expr;
+    size_t position;
+  };
+
+  struct Occurrence {
+    const std::unique_ptr<Expr>* expr;
+    size_t position;
+    bool unconditional;
+  };
+
+  // loop variables are numbered by nesting depth, so equal loops get equal numbers
+  struct Scope {
+    std::unordered_map<std::string, std::string> binders;
+    int depth = 0;
+  };
+
+  struct Loop {
+    const std::unique_ptr<Expr>* body;
+    Scope scope;
+  };
+
+  std::unordered_map<std::string, int> numbers;
+  std::unordered_map<int, int> sizes;
+  std::map<int, std::vector<Occurrence>> occurrences;
+  std::unordered_set<std::string> local;
+  std::vector<Loop> loops;
+  Scope scope;
+  int base_depth = 0;
+  size_t position = 0;
+  bool unconditional = true;
+  Value result;
+  int ctr = 0;
+
+  typedef std::function<std::vector<Root>()> Roots;
+  typedef std::function<void(size_t, std::string, std::unique_ptr<Expr>)> Bind;
+
+  void eliminate(Roots roots, Bind bind, Scope region) {
+    std::set<std::pair<int, size_t>> kept;
+    while (true) {
+      auto current = roots();
+      number_region(current, region);
+      auto number = pick(kept);
+      if (!number) break;
+      auto& uses = occurrences[*number];
+      auto first = *first_use(*number, uses, kept);
+      auto root = std::find_if(current.begin(), current.end(), [&](const Root& root) { return root.position == first.position; })->expr;
+      std::vector<const Expr*> here, targets;
+      for (const auto& use : uses) {
+        if (use.position != first.position) continue;
+        here.push_back(use.expr->get());
+        if (use.unconditional) targets.push_back(use.expr->get());
+      }
+      auto type = (*first.expr)->type;
+      if (!can_fail(**first.expr) || fails_before(**root, targets) == false) {
+        auto name = "_cse" + std::to_string(ctr++);
+        auto value = take(*first.expr);
+        for (const auto& use : uses) {
+          if (use.position >= first.position) use_var(*use.expr, name, type);
+        }
+        bind(first.position, name, std::move(value));
+        kept.clear();
+        continue;
+      }
+      // something evaluated first in the statement can fail, so bind the
+      // value just around its occurrences there, if that goes first in them
+      auto at = enclosing(*root, here);
+      if (here.size() < 2 || fails_before(**at, targets) != false) {
+        kept.insert({*number, first.position});
+        continue;
+      }
+      auto name = "_cse" + std::to_string(ctr++);
+      auto value = take(*first.expr);
+      for (const auto& use : uses) {
+        if (use.position == first.position) use_var(*use.expr, name, type);
+      }
+      auto body_type = (*at)->type;
+      auto let = std::make_unique<LetExpr>(name, std::move(value), take(*at));
+      let->type = body_type;
+      edit(*at) = std::move(let);
+      kept.clear();
+    }
+
+    // then look for repeated work inside each loop body
+    number_region(roots(), region);
+    auto inner = loops;
+    for (const auto& loop : inner) {
+      auto body = loop.body;
+      auto roots = [=]() { return std::vector<Root>{{body, 0}}; };
+      auto bind = [=](size_t position, std::string name, std::unique_ptr<Expr> value) {
+        auto type = (*body)->type;
+        auto let = std::make_unique<LetExpr>(name, std::move(value), take(*body));
+        let->type = type;
+        edit(*body) = std::move(let);
+      };
+      eliminate(roots, bind, loop.scope);
+    }
+  }
+
+  void number_region(const std::vector<Root>& roots, const Scope& region) {
+    occurrences.clear();
+    local.clear();
+    loops.clear();
+    base_depth = region.depth;
+    for (const auto& root : roots) {
+      scope = region;
+      position = root.position;
+      unconditional = true;
+      walk(*root.expr);
+    }
+  }
+
+  // the largest number computed twice from its first unconditional occurrence
+  // on, skipping the statements it is kept as it is in
+  std::optional<int> pick(const std::set<std::pair<int, size_t>>& kept) {
+    std::optional<int> best;
+    for (const auto& [number, uses] : occurrences) {
+      auto first = first_use(number, uses, kept);
+      if (first == uses.end()) continue;
+      auto count = std::count_if(uses.begin(), uses.end(), [&](const auto& use) { return use.position >= first->position; });
+      if (count < 2) continue;
+      if (!best || sizes[number] > sizes[*best]) {
+        best = number;
+      }
+    }
+    return best;
+  }
+
+  static void use_var(const std::unique_ptr<Expr>& slot, const std::string& name, std::shared_ptr<ResolvedType> type) {
+    auto var = std::make_unique<VarExpr>(name);
+    var->type = type;
+    edit(slot) = std::move(var);
+  }
+
+  // whether evaluating an expression can fail before it reaches one of the
+  // given occurrences, or nullopt when it reaches none
+  static std::optional<bool> fails_before(const Expr& expr, const std::vector<const Expr*>& targets) {
+    if (std::count(targets.begin(), targets.end(), &expr)) return false;
+    if (!count_in(expr, targets)) return can_fail(expr) ? std::optional<bool>(true) : std::nullopt;
+    for (auto child : evaluation_order(expr)) {
+      if (auto failed = fails_before(**child, targets)) return failed;
+    }
+    return std::nullopt;
+  }
+
+  // the parts of an expression in the order the code generator evaluates
+  // them: operands, arguments, elements, indices and bounds last to first
+  static std::vector<const std::unique_ptr<Expr>*> evaluation_order(const Expr& expr) {
+    auto slots = children(expr);
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    if ((binop && binop->op != "&&" && binop->op != "||") || dynamic_cast<const CallExpr*>(&expr) ||
+        dynamic_cast<const ArrayLiteralExpr*>(&expr) || dynamic_cast<const StructLiteralExpr*>(&expr)) {
+      std::reverse(slots.begin(), slots.end());
+    } else if (dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      std::reverse(slots.begin() + 1, slots.end());
+    } else if (auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr)) {
+      std::reverse(slots.begin(), slots.begin() + loop->axis.size());
+    } else if (auto loop = dynamic_cast<const SumLoopExpr*>(&expr)) {
+      std::reverse(slots.begin(), slots.begin() + loop->axis.size());
+    }
+    return slots;
+  }
+
+  // how many of the given occurrences an expression contains
+  static size_t count_in(const Expr& expr, const std::vector<const Expr*>& parts) {
+    size_t found = std::count(parts.begin(), parts.end(), &expr);
+    for (auto child : children(expr)) {
+      found += count_in(**child, parts);
+    }
+    return found;
+  }
+
+  // the innermost slot holding all the given occurrences
+  static const std::unique_ptr<Expr>* enclosing(const std::unique_ptr<Expr>& slot, const std::vector<const Expr*>& parts) {
+    for (auto child : children(*slot)) {
+      if (count_in(**child, parts) == parts.size()) return enclosing(*child, parts);
+    }
+    return &slot;
+  }
+
+  static std::vector<Occurrence>::const_iterator first_use(int number, const std::vector<Occurrence>& uses, const std::set<std::pair<int, size_t>>& kept) {
+    return std::find_if(uses.begin(), uses.end(), [&](const auto& use) { return use.unconditional && !kept.count({number, use.position}); });
+  }
+
+  Value walk(const std::unique_ptr<Expr>& expr) {
+    expr->accept(*this);
+    auto value = result;
+    if (value.number >= 0 && !value.local && value.size > 1 && !expr->type->is<Void>() && !dynamic_cast<const LetExpr*>(expr.get())) {
+      occurrences[value.number].push_back({&expr, position, unconditional});
+      sizes[value.number] = value.size;
+    }
+    return value;
+  }
+
+  Value loop(std::string kind, const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis, const std::unique_ptr<Expr>& body) {
+    std::vector<Value> values;
+    for (const auto& [variable, bound] : axis) {
+      values.push_back(walk(bound));
+    }
+    auto outer = scope;
+    auto outer_unconditional = unconditional;
+    scope.depth++;
+    for (size_t i = 0; i < axis.size(); i++) {
+      scope.binders[axis[i].first] = "^" + std::to_string(scope.depth) + "." + std::to_string(i);
+    }
+    if (outer.depth == base_depth) {
+      loops.push_back({&body, scope});
+    }
+    unconditional = false;
+    values.push_back(walk(body));
+    scope = outer;
+    unconditional = outer_unconditional;
+    return combine(kind + " " + std::to_string(axis.size()), values);
+  }
+
+  Value leaf(std::string signature) {
+    return {number(signature), 1, false};
+  }
+
+  Value combine(std::string signature, const std::vector<Value>& children) {
+    Value value{0, 1, false};
+    for (const auto& child : children) {
+      if (child.number < 0) {
+        value.number = -1;
+      }
+      value.size += child.size;
+      value.local |= child.local;
+      signature += " " + std::to_string(child.number);
+    }
+    if (value.number >= 0) {
+      value.number = number(signature);
+    }
+    return value;
+  }
+
+  int number(const std::string& signature) {
+    auto it = numbers.find(signature);
+    if (it == numbers.end()) {
+      it = numbers.emplace(signature, numbers.size()).first;
+    }
+    return it->second;
+  }
+
+  const std::unique_ptr<Expr>* root_of(const ASTNode& node) {
+    if (auto cmd = dynamic_cast<const LetCmd*>(&node)) return &cmd->expr;
+    if (auto cmd = dynamic_cast<const ShowCmd*>(&node)) return &cmd->expr;
+    if (auto cmd = dynamic_cast<const AssertCmd*>(&node)) return &cmd->expr;
+    if (auto cmd = dynamic_cast<const WriteCmd*>(&node)) return &cmd->expr;
+    if (auto stmt = dynamic_cast<const LetStmt*>(&node)) return &stmt->expr;
+    if (auto stmt = dynamic_cast<const AssertStmt*>(&node)) return &stmt->expr;
+    if (auto stmt = dynamic_cast<const ReturnStmt*>(&node)) return &stmt->expr;
+    return nullptr;
+  }
+};
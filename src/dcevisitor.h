@@ -0,0 +1,198 @@
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "astnodes.h"
+#include "rewritevisitor.h"
+
+// Dead code elimination. A let, let statement, LetExpr or hoisted let whose
+// names are never read afterwards is dropped when its value cannot fail:
+// everything but the checks the earlier passes could not prove away and
+// calls to functions that might fail or not return. That includes whole
+// array loops, so an unused array is never allocated or filled. Functions
+// that no remaining command calls, directly or through other functions, are
+// removed from the program. Removing a let can leave other lets and
+// functions unused, so the sweep repeats until nothing changes.
+class DCEVisitor : public RewriteVisitor {
+ public:
+  virtual void visit(const Program& program) override {
+    // a function is pure when its body cannot fail and it only calls pure
+    // functions defined before it, which rules out recursion
+    for (const auto& cmd : program.cmds) {
+      if (auto fn = dynamic_cast<const FnCmd*>(cmd.get())) {
+        pure[fn->identifier] = pure_body(*fn);
+      }
+    }
+    auto& cmds = edit(program.cmds);
+    do {
+      changed = false;
+      auto reachable = reachable_functions(program);
+      std::unordered_set<std::string> live;
+      for (size_t i = cmds.size(); i-- > 0;) {
+        auto fn = dynamic_cast<const FnCmd*>(cmds[i].get());
+        if (fn && !reachable.count(fn->identifier)) {
+          cmds.erase(cmds.begin() + i);
+          changed = true;
+          continue;
+        }
+        auto let = dynamic_cast<const LetCmd*>(cmds[i].get());
+        if (let && dead(*let->lvalue, *let->expr, live)) {
+          cmds.erase(cmds.begin() + i);
+          changed = true;
+          continue;
+        }
+        cmds[i]->accept(*this);
+        cmd_names(*cmds[i], live);
+      }
+    } while (changed);
+  }
+
+  virtual void visit(const FnCmd& fn) override {
+    auto& stmts = edit(fn.stmts);
+    std::unordered_set<std::string> live;
+    for (size_t i = stmts.size(); i-- > 0;) {
+      auto let = dynamic_cast<const LetStmt*>(stmts[i].get());
+      if (let && dead(*let->lvalue, *let->expr, live)) {
+        stmts.erase(stmts.begin() + i);
+        changed = true;
+        continue;
+      }
+      stmts[i]->accept(*this);
+      cmd_names(*stmts[i], live);
+    }
+  }
+
+  virtual void visit(const LetExpr& expr) override {
+    rewrite(expr.body);
+    std::unordered_set<std::string> used;
+    names(*expr.body, used);
+    if (!used.count(expr.identifier) && !can_fail(*expr.value, pure)) {
+      changed = true;
+      replace(take(expr.body));
+      return;
+    }
+    rewrite(expr.value);
+  }
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    loop(expr.axis, expr.hoisted, expr.expr);
+  }
+
+  virtual void visit(const SumLoopExpr& expr) override {
+    loop(expr.axis, expr.hoisted, expr.expr);
+  }
+
+ private:
+  typedef std::vector<std::pair<std::string, std::unique_ptr<Expr>>> Lets;
+
+  std::unordered_map<std::string, bool> pure;
+  bool changed = false;
+
+  void loop(const Lets& axis, const std::vector<Lets>& hoisted, const std::unique_ptr<Expr>& body) {
+    rewrite(body);
+    std::unordered_set<std::string> used;
+    names(*body, used);
+    // hoisted lets are read by the later ones and the body
+    auto& levels = edit(hoisted);
+    for (size_t k = levels.size(); k-- > 0;) {
+      auto& lets = levels[k];
+      for (size_t j = lets.size(); j-- > 0;) {
+        if (!used.count(lets[j].first) && !can_fail(*lets[j].second, pure)) {
+          lets.erase(lets.begin() + j);
+          changed = true;
+          continue;
+        }
+        rewrite(lets[j].second);
+        names(*lets[j].second, used);
+      }
+    }
+    for (const auto& [variable, bound] : axis) {
+      rewrite(bound);
+    }
+  }
+
+  bool dead(const LValue& lvalue, const Expr& value, const std::unordered_set<std::string>& live) {
+    if (live.count(lvalue.identifier)) return false;
+    if (auto array = dynamic_cast<const ArrayLValue*>(&lvalue)) {
+      for (const auto& name : array->indices) {
+        if (live.count(name)) return false;
+      }
+    }
+    return !can_fail(value, pure);
+  }
+
+  bool pure_body(const FnCmd& fn) {
+    for (const auto& stmt : fn.stmts) {
+      if (dynamic_cast<const AssertStmt*>(stmt.get())) return false;
+      if (auto let = dynamic_cast<const LetStmt*>(stmt.get()); let && can_fail(*let->expr, pure)) return false;
+      if (auto ret = dynamic_cast<const ReturnStmt*>(stmt.get()); ret && can_fail(*ret->expr, pure)) return false;
+    }
+    return true;
+  }
+
+  // the functions called from commands, and from the functions they call
+  std::unordered_set<std::string> reachable_functions(const Program& program) {
+    std::unordered_map<std::string, std::unordered_set<std::string>> callees;
+    std::unordered_set<std::string> reachable;
+    std::vector<std::string> work;
+    for (const auto& cmd : program.cmds) {
+      if (auto fn = dynamic_cast<const FnCmd*>(cmd.get())) {
+        for (const auto& stmt : fn->stmts) {
+          for_each_expr(*stmt, [&](const Expr& expr) { calls(expr, callees[fn->identifier]); });
+        }
+      } else {
+        std::unordered_set<std::string> called;
+        for_each_expr(*cmd, [&](const Expr& expr) { calls(expr, called); });
+        work.insert(work.end(), called.begin(), called.end());
+      }
+    }
+    while (!work.empty()) {
+      auto name = work.back();
+      work.pop_back();
+      if (!reachable.insert(name).second) continue;
+      work.insert(work.end(), callees[name].begin(), callees[name].end());
+    }
+    return reachable;
+  }
+
+  static void calls(const Expr& expr, std::unordered_set<std::string>& called) {
+    if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+      called.insert(call->identifier);
+    }
+    for (auto child : children(expr)) {
+      calls(**child, called);
+    }
+  }
+
+  static void cmd_names(const Cmd& cmd, std::unordered_set<std::string>& used) {
+    for_each_expr(cmd, [&](const Expr& expr) { names(expr, used); });
+  }
+
+  // calls f on the root expressions of a command, statement or function
+  template <typename F>
+  static void for_each_expr(const Cmd& cmd, F f) {
+    if (auto let = dynamic_cast<const LetCmd*>(&cmd)) {
+      f(*let->expr);
+    } else if (auto write = dynamic_cast<const WriteCmd*>(&cmd)) {
+      f(*write->expr);
+    } else if (auto assert = dynamic_cast<const AssertCmd*>(&cmd)) {
+      f(*assert->expr);
+    } else if (auto show = dynamic_cast<const ShowCmd*>(&cmd)) {
+      f(*show->expr);
+    } else if (auto time = dynamic_cast<const TimeCmd*>(&cmd)) {
+      for_each_expr(*time->cmd, f);
+    } else if (auto fn = dynamic_cast<const FnCmd*>(&cmd)) {
+      for (const auto& stmt : fn->stmts) {
+        for_each_expr(*stmt, f);
+      }
+    } else if (auto let = dynamic_cast<const LetStmt*>(&cmd)) {
+      f(*let->expr);
+    } else if (auto assert = dynamic_cast<const AssertStmt*>(&cmd)) {
+      f(*assert->expr);
+    } else if (auto ret = dynamic_cast<const ReturnStmt*>(&cmd)) {
+      f(*ret->expr);
+    }
+  }
+};
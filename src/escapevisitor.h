@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "astnodes.h"
+#include "context.h"
+#include "rewritevisitor.h"
+
+// Escape analysis for arrays. An array literal or an array loop with
+// constant bounds that is bound by a let, and whose name is then only ever
+// indexed, like the kernel in let k = [1.0, 2.0, 1.0] or a small table built
+// in a function called for every pixel, cannot be returned, passed, stored
+// or otherwise outlive the let. Such arrays, when small, are given a place
+// in the frame of their function or of the top-level code, and the code
+// generator builds them there instead of on the heap. Each gets a place of
+// its own, reused by every evaluation of its let, since a let inside a loop
+// is done with its array before the next iteration builds it again.
+//
+// This runs last, so the marks describe the final tree.
+class EscapeVisitor : public RewriteVisitor {
+ public:
+  EscapeVisitor(std::shared_ptr<Context> ctx) : ctx(ctx) {}
+
+  virtual void visit(const Program& program) override {
+    for (const auto& cmd : program.cmds) {
+      auto outer = frame_size;
+      if (dynamic_cast<const FnCmd*>(cmd.get())) frame_size = 0;
+      cmd->accept(*this);
+      if (dynamic_cast<const FnCmd*>(cmd.get())) frame_size = outer;
+    }
+    program.frame_size = frame_size;
+  }
+
+  virtual void visit(const FnCmd& fn) override {
+    RewriteVisitor::visit(fn);
+    for (size_t i = 0; i < fn.stmts.size(); i++) {
+      auto let = dynamic_cast<const LetStmt*>(fn.stmts[i].get());
+      if (!let) continue;
+      bool local = true;
+      for (size_t k = i + 1; k < fn.stmts.size(); k++) {
+        local &= indexed_only(*value_of(*fn.stmts[k]), let->lvalue->identifier);
+      }
+      if (local) place(*let->expr);
+    }
+    fn.frame_size = frame_size;
+  }
+
+  virtual void visit(const LetExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    if (indexed_only(*expr.body, expr.identifier)) place(*expr.value);
+  }
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    hoisted(expr.hoisted, {expr.expr.get(), expr.interior.get()});
+  }
+
+  virtual void visit(const SumLoopExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    hoisted(expr.hoisted, {expr.expr.get()});
+  }
+
+ private:
+  typedef std::vector<std::pair<std::string, std::unique_ptr<Expr>>> Lets;
+
+  // the largest array kept in a frame, and the most all of a frame's
+  // arrays may take, in bytes
+  static constexpr int64_t max_array = 4096;
+  static constexpr int64_t max_frame = 16384;
+
+  std::shared_ptr<Context> ctx;
+  // bytes taken so far in the frame being visited
+  int64_t frame_size = 0;
+
+  static const std::unique_ptr<Expr>& value_of(const Stmt& stmt) {
+    if (auto let = dynamic_cast<const LetStmt*>(&stmt)) return let->expr;
+    if (auto assert = dynamic_cast<const AssertStmt*>(&stmt)) return assert->expr;
+    return static_cast<const ReturnStmt&>(stmt).expr;
+  }
+
+  // lets hoisted out of a loop are in scope in the lets after them and in
+  // the bodies
+  void hoisted(const std::vector<Lets>& hoisted, const std::vector<const Expr*>& bodies) {
+    std::vector<std::pair<const std::string*, const Expr*>> lets;
+    for (const auto& group : hoisted) {
+      for (const auto& [identifier, value] : group) lets.emplace_back(&identifier, value.get());
+    }
+    for (size_t i = 0; i < lets.size(); i++) {
+      const auto& name = *lets[i].first;
+      bool local = true;
+      size_t k = i + 1;
+      for (; k < lets.size() && local; k++) {
+        local &= indexed_only(*lets[k].second, name);
+        if (*lets[k].first == name) break;
+      }
+      if (k == lets.size()) {
+        for (auto body : bodies) {
+          if (body) local &= indexed_only(*body, name);
+        }
+      }
+      if (local) place(*lets[i].second);
+    }
+  }
+
+  // gives an array built by the expression a place in the frame, if it is
+  // small enough and there is room
+  void place(const Expr& expr) {
+    auto element = [&](const Expr& array) { return array.type->as<Array>()->element_type->size(ctx.get()); };
+    int64_t size = 0;
+    int64_t* mark = nullptr;
+    if (auto literal = dynamic_cast<const ArrayLiteralExpr*>(&expr)) {
+      size = literal->elements.size() * element(expr);
+      mark = &literal->frame;
+    } else if (auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr)) {
+      size = element(expr);
+      for (const auto& [_, bound] : loop->axis) {
+        auto constant = dynamic_cast<const IntExpr*>(bound.get());
+        if (!constant || constant->value <= 0 || constant->value > max_array) return;
+        size *= constant->value;
+        if (size > max_array) return;
+      }
+      mark = &loop->frame;
+    }
+    if (!mark || *mark >= 0 || size <= 0 || size > max_array) return;
+    // each array starts 16-byte aligned
+    size = (size + 15) / 16 * 16;
+    if (frame_size + size > max_frame) return;
+    *mark = frame_size;
+    frame_size += size;
+  }
+
+  // whether every free use of a name indexes it
+  static bool indexed_only(const Expr& expr, const std::string& name) {
+    if (auto var = dynamic_cast<const VarExpr*>(&expr)) return var->identifier != name;
+    if (auto index = dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      auto var = dynamic_cast<const VarExpr*>(index->expr.get());
+      if (var && var->identifier == name) {
+        for (const auto& i : index->indices) {
+          if (!indexed_only(*i, name)) return false;
+        }
+        return true;
+      }
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      return indexed_only(*let->value, name) && (let->identifier == name || indexed_only(*let->body, name));
+    }
+    auto inside = [&](const Lets& axis, const std::vector<Lets>& hoisted, const std::vector<const Expr*>& bodies) {
+      for (const auto& [_, bound] : axis) {
+        if (!indexed_only(*bound, name)) return false;
+      }
+      for (const auto& [variable, _] : axis) {
+        if (variable == name) return true;
+      }
+      for (const auto& lets : hoisted) {
+        for (const auto& [identifier, value] : lets) {
+          if (!indexed_only(*value, name)) return false;
+          if (identifier == name) return true;
+        }
+      }
+      for (auto body : bodies) {
+        if (body && !indexed_only(*body, name)) return false;
+      }
+      return true;
+    };
+    if (auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr)) return inside(loop->axis, loop->hoisted, {loop->expr.get(), loop->interior.get()});
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(&expr)) return inside(loop->axis, loop->hoisted, {loop->expr.get()});
+    for (auto child : children(expr)) {
+      if (!indexed_only(**child, name)) return false;
+    }
+    return true;
+  }
+};
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "affine.h"
+#include "astnodes.h"
+#include "clonevisitor.h"
+#include "rewritevisitor.h"
+
+// Index-set splitting. A branch on how near the loop variables are to the
+// edges of the array, like the padding test i == 0 || i == H + 1 || j == 0
+// || j == W + 1 over array[i : H + 2, j : W + 2], goes the same way in all
+// but a few rows and columns. The loop is given an interior body with such
+// branches resolved, and margins outside of which it does not hold; the code
+// generator runs the original body over the border and the interior body,
+// without the branch, over the rest. A condition is resolved from the
+// comparisons of a loop variable, plus a constant, with a constant or with
+// the loop's bound plus a constant, combined with !, && and ||.
+//
+// The border is computed before the interior, so only loops whose body
+// cannot fail are split. This runs last, on one- and two-axis loops that
+// the earlier passes left in order and untiled; the interior keeps the
+// marks they made.
+class IndexSplitVisitor : public RewriteVisitor {
+ public:
+  virtual void visit(const LetExpr& expr) override {
+    rewrite(expr.value);
+    auto outer = scope;
+    bind(expr.identifier, *expr.value, scope);
+    rewrite(expr.body);
+    scope = outer;
+  }
+
+  virtual void visit(const SumLoopExpr& expr) override {
+    auto outer = scope;
+    shadow(expr.axis, expr.hoisted);
+    RewriteVisitor::visit(expr);
+    scope = outer;
+  }
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    auto outer = scope;
+    shadow(expr.axis, expr.hoisted);
+    RewriteVisitor::visit(expr);
+    scope = outer;
+    split(expr);
+  }
+
+ private:
+  typedef std::vector<std::pair<std::string, std::unique_ptr<Expr>>> Lets;
+  typedef std::vector<std::pair<int64_t, int64_t>> Margins;
+
+  // the widest margin worth running the original body over
+  inline static const int64_t max_margin = 8;
+  // constants compared with are kept small, so no value wraps around
+  inline static const int64_t max_constant = int64_t(1) << 32;
+
+  struct Scope {
+    // int lets with an affine value, in terms of names bound outside them
+    std::map<std::string, Affine> affine;
+    // bool lets, with the names their value reads
+    std::map<std::string, std::pair<const Expr*, std::unordered_set<std::string>>> conditions;
+    // the loop's variables and bounds, outer axis first
+    std::vector<std::string> variables;
+    std::vector<std::optional<Affine>> bounds;
+  };
+
+  Scope scope;
+
+  void shadow(const Lets& axis, const std::vector<Lets>& hoisted) {
+    for (const auto& [variable, _] : axis) forget(variable, scope);
+    for (const auto& lets : hoisted) {
+      for (const auto& [identifier, _] : lets) forget(identifier, scope);
+    }
+  }
+
+  void split(const ArrayLoopExpr& expr) {
+    auto num_e = expr.axis.size();
+    if (num_e > 2 || expr.tile || !expr.dims.empty() || expr.interior || can_fail(*expr.expr)) return;
+    // the code generator checks for the interior where the body starts
+    if (expr.hoisted.size() >= num_e && !expr.hoisted.back().empty()) return;
+    Scope inner = scope;
+    for (const auto& [variable, bound] : expr.axis) {
+      inner.bounds.push_back(resolve(*bound, scope));
+    }
+    for (const auto& [variable, _] : expr.axis) {
+      forget(variable, inner);
+      inner.variables.push_back(variable);
+    }
+    for (const auto& lets : expr.hoisted) {
+      for (const auto& [identifier, value] : lets) bind(identifier, *value, inner);
+    }
+    Margins margins(num_e);
+    auto walked = inner;
+    if (!walk(expr.expr, walked, margins, true)) return;
+    auto interior = CloneVisitor::clone(*expr.expr, true);
+    walk(interior, inner, margins, false);
+    auto whole = std::all_of(margins.begin(), margins.end(), [](const auto& margin) { return !margin.first && !margin.second; });
+    if (whole) {
+      // the branches go the same way everywhere
+      edit(expr.expr) = std::move(interior);
+      return;
+    }
+    expr.interior = std::move(interior);
+    expr.margins = margins;
+  }
+
+  // the branches of a body that go one way over the interior, widening the
+  // margins to make them when allowed, or else replacing them with the way
+  // they go; branches inside nested loops are left alone
+  int walk(const std::unique_ptr<Expr>& slot, Scope& scope, Margins& margins, bool widen) {
+    if (dynamic_cast<const ArrayLoopExpr*>(slot.get()) || dynamic_cast<const SumLoopExpr*>(slot.get())) return 0;
+    if (auto let = dynamic_cast<const LetExpr*>(slot.get())) {
+      auto resolved = walk(let->value, scope, margins, widen);
+      auto outer = scope;
+      bind(let->identifier, *let->value, scope);
+      resolved += walk(let->body, scope, margins, widen);
+      scope = outer;
+      return resolved;
+    }
+    if (auto branch = dynamic_cast<const IfExpr*>(slot.get())) {
+      auto trial = margins;
+      if (auto value = decide(*branch->condition, scope, trial, widen)) {
+        margins = trial;
+        const auto& taken = *value ? branch->if_expr : branch->else_expr;
+        if (widen) return 1 + walk(taken, scope, margins, widen);
+        edit(slot) = take(taken);
+        return 1 + walk(slot, scope, margins, widen);
+      }
+    }
+    int resolved = 0;
+    for (auto child : children(*slot)) {
+      resolved += walk(*child, scope, margins, widen);
+    }
+    return resolved;
+  }
+
+  // the value of a condition over the interior, if it has one
+  std::optional<bool> decide(const Expr& expr, const Scope& scope, Margins& margins, bool widen) {
+    if (dynamic_cast<const TrueExpr*>(&expr)) return true;
+    if (dynamic_cast<const FalseExpr*>(&expr)) return false;
+    if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+      auto it = scope.conditions.find(var->identifier);
+      if (it == scope.conditions.end()) return std::nullopt;
+      return decide(*it->second.first, scope, margins, widen);
+    }
+    if (auto unop = dynamic_cast<const UnopExpr*>(&expr); unop && unop->op == "!") {
+      auto value = decide(*unop->expr, scope, margins, widen);
+      if (!value) return std::nullopt;
+      return !*value;
+    }
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    if (!binop) return std::nullopt;
+    if (binop->op == "&&" || binop->op == "||") {
+      // the value either side settles the condition with
+      auto settles = binop->op == "||";
+      auto left = decide(*binop->left, scope, margins, widen);
+      if (left == settles) return settles;
+      auto right = decide(*binop->right, scope, margins, widen);
+      if (right == settles) return settles;
+      if (left && right) return !settles;
+      return std::nullopt;
+    }
+    return compare(*binop, scope, margins, widen);
+  }
+
+  // a comparison of one loop variable, as v op t for a t near zero or near
+  // the variable's bound
+  std::optional<bool> compare(const BinopExpr& binop, const Scope& scope, Margins& margins, bool widen) {
+    static const std::set<std::string> ops = {"==", "!=", "<", "<=", ">", ">="};
+    if (!ops.count(binop.op) || !binop.left->type || !binop.left->type->is<Int>()) return std::nullopt;
+    auto left = resolve(*binop.left, scope);
+    auto right = resolve(*binop.right, scope);
+    if (!left || !right || !small(*left, scope) || !small(*right, scope)) return std::nullopt;
+    auto difference = left->add(*right, -1);
+    if (!difference) return std::nullopt;
+    int axis = -1;
+    int64_t sign = 0;
+    for (size_t k = 0; k < scope.variables.size(); k++) {
+      auto coefficient = difference->coefficient(scope.variables[k]);
+      if (coefficient == 0) continue;
+      if (axis >= 0 || (coefficient != 1 && coefficient != -1)) return std::nullopt;
+      axis = k;
+      sign = coefficient;
+    }
+    if (axis < 0) return std::nullopt;
+    // v + rest op 0, that is v op -rest, and v op bound - offset
+    auto op = binop.op;
+    auto rest = *difference->scale(sign);
+    if (sign < 0) op = mirror(op);
+    rest.terms.erase(scope.variables[axis]);
+    const auto& bound = scope.bounds[axis];
+    auto offset = bound ? rest.add(*bound) : std::nullopt;
+    auto& [first, last] = margins[axis];
+    auto from_low = first, from_high = last;
+    std::optional<bool> by_low, by_high;
+    if (rest.is_constant()) by_low = low(op, -rest.constant, from_low, widen);
+    if (offset && offset->is_constant()) by_high = high(op, offset->constant, from_high, widen);
+    // a constant bound allows either, whichever needs the narrower margin
+    if (by_low && (!by_high || from_low - first <= from_high - last)) {
+      first = from_low;
+      return by_low;
+    }
+    last = from_high;
+    return by_high;
+  }
+
+  static std::string mirror(const std::string& op) {
+    if (op == "<") return ">";
+    if (op == "<=") return ">=";
+    if (op == ">") return "<";
+    if (op == ">=") return "<=";
+    return op;
+  }
+
+  // v op t, for v at least the low margin
+  static std::optional<bool> low(const std::string& op, int64_t t, int64_t& margin, bool widen) {
+    if (op == "==" || op == "!=") return settle(t + 1, op == "!=", margin, widen);
+    if (op == "<" || op == ">=") return settle(t, op == ">=", margin, widen);
+    return settle(t + 1, op == ">", margin, widen);
+  }
+
+  // v op bound - c, for v short of the bound by at least the high margin
+  static std::optional<bool> high(const std::string& op, int64_t c, int64_t& margin, bool widen) {
+    if (op == "==" || op == "!=") return settle(c, op == "!=", margin, widen);
+    if (op == "<" || op == ">=") return settle(c, op == "<", margin, widen);
+    return settle(c - 1, op == "<=", margin, widen);
+  }
+
+  // a comparison that has its value once the margin is at least need
+  static std::optional<bool> settle(int64_t need, bool value, int64_t& margin, bool widen) {
+    need = std::max<int64_t>(need, 0);
+    if (margin < need) {
+      if (!widen || need > max_margin) return std::nullopt;
+      margin = need;
+    }
+    return value;
+  }
+
+  // whether an int lies near zero, a loop variable or a bound, where its
+  // value is the same as the affine expression's
+  static bool small(Affine value, const Scope& scope) {
+    for (const auto& variable : scope.variables) {
+      auto coefficient = value.coefficient(variable);
+      if (coefficient < -1 || coefficient > 1) return false;
+      value.terms.erase(variable);
+    }
+    auto near = [](const Affine& rest) { return rest.is_constant() && rest.constant > -max_constant && rest.constant < max_constant; };
+    if (near(value)) return true;
+    for (const auto& bound : scope.bounds) {
+      if (!bound) continue;
+      for (int64_t factor : {-1, 1}) {
+        auto rest = value.add(*bound, factor);
+        if (rest && near(*rest)) return true;
+      }
+    }
+    return false;
+  }
+
+  static std::optional<Affine> resolve(const Expr& expr, const Scope& scope) {
+    if (!expr.type || !expr.type->is<Int>()) return std::nullopt;
+    auto affine = Affine::of(expr);
+    if (!affine) return std::nullopt;
+    auto terms = affine->terms;
+    for (const auto& [name, _] : terms) {
+      if (auto it = scope.affine.find(name); it != scope.affine.end()) {
+        affine = affine->substitute(name, it->second);
+        if (!affine) return std::nullopt;
+      }
+    }
+    return affine;
+  }
+
+  static void bind(const std::string& identifier, const Expr& value, Scope& scope) {
+    auto affine = resolve(value, scope);
+    forget(identifier, scope);
+    if (affine) {
+      if (!affine->coefficient(identifier)) scope.affine[identifier] = *affine;
+    } else if (value.type && value.type->is<Bool>()) {
+      std::unordered_set<std::string> used;
+      names(value, used);
+      if (!used.count(identifier)) scope.conditions[identifier] = {&value, used};
+    }
+  }
+
+  // drops what is known about a name being bound again, and about the
+  // values that read it
+  static void forget(const std::string& name, Scope& scope) {
+    scope.affine.erase(name);
+    scope.conditions.erase(name);
+    for (auto it = scope.affine.begin(); it != scope.affine.end();) {
+      it = it->second.coefficient(name) ? scope.affine.erase(it) : std::next(it);
+    }
+    for (auto it = scope.conditions.begin(); it != scope.conditions.end();) {
+      it = it->second.second.count(name) ? scope.conditions.erase(it) : std::next(it);
+    }
+  }
+};
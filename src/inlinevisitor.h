@@ -0,0 +1,378 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "astnodes.h"
+#include "clonevisitor.h"
+#include "rewritevisitor.h"
+
+// Inlines calls to small functions. A function whose body is a list of lets
+// ending in a return becomes a chain of LetExprs at each call site, with its
+// locals renamed apart and its arguments either substituted (constants and
+// variables) or bound to fresh names, the last argument first as the call
+// evaluates them. The decision is made per call from the size of the body:
+// always when it is about as small as the call sequence, up to a larger
+// limit inside loops, and for any size when it is the only call. Functions
+// are processed in order, so callees are already inlined into by the time
+// their own calls are considered.
+class InlineVisitor : public RewriteVisitor {
+ public:
+  virtual void visit(const Program& program) override {
+    for (const auto& cmd : program.cmds) {
+      count_calls(*cmd);
+    }
+    ASTVisitor::visit(program);
+  }
+
+  virtual void visit(const ReadCmd& cmd) override {
+    add_dims(*cmd.lvalue);
+  }
+
+  virtual void visit(const LetCmd& cmd) override {
+    RewriteVisitor::visit(cmd);
+    add_dims(*cmd.lvalue);
+  }
+
+  virtual void visit(const LetStmt& stmt) override {
+    RewriteVisitor::visit(stmt);
+    add_dims(*stmt.lvalue);
+  }
+
+  virtual void visit(const FnCmd& fn) override {
+    auto outer_dims = dims;
+    auto outer_growth = growth;
+    growth = 0;
+    for (const auto& param : fn.params) {
+      add_dims(*param->lvalue);
+    }
+    RewriteVisitor::visit(fn);
+    dims = outer_dims;
+    growth = outer_growth;
+    if (inlinable(fn)) {
+      functions[fn.identifier] = &fn;
+    }
+  }
+
+  virtual void visit(const CallExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    auto it = functions.find(expr.identifier);
+    if (it == functions.end()) return;
+    auto& fn = *it->second;
+    auto size = size_of(fn);
+    auto call_cost = 6 + 2 * static_cast<int>(expr.args.size());
+    bool worth = size <= call_cost || (loops > 0 && size <= loop_limit) || calls[fn.identifier] == 1;
+    if (!worth || growth + size > growth_limit) return;
+    if (auto body = expand(fn, expr)) {
+      growth += size;
+      replace(std::move(body));
+    }
+  }
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    loop(expr.axis, expr.expr);
+  }
+
+  virtual void visit(const SumLoopExpr& expr) override {
+    loop(expr.axis, expr.expr);
+  }
+
+  virtual void visit(const LetExpr& expr) override {
+    rewrite(expr.value);
+    bound.insert(expr.identifier);
+    rewrite(expr.body);
+    bound.erase(bound.find(expr.identifier));
+  }
+
+ private:
+  // largest body inlined into a loop, in AST nodes
+  static constexpr int loop_limit = 120;
+  // most code a single function or the top level may grow by
+  static constexpr int growth_limit = 2000;
+
+  std::unordered_map<std::string, const FnCmd*> functions;
+  std::unordered_map<std::string, int> calls;
+  // dimension variables of the arrays in scope
+  std::unordered_map<std::string, std::vector<std::string>> dims;
+  // names bound by the loops and lets around the current expression
+  std::unordered_multiset<std::string> bound;
+  int loops = 0;
+  int growth = 0;
+  int ctr = 0;
+
+  void loop(const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis, const std::unique_ptr<Expr>& body) {
+    for (const auto& [variable, limit] : axis) {
+      rewrite(limit);
+    }
+    for (const auto& [variable, _] : axis) {
+      bound.insert(variable);
+    }
+    loops++;
+    rewrite(body);
+    loops--;
+    for (const auto& [variable, _] : axis) {
+      bound.erase(bound.find(variable));
+    }
+  }
+
+  void add_dims(const LValue& lvalue) {
+    if (auto array = dynamic_cast<const ArrayLValue*>(&lvalue)) {
+      dims[array->identifier] = array->indices;
+    } else {
+      dims.erase(lvalue.identifier);
+    }
+  }
+
+  void count_calls(const ASTNode& node) {
+    const Expr* expr = nullptr;
+    if (auto cmd = dynamic_cast<const LetCmd*>(&node)) expr = cmd->expr.get();
+    if (auto cmd = dynamic_cast<const ShowCmd*>(&node)) expr = cmd->expr.get();
+    if (auto cmd = dynamic_cast<const AssertCmd*>(&node)) expr = cmd->expr.get();
+    if (auto cmd = dynamic_cast<const WriteCmd*>(&node)) expr = cmd->expr.get();
+    if (auto cmd = dynamic_cast<const TimeCmd*>(&node)) count_calls(*cmd->cmd);
+    if (auto stmt = dynamic_cast<const LetStmt*>(&node)) expr = stmt->expr.get();
+    if (auto stmt = dynamic_cast<const AssertStmt*>(&node)) expr = stmt->expr.get();
+    if (auto stmt = dynamic_cast<const ReturnStmt*>(&node)) expr = stmt->expr.get();
+    if (auto fn = dynamic_cast<const FnCmd*>(&node)) {
+      for (const auto& stmt : fn->stmts) {
+        count_calls(*stmt);
+      }
+    }
+    if (expr) count_calls(*expr);
+  }
+
+  void count_calls(const Expr& expr) {
+    if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+      calls[call->identifier]++;
+    }
+    for (auto child : children(expr)) {
+      count_calls(**child);
+    }
+  }
+
+  // a function is inlined as an expression, so it may only hold lets
+  // (without dimension variables that are used) up to its return
+  bool inlinable(const FnCmd& fn) {
+    std::unordered_set<std::string> used;
+    for (const auto& stmt : fn.stmts) {
+      if (auto let = dynamic_cast<const LetStmt*>(stmt.get())) {
+        names(*let->expr, used);
+      } else if (auto ret = dynamic_cast<const ReturnStmt*>(stmt.get())) {
+        names(*ret->expr, used);
+        if (calls_to(*ret->expr, fn.identifier)) return false;
+        break;
+      } else {
+        return false;
+      }
+    }
+    for (const auto& stmt : fn.stmts) {
+      auto let = dynamic_cast<const LetStmt*>(stmt.get());
+      if (!let) break;
+      if (calls_to(*let->expr, fn.identifier)) return false;
+      if (auto array = dynamic_cast<const ArrayLValue*>(let->lvalue.get())) {
+        for (const auto& dim : array->indices) {
+          if (used.count(dim)) return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  static bool calls_to(const Expr& expr, const std::string& name) {
+    if (auto call = dynamic_cast<const CallExpr*>(&expr); call && call->identifier == name) return true;
+    for (auto child : children(expr)) {
+      if (calls_to(**child, name)) return true;
+    }
+    return false;
+  }
+
+  static int size_of(const Expr& expr) {
+    int size = 1;
+    for (auto child : children(expr)) {
+      size += size_of(**child);
+    }
+    return size;
+  }
+
+  static int size_of(const FnCmd& fn) {
+    int size = 0;
+    for (const auto& stmt : fn.stmts) {
+      if (auto let = dynamic_cast<const LetStmt*>(stmt.get())) {
+        size += size_of(*let->expr) + 1;
+      } else if (auto ret = dynamic_cast<const ReturnStmt*>(stmt.get())) {
+        size += size_of(*ret->expr);
+        break;
+      }
+    }
+    return size;
+  }
+
+  // names used but not bound inside an expression
+  static void free_names(const Expr& expr, std::unordered_set<std::string> bound, std::unordered_set<std::string>& free) {
+    if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+      if (!bound.count(var->identifier)) free.insert(var->identifier);
+      return;
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      free_names(*let->value, bound, free);
+      bound.insert(let->identifier);
+      free_names(*let->body, bound, free);
+      return;
+    }
+    auto loop = [&](const auto& axis, const Expr& body) {
+      for (const auto& [variable, bound_expr] : axis) {
+        free_names(*bound_expr, bound, free);
+      }
+      for (const auto& [variable, _] : axis) {
+        bound.insert(variable);
+      }
+      free_names(body, bound, free);
+    };
+    if (auto node = dynamic_cast<const ArrayLoopExpr*>(&expr)) return loop(node->axis, *node->expr);
+    if (auto node = dynamic_cast<const SumLoopExpr*>(&expr)) return loop(node->axis, *node->expr);
+    for (auto child : children(expr)) {
+      free_names(**child, bound, free);
+    }
+  }
+
+  // every name bound anywhere inside an expression
+  static void binders(const Expr& expr, std::unordered_set<std::string>& bound) {
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) bound.insert(let->identifier);
+    if (auto node = dynamic_cast<const ArrayLoopExpr*>(&expr)) {
+      for (const auto& [variable, _] : node->axis) bound.insert(variable);
+    }
+    if (auto node = dynamic_cast<const SumLoopExpr*>(&expr)) {
+      for (const auto& [variable, _] : node->axis) bound.insert(variable);
+    }
+    for (auto child : children(expr)) {
+      binders(**child, bound);
+    }
+  }
+
+  // replaces every use of a name that is never rebound
+  static void substitute(const std::unique_ptr<Expr>& expr, const std::string& name, const Expr& value) {
+    if (auto var = dynamic_cast<const VarExpr*>(expr.get())) {
+      if (var->identifier == name) {
+        edit(expr) = CloneVisitor::clone(value);
+      }
+      return;
+    }
+    for (auto child : children(*expr)) {
+      substitute(*child, name, value);
+    }
+  }
+
+  // the body of the function as an expression over the call's arguments, or
+  // null if it cannot be placed here without changing what its names refer to
+  std::unique_ptr<Expr> expand(const FnCmd& fn, const CallExpr& call) {
+    std::vector<const std::unique_ptr<Expr>*> exprs;
+    std::vector<std::string> lets;
+    std::unordered_set<std::string> locals;
+    const std::unique_ptr<Expr>* result = nullptr;
+    for (const auto& param : fn.params) {
+      locals.insert(param->lvalue->identifier);
+      if (auto array = dynamic_cast<const ArrayLValue*>(param->lvalue.get())) {
+        locals.insert(array->indices.begin(), array->indices.end());
+      }
+    }
+    for (const auto& stmt : fn.stmts) {
+      if (auto let = dynamic_cast<const LetStmt*>(stmt.get())) {
+        exprs.push_back(&let->expr);
+        lets.push_back(let->lvalue->identifier);
+        locals.insert(let->lvalue->identifier);
+      } else if (auto ret = dynamic_cast<const ReturnStmt*>(stmt.get())) {
+        result = &ret->expr;
+        break;
+      }
+    }
+
+    std::unordered_set<std::string> free, inner;
+    for (auto expr : exprs) {
+      free_names(**expr, locals, free);
+      binders(**expr, inner);
+    }
+    if (result) {
+      free_names(**result, locals, free);
+      binders(**result, inner);
+    }
+    // globals read by the body must not be shadowed at the call
+    for (const auto& name : free) {
+      if (bound.count(name)) return nullptr;
+    }
+
+    // dimension variables of array parameters come from the argument's binding
+    std::unordered_set<std::string> used;
+    for (auto expr : exprs) names(**expr, used);
+    if (result) names(**result, used);
+    std::vector<std::pair<std::string, std::string>> dim_names;
+    for (size_t i = 0; i < fn.params.size(); i++) {
+      auto array = dynamic_cast<const ArrayLValue*>(fn.params[i]->lvalue.get());
+      if (!array) continue;
+      for (size_t d = 0; d < array->indices.size(); d++) {
+        if (!used.count(array->indices[d])) continue;
+        auto var = dynamic_cast<const VarExpr*>(call.args[i].get());
+        if (!var || !dims.count(var->identifier)) return nullptr;
+        auto dim = dims[var->identifier][d];
+        if (bound.count(dim) || inner.count(dim)) return nullptr;
+        dim_names.emplace_back(array->indices[d], dim);
+      }
+    }
+
+    // rename the function's own variables apart
+    std::map<std::string, std::string> fresh;
+    for (const auto& param : fn.params) {
+      fresh[param->lvalue->identifier] = "_inl" + std::to_string(ctr++);
+    }
+    for (const auto& let : lets) {
+      fresh[let] = "_inl" + std::to_string(ctr++);
+    }
+    auto prepare = [&](const Expr& expr) {
+      auto copy = CloneVisitor::clone(expr);
+      for (const auto& [from, to] : fresh) {
+        rename(copy, from, to);
+      }
+      for (const auto& [from, to] : dim_names) {
+        rename(copy, from, to);
+      }
+      return copy;
+    };
+
+    std::unique_ptr<Expr> body;
+    if (result) {
+      body = prepare(**result);
+    } else {
+      body = std::make_unique<VoidExpr>();
+      body->type = fn.return_type->type;
+    }
+    for (int i = lets.size() - 1; i >= 0; i--) {
+      auto type = body->type;
+      body = std::make_unique<LetExpr>(fresh[lets[i]], prepare(**exprs[i]), std::move(body));
+      body->type = type;
+    }
+
+    // arguments that are constants or variables not rebound inside are
+    // substituted, the rest are evaluated before the body, last to first
+    // as the call evaluates them
+    std::vector<std::pair<std::string, std::unique_ptr<Expr>>> bindings;
+    for (size_t i = 0; i < fn.params.size(); i++) {
+      auto name = fresh[fn.params[i]->lvalue->identifier];
+      auto& arg = call.args[i];
+      auto var = dynamic_cast<const VarExpr*>(arg.get());
+      bool constant = dynamic_cast<const IntExpr*>(arg.get()) || dynamic_cast<const FloatExpr*>(arg.get()) ||
+                      dynamic_cast<const TrueExpr*>(arg.get()) || dynamic_cast<const FalseExpr*>(arg.get());
+      if (constant || (var && !inner.count(var->identifier))) {
+        substitute(body, name, *arg);
+      } else {
+        bindings.emplace_back(name, take(arg));
+      }
+    }
+    for (size_t i = 0; i < bindings.size(); i++) {
+      auto type = body->type;
+      body = std::make_unique<LetExpr>(bindings[i].first, std::move(bindings[i].second), std::move(body));
+      body->type = type;
+    }
+    return body;
+  }
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "affine.h"
+#include "astnodes.h"
+#include "rewritevisitor.h"
+
+// Loop interchange. Arrays are stored row-major, so a loop whose innermost
+// axis indexes anything but the last dimension of the arrays it reads, like
+// img[j, i] in array[i : H, j : W], jumps a whole row every iteration. The
+// axis that the fewest accesses stride over is moved innermost, the others
+// keeping their order. An array loop's own store counts as an access: after
+// an interchange it no longer fills its array in order, and ArrayLoopExpr::
+// dims records which dimension each axis now runs over.
+//
+// Reordering changes which iteration would fail first, so only loops whose
+// body and bounds cannot fail are interchanged, and sums only when they are
+// integers: reassociating a float sum changes its value. This runs after
+// bounds check elimination, whose per-axis marks are permuted with the
+// axes, and before LICM, which hoists by axis.
+class InterchangeVisitor : public RewriteVisitor {
+ public:
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    if (!expr.hoisted.empty() || !expr.dims.empty()) return;
+    auto order = best_order(expr.axis, *expr.expr, true);
+    if (!order) return;
+    expr.dims = *order;
+    permute(expr.axis, expr.bound_safe, *order);
+  }
+
+  virtual void visit(const SumLoopExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    if (!expr.type->is<Int>() || !expr.hoisted.empty()) return;
+    auto order = best_order(expr.axis, *expr.expr, false);
+    if (!order) return;
+    permute(expr.axis, expr.bound_safe, *order);
+  }
+
+ private:
+  typedef std::vector<std::pair<std::string, std::unique_ptr<Expr>>> Lets;
+
+  // the position of each variable in the indices of one read, in terms of
+  // the names bound outside the loop
+  struct Access {
+    std::vector<Affine> indices;
+  };
+
+  static void permute(const Lets& axis, const std::vector<bool>& marks, const std::vector<size_t>& order) {
+    Lets reordered;
+    std::vector<bool> reordered_marks;
+    for (auto k : order) {
+      reordered.emplace_back(axis[k].first, std::move(edit(axis[k].second)));
+      reordered_marks.push_back(k < marks.size() && marks[k]);
+    }
+    edit(axis) = std::move(reordered);
+    edit(marks) = std::move(reordered_marks);
+  }
+
+  // the axes in their new order, original position by new position, when
+  // some other axis is a better innermost one
+  std::optional<std::vector<size_t>> best_order(const Lets& axis, const Expr& body, bool stores) {
+    if (axis.size() < 2 || can_fail(body)) return std::nullopt;
+    for (const auto& [_, bound] : axis) {
+      if (can_fail(*bound)) return std::nullopt;
+    }
+    std::vector<Access> accesses;
+    std::map<std::string, Affine> lets;
+    find_accesses(body, lets, accesses);
+    std::vector<int> strides(axis.size(), 0);
+    for (size_t k = 0; k < axis.size(); k++) {
+      for (const auto& access : accesses) {
+        strides[k] += strided(access, axis[k].first);
+      }
+      // the loop's own element goes at [axis 0, ..., axis n-1]
+      if (stores && k + 1 != axis.size()) strides[k]++;
+    }
+    auto innermost = axis.size() - 1;
+    auto best = innermost;
+    for (size_t k = 0; k < axis.size(); k++) {
+      if (strides[k] < strides[best]) best = k;
+    }
+    if (best == innermost) return std::nullopt;
+    std::vector<size_t> order;
+    for (size_t k = 0; k < axis.size(); k++) {
+      if (k != best) order.push_back(k);
+    }
+    order.push_back(best);
+    return order;
+  }
+
+  // whether an access moves by more than one element as var steps
+  static bool strided(const Access& access, const std::string& var) {
+    for (size_t k = 0; k < access.indices.size(); k++) {
+      auto coefficient = access.indices[k].coefficient(var);
+      if (coefficient == 0) continue;
+      if (k + 1 != access.indices.size() || (coefficient != 1 && coefficient != -1)) return true;
+    }
+    return false;
+  }
+
+  // the reads evaluated directly in the body, not in nested loops, whose
+  // indices are affine
+  void find_accesses(const Expr& expr, std::map<std::string, Affine>& lets, std::vector<Access>& accesses) {
+    if (dynamic_cast<const ArrayLoopExpr*>(&expr) || dynamic_cast<const SumLoopExpr*>(&expr)) return;
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      find_accesses(*let->value, lets, accesses);
+      auto outer = lets;
+      if (auto value = resolve(*let->value, lets)) {
+        lets[let->identifier] = *value;
+      } else {
+        lets.erase(let->identifier);
+      }
+      find_accesses(*let->body, lets, accesses);
+      lets = outer;
+      return;
+    }
+    if (auto read = dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      Access access;
+      for (const auto& index : read->indices) {
+        auto affine = resolve(*index, lets);
+        if (!affine) break;
+        access.indices.push_back(*affine);
+      }
+      if (access.indices.size() == read->indices.size()) accesses.push_back(access);
+    }
+    for (auto child : children(expr)) {
+      find_accesses(**child, lets, accesses);
+    }
+  }
+
+  static std::optional<Affine> resolve(const Expr& expr, const std::map<std::string, Affine>& lets) {
+    if (!expr.type || !expr.type->is<Int>()) return std::nullopt;
+    auto affine = Affine::of(expr);
+    if (!affine) return std::nullopt;
+    auto terms = affine->terms;
+    for (const auto& [name, _] : terms) {
+      if (auto it = lets.find(name); it != lets.end()) {
+        affine = affine->substitute(name, it->second);
+        if (!affine) return std::nullopt;
+      }
+    }
+    return affine;
+  }
+};
@@ -3,13 +3,28 @@
 #include <iostream>
 #include <vector>
 
+#include "arrayfusionvisitor.h"
 #include "asmgenvisitor.h"
+#include "boundscheckvisitor.h"
 #include "codegenvisitor.h"
+#include "constfoldvisitor.h"
+#include "csevisitor.h"
+#include "dcevisitor.h"
+#include "escapevisitor.h"
+#include "indexsplitvisitor.h"
+#include "inlinevisitor.h"
+#include "interchangevisitor.h"
 #include "lexer.h"
+#include "licmvisitor.h"
 #include "logger.h"
 #include "parser.h"
 #include "printervisitor.h"
+#include "specializevisitor.h"
+#include "sroavisitor.h"
+#include "sumfusionvisitor.h"
+#include "tilingvisitor.h"
 #include "typecheckervisitor.h"
+#include "unrollvisitor.h"
 // #include "typedefvisitor.h"
 
 struct Options {
@@ -20,6 +35,8 @@ struct Options {
   bool assembly;
   bool typecheck;
   bool opt1;
+  bool avx2;
+  bool reassociate;
 };
 
 int main(int argc, char *argv[]) {
@@ -45,7 +62,9 @@ int main(int argc, char *argv[]) {
       .c = std::find(args.begin(), args.end(), "-i") != args.end(),
       .assembly = std::find(args.begin(), args.end(), "-s") != args.end(),
       .typecheck = std::find(args.begin(), args.end(), "-t") != args.end(),
-      .opt1 = std::find(args.begin(), args.end(), "-O1") != args.end()};
+      .opt1 = std::find(args.begin(), args.end(), "-O1") != args.end(),
+      .avx2 = std::find(args.begin(), args.end(), "-mavx2") != args.end(),
+      .reassociate = std::find(args.begin(), args.end(), "-fassociative-math") != args.end()};
 
   if (options.lex + options.parse + options.typecheck > 1) {
     std::cerr << "Error: only one of -l, -p, -t can be specified" << std::endl;
@@ -69,6 +88,40 @@ int main(int argc, char *argv[]) {
   std::unique_ptr<Program> program = parser.parse();
   TypeCheckerVisitor typechecker(logger);
   program->accept(typechecker);
+  if (options.opt1) {
+    SpecializeVisitor specialize(typechecker.ctx);
+    program->accept(specialize);
+    InlineVisitor inliner;
+    program->accept(inliner);
+    ConstFoldVisitor folder;
+    program->accept(folder);
+    ArrayFusionVisitor array_fusion(typechecker.ctx);
+    program->accept(array_fusion);
+    SumFusionVisitor fusion(typechecker.ctx);
+    program->accept(fusion);
+    UnrollVisitor unroll;
+    program->accept(unroll);
+    ConstFoldVisitor unrolled_folder;
+    program->accept(unrolled_folder);
+    SROAVisitor sroa(typechecker.ctx);
+    program->accept(sroa);
+    CSEVisitor cse;
+    program->accept(cse);
+    BoundsCheckVisitor bounds_checks(typechecker.ctx);
+    program->accept(bounds_checks);
+    InterchangeVisitor interchange;
+    program->accept(interchange);
+    LICMVisitor licm;
+    program->accept(licm);
+    DCEVisitor dce;
+    program->accept(dce);
+    TilingVisitor tiling(typechecker.ctx);
+    program->accept(tiling);
+    IndexSplitVisitor index_split;
+    program->accept(index_split);
+    EscapeVisitor escape(typechecker.ctx);
+    program->accept(escape);
+  }
   if (options.parse) {
     PrinterVisitor visitor;
     program->accept(visitor);
@@ -82,7 +135,7 @@ int main(int argc, char *argv[]) {
     exit(0);
   } else if (options.assembly) {
     int opt = options.opt1 ? 1 : 0;
-    ASMGenVisitor generator(typechecker.ctx, logger, opt);
+    ASMGenVisitor generator(typechecker.ctx, logger, opt, options.avx2, options.reassociate);
     program->accept(generator);
     std::cout << "\nCompilation succeeded" << std::endl;
     exit(0);
@@ -0,0 +1,402 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "astnodes.h"
+#include "rewritevisitor.h"
+
+// Loop-invariant code motion. Each axis of each loop is a level, and an
+// expression inside a loop body whose variables are all bound outside some
+// of the axes around it is evaluated once per iteration of the innermost
+// axis it depends on: as a hoisted let of that axis, or as a LetExpr just
+// before the loop when it depends on none of them. Integer sums are
+// reordered so their terms group by level, which exposes partially
+// invariant terms like i * W in i * W + j.
+//
+// Expressions that can fail are only moved out of axes they are evaluated
+// in unconditionally, whose loops have bounds known to be positive and
+// that cannot fail, and in which nothing else can fail, so the failure
+// reported is the same. This runs after bounds check elimination, whose
+// marks survive since nodes are only moved.
+class LICMVisitor : public RewriteVisitor {
+ public:
+  virtual void visit(const Program& program) override {
+    for (const auto& cmd : program.cmds) {
+      hoist_all(*cmd);
+    }
+  }
+
+  virtual void visit(const FnCmd& fn) override {
+    for (const auto& stmt : fn.stmts) {
+      hoist_all(*stmt);
+    }
+  }
+
+ private:
+  typedef std::vector<std::pair<std::string, std::unique_ptr<Expr>>> Lets;
+
+  struct Info {
+    std::unordered_set<std::string> free;
+    bool failable;
+    int size;
+    // the level of the innermost branch between the axes and here
+    int branch;
+  };
+
+  struct Axis {
+    const std::unique_ptr<Expr>* loop;
+    size_t index;
+  };
+
+  std::unordered_map<const Expr*, Info> infos;
+  // the level each variable is bound at, 0 outside every loop
+  std::unordered_map<std::string, int> levels;
+  // the axes around the current expression, outermost first
+  std::vector<Axis> axes;
+  int branch = 0;
+  bool moved = false;
+  int ctr = 0;
+
+  void hoist_all(const ASTNode& node) {
+    if (auto fn = dynamic_cast<const FnCmd*>(&node)) {
+      return visit(*fn);
+    }
+    if (auto cmd = dynamic_cast<const TimeCmd*>(&node)) {
+      return hoist_all(*cmd->cmd);
+    }
+    const std::unique_ptr<Expr>* root = nullptr;
+    if (auto cmd = dynamic_cast<const LetCmd*>(&node)) root = &cmd->expr;
+    if (auto cmd = dynamic_cast<const ShowCmd*>(&node)) root = &cmd->expr;
+    if (auto cmd = dynamic_cast<const AssertCmd*>(&node)) root = &cmd->expr;
+    if (auto cmd = dynamic_cast<const WriteCmd*>(&node)) root = &cmd->expr;
+    if (auto stmt = dynamic_cast<const LetStmt*>(&node)) root = &stmt->expr;
+    if (auto stmt = dynamic_cast<const AssertStmt*>(&node)) root = &stmt->expr;
+    if (auto stmt = dynamic_cast<const ReturnStmt*>(&node)) root = &stmt->expr;
+    if (!root) return;
+    // moving an expression invalidates what was learned about the ones
+    // around it, so each walk moves one and the next starts afresh
+    do {
+      moved = false;
+      infos.clear();
+      levels.clear();
+      branch = 0;
+      walk(*root);
+    } while (moved);
+  }
+
+  int depth() {
+    return axes.size();
+  }
+
+  int level_of(const Info& info) {
+    int level = 0;
+    for (const auto& name : info.free) {
+      if (auto it = levels.find(name); it != levels.end()) {
+        level = std::max(level, it->second);
+      }
+    }
+    return level;
+  }
+
+  std::optional<int> saved(const std::string& name) {
+    auto it = levels.find(name);
+    return it == levels.end() ? std::nullopt : std::optional<int>(it->second);
+  }
+
+  void restore(const std::string& name, std::optional<int> level) {
+    if (level) {
+      levels[name] = *level;
+    } else {
+      levels.erase(name);
+    }
+  }
+
+  const Info& walk(const std::unique_ptr<Expr>& slot) {
+    Info info{{}, false, 1, branch};
+    auto merge = [&](const Info& child) {
+      info.free.insert(child.free.begin(), child.free.end());
+      info.failable |= child.failable;
+      info.size += child.size;
+    };
+
+    if (auto var = dynamic_cast<const VarExpr*>(slot.get())) {
+      info.free.insert(var->identifier);
+    } else if (auto let = dynamic_cast<const LetExpr*>(slot.get())) {
+      merge(walk(let->value));
+      // a binding whose value moves out is replaced by the hoisted one
+      if (level_of(info) < depth() && try_hoist(let->value)) {
+        auto& hoisted = static_cast<const VarExpr&>(*let->value).identifier;
+        rename(let->body, let->identifier, hoisted);
+        edit(slot) = take(let->body);
+        return infos[slot.get()] = info;
+      }
+      auto outer = saved(let->identifier);
+      levels[let->identifier] = depth();
+      auto body = walk(let->body);
+      // the body can only be settled while its binding is in scope
+      if (level_of(body) < depth()) settle(let->body);
+      body.free.erase(let->identifier);
+      merge(body);
+      restore(let->identifier, outer);
+    } else if (auto loop = dynamic_cast<const ArrayLoopExpr*>(slot.get())) {
+      this->loop(slot, loop->axis, loop->hoisted, loop->expr, info);
+    } else if (auto loop = dynamic_cast<const SumLoopExpr*>(slot.get())) {
+      this->loop(slot, loop->axis, loop->hoisted, loop->expr, info);
+    } else if (auto if_expr = dynamic_cast<const IfExpr*>(slot.get())) {
+      merge(walk(if_expr->condition));
+      auto outer = branch;
+      branch = depth();
+      merge(walk(if_expr->if_expr));
+      merge(walk(if_expr->else_expr));
+      branch = outer;
+    } else if (auto binop = dynamic_cast<const BinopExpr*>(slot.get()); binop && (binop->op == "&&" || binop->op == "||")) {
+      merge(walk(binop->left));
+      auto outer = branch;
+      branch = depth();
+      merge(walk(binop->right));
+      branch = outer;
+    } else if (sum(*slot) && depth() > 0) {
+      reassociate(slot);
+      for (auto child : children(*slot)) {
+        merge(infos.at(child->get()));
+      }
+    } else {
+      for (auto child : children(*slot)) {
+        merge(walk(*child));
+      }
+      info.failable |= can_fail(*slot);
+    }
+    // an expression that varies in the innermost axis stays, and its
+    // invariant parts move; an invariant one is left to its parent
+    if (level_of(info) == depth()) flush(*slot);
+    return infos[slot.get()] = info;
+  }
+
+  void loop(const std::unique_ptr<Expr>& slot, const Lets& axis, const std::vector<Lets>& hoisted, const std::unique_ptr<Expr>& body,
+            Info& info) {
+    for (const auto& [variable, bound] : axis) {
+      auto& bound_info = walk(bound);
+      info.free.insert(bound_info.free.begin(), bound_info.free.end());
+      info.size += bound_info.size;
+    }
+    // a loop fails on non-positive bounds
+    info.failable = true;
+    std::vector<std::pair<std::string, std::optional<int>>> outer;
+    std::unordered_set<std::string> inner;
+    for (size_t k = 0; k < axis.size(); k++) {
+      axes.push_back({&slot, k});
+      outer.emplace_back(axis[k].first, saved(axis[k].first));
+      levels[axis[k].first] = depth();
+      inner.insert(axis[k].first);
+      if (k >= hoisted.size()) continue;
+      for (const auto& [variable, value] : hoisted[k]) {
+        auto& value_info = walk(value);
+        info.free.insert(value_info.free.begin(), value_info.free.end());
+        info.size += value_info.size;
+        outer.emplace_back(variable, saved(variable));
+        levels[variable] = depth();
+        inner.insert(variable);
+      }
+    }
+    auto body_info = walk(body);
+    if (level_of(body_info) < depth()) settle(body);
+    axes.resize(axes.size() - axis.size());
+    for (auto it = outer.rbegin(); it != outer.rend(); it++) {
+      restore(it->first, it->second);
+    }
+    info.free.insert(body_info.free.begin(), body_info.free.end());
+    info.size += body_info.size;
+    for (const auto& name : inner) {
+      info.free.erase(name);
+    }
+  }
+
+  bool settle(const std::unique_ptr<Expr>& slot) {
+    return try_hoist(slot) || flush(*slot);
+  }
+
+  // moves the invariant parts of an expression that is not itself moved;
+  // the scoped parts of binding forms were settled while in scope
+  bool flush(const Expr& expr) {
+    std::vector<const std::unique_ptr<Expr>*> parts;
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      parts.push_back(&let->value);
+    } else if (auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr)) {
+      for (const auto& [_, bound] : loop->axis) parts.push_back(&bound);
+    } else if (auto loop = dynamic_cast<const SumLoopExpr*>(&expr)) {
+      for (const auto& [_, bound] : loop->axis) parts.push_back(&bound);
+    } else {
+      parts = children(expr);
+    }
+    for (auto part : parts) {
+      auto it = infos.find(part->get());
+      if (it == infos.end() || level_of(it->second) >= depth()) continue;
+      if (settle(*part)) return true;
+    }
+    return false;
+  }
+
+  bool try_hoist(const std::unique_ptr<Expr>& slot) {
+    auto it = infos.find(slot.get());
+    if (moved || it == infos.end() || axes.empty()) return false;
+    auto info = it->second;
+    if (info.size < 2 || slot->type->is<Void>()) return false;
+    auto level = level_of(info);
+    if (info.failable) level = std::max(level, info.branch);
+    while (info.failable && level < depth() && !in_order(*slot, level)) level++;
+    if (level >= depth()) return false;
+
+    auto name = "_licm" + std::to_string(ctr++);
+    auto var = std::make_unique<VarExpr>(name);
+    var->type = slot->type;
+    auto value = take(slot);
+    edit(slot) = std::move(var);
+    moved = true;
+
+    // axes[level] is the outermost axis it varies in
+    auto [loop, index] = axes[level];
+    if (index > 0) {
+      auto& hoisted = hoisted_of(**loop);
+      if (hoisted.size() < index) hoisted.resize(index);
+      hoisted[index - 1].emplace_back(name, std::move(value));
+      return true;
+    }
+    auto let = std::make_unique<LetExpr>(name, std::move(value), take(*loop));
+    let->type = let->body->type;
+    edit(*loop) = std::move(let);
+    return true;
+  }
+
+  static std::vector<Lets>& hoisted_of(const Expr& loop) {
+    if (auto array = dynamic_cast<const ArrayLoopExpr*>(&loop)) return array->hoisted;
+    return static_cast<const SumLoopExpr&>(loop).hoisted;
+  }
+
+  static bool sum(const Expr& expr) {
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    return binop && (binop->op == "+" || binop->op == "-") && binop->type->is<Int>();
+  }
+
+  // whether a failing expression can run ahead of the axes from level on:
+  // the bounds of their loops are checked and cannot fail, and nothing
+  // else in the loops can fail before or after it
+  bool in_order(const Expr& expr, int level) {
+    for (int k = level; k < depth(); k++) {
+      if (!checked(**axes[k].loop)) return false;
+    }
+    // the terms of a sum being reassociated are out of the tree
+    auto& loop = **axes[level].loop;
+    return contains(loop, expr) && !fails_besides(loop, expr);
+  }
+
+  static bool checked(const Expr& loop) {
+    auto all = [](const std::vector<bool>& marks, size_t size) {
+      return marks.size() >= size && std::all_of(marks.begin(), marks.begin() + size, [](bool mark) { return mark; });
+    };
+    if (auto array = dynamic_cast<const ArrayLoopExpr*>(&loop)) return array->size_safe && all(array->bound_safe, array->axis.size());
+    auto& sum = static_cast<const SumLoopExpr&>(loop);
+    return all(sum.bound_safe, sum.axis.size());
+  }
+
+  // whether anything in an expression but skip can fail; the marks of the
+  // code that stays in place still hold
+  static bool fails_besides(const Expr& expr, const Expr& skip) {
+    if (&expr == &skip) return false;
+    if (!contains(expr, skip)) return RewriteVisitor::can_fail(expr);
+    if (auto index = dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      for (size_t k = 0; k < index->indices.size(); k++) {
+        if (k >= index->lower_safe.size() || !index->lower_safe[k] || !index->upper_safe[k]) return true;
+      }
+    }
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    if (binop && (binop->op == "/" || binop->op == "%") && binop->type->is<Int>() && !binop->divisor_safe) return true;
+    if (auto call = dynamic_cast<const CallExpr*>(&expr); call && !builtins.count(call->identifier)) return true;
+    auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr) || dynamic_cast<const SumLoopExpr*>(&expr);
+    if (loop && !checked(expr)) return true;
+    for (auto child : children(expr)) {
+      if (fails_besides(**child, skip)) return true;
+    }
+    return false;
+  }
+
+  static bool contains(const Expr& expr, const Expr& part) {
+    if (&expr == &part) return true;
+    for (auto child : children(expr)) {
+      if (*child && contains(**child, part)) return true;
+    }
+    return false;
+  }
+
+  // whether the node itself can fail; marks are not trusted, since those
+  // inside a branch may rely on its condition. x / -1 overflows for the
+  // smallest integer
+  static bool can_fail(const Expr& expr) {
+    if (dynamic_cast<const ArrayIndexExpr*>(&expr)) return true;
+    if (auto call = dynamic_cast<const CallExpr*>(&expr)) return !builtins.count(call->identifier);
+    if (auto binop = dynamic_cast<const BinopExpr*>(&expr); binop && (binop->op == "/" || binop->op == "%") && binop->type->is<Int>()) {
+      auto divisor = dynamic_cast<const IntExpr*>(binop->right.get());
+      return !divisor || divisor->value == 0 || divisor->value == -1;
+    }
+    return false;
+  }
+
+  // rebuilds an integer sum with the terms of outer levels first, so
+  // j + i * W + 1 becomes (1 + i * W) + j in loops over i and j
+  void reassociate(const std::unique_ptr<Expr>& slot) {
+    std::vector<std::unique_ptr<Expr>> terms;
+    std::vector<bool> negative;
+    std::function<void(std::unique_ptr<Expr>, bool)> flatten = [&](std::unique_ptr<Expr> expr, bool negated) {
+      if (sum(*expr)) {
+        auto& binop = static_cast<BinopExpr&>(*expr);
+        flatten(std::move(binop.left), negated);
+        flatten(std::move(binop.right), binop.op == "-" ? !negated : negated);
+      } else {
+        terms.push_back(std::move(expr));
+        negative.push_back(negated);
+      }
+    };
+    flatten(take(slot), false);
+
+    std::vector<int> term_levels;
+    bool failable = false;
+    for (const auto& term : terms) {
+      auto& info = walk(term);
+      failable |= info.failable;
+      term_levels.push_back(level_of(info));
+    }
+    std::vector<size_t> order(terms.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    // reordering terms that can fail would change which failure is reported
+    if (!failable) {
+      std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return term_levels[a] < term_levels[b]; });
+    }
+
+    std::unique_ptr<Expr> result;
+    for (auto i : order) {
+      auto info = infos.at(terms[i].get());
+      if (!result && !negative[i]) {
+        result = std::move(terms[i]);
+        continue;
+      }
+      if (!result) {
+        result = std::make_unique<UnopExpr>("-", std::move(terms[i]));
+      } else {
+        const auto& so_far = infos.at(result.get());
+        info.free.insert(so_far.free.begin(), so_far.free.end());
+        info.failable |= so_far.failable;
+        info.size += so_far.size;
+        result = std::make_unique<BinopExpr>(std::move(result), negative[i] ? "-" : "+", std::move(terms[i]));
+      }
+      result->type = Int::shared;
+      info.size++;
+      info.branch = branch;
+      infos[result.get()] = info;
+    }
+    edit(slot) = std::move(result);
+  }
+};
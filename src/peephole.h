@@ -0,0 +1,372 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// One line of the generated assembly. Instructions are split into a
+// mnemonic and operands; labels, directives and comments only keep their
+// text.
+struct Instruction {
+  std::string op;
+  std::vector<std::string> operands;
+  std::string text;
+
+  static Instruction parse(const std::string& line) {
+    Instruction instruction;
+    instruction.text = line;
+    // instructions are indented, data and globals are not
+    if (line.rfind("    ", 0) != 0) return instruction;
+    auto code = line.substr(0, line.find(';'));
+    auto start = code.find_first_not_of(' ');
+    if (start == std::string::npos) return instruction;
+    auto end = code.find_last_not_of(' ');
+    code = code.substr(start, end - start + 1);
+    auto space = code.find(' ');
+    instruction.op = code.substr(0, space);
+    if (instruction.op.back() == ':') {
+      instruction.op.clear();
+      return instruction;
+    }
+    if (space == std::string::npos) return instruction;
+    std::stringstream operands(code.substr(space + 1));
+    std::string operand;
+    while (std::getline(operands, operand, ',')) {
+      operand = operand.substr(operand.find_first_not_of(' '));
+      instruction.operands.push_back(operand);
+    }
+    return instruction;
+  }
+
+  static Instruction make(std::string op, std::vector<std::string> operands) {
+    Instruction instruction;
+    instruction.text = "    " + op;
+    for (size_t i = 0; i < operands.size(); i++) {
+      instruction.text += (i == 0 ? " " : ", ") + operands[i];
+    }
+    instruction.op = std::move(op);
+    instruction.operands = std::move(operands);
+    return instruction;
+  }
+
+  bool is(const std::string& mnemonic, size_t arity) const {
+    return op == mnemonic && operands.size() == arity;
+  }
+
+  // blank lines and comments
+  bool transparent() const {
+    if (!op.empty()) return false;
+    auto start = text.find_first_not_of(' ');
+    return start == std::string::npos || text[start] == ';';
+  }
+};
+
+// Sends a stream's output to another buffer until destroyed, so the
+// stream gets its own buffer back even if code generation throws.
+class Capture {
+ public:
+  Capture(std::ostream& stream, std::streambuf* buffer) : stream(stream), saved(stream.rdbuf(buffer)) {}
+  Capture(const Capture&) = delete;
+  Capture& operator=(const Capture&) = delete;
+  ~Capture() { stream.rdbuf(saved); }
+
+ private:
+  std::ostream& stream;
+  std::streambuf* saved;
+};
+
+// Removes and combines adjacent instructions left behind by the stack
+// machine lowering: a value pushed and popped straight away becomes a
+// register move, pushes discarded by the next instruction go away, stack
+// pointer adjustments are merged, and a load from the slot just stored
+// is dropped. Only instructions with nothing but comments between them
+// are combined, so no pattern spans a label.
+class Peephole {
+ public:
+  std::vector<Instruction> code;
+
+  explicit Peephole(std::istream& text) {
+    std::string line;
+    while (std::getline(text, line)) {
+      code.push_back(Instruction::parse(line));
+    }
+  }
+
+  // rewrites the code until no pattern applies, returning the number of
+  // instructions removed
+  int optimize() {
+    auto before = count();
+    bool changed;
+    do {
+      changed = false;
+      for (size_t i = 0; i < code.size(); i++) {
+        changed |= rewrite(i);
+      }
+    } while (changed);
+    return before - count();
+  }
+
+  void emit(std::ostream& out) const {
+    for (const auto& instruction : code) {
+      if (!instruction.text.empty()) out << instruction.text << '\n';
+    }
+  }
+
+ private:
+  static constexpr size_t none = std::string::npos;
+
+  // a value pushed by the code at some position, and the number of
+  // instructions doing it
+  struct Pushed {
+    enum { Gpr, Xmm, Imm, Mem } kind;
+    std::string operand;
+    int length;
+  };
+
+  int count() const {
+    int n = 0;
+    for (const auto& instruction : code) n += !instruction.op.empty();
+    return n;
+  }
+
+  // the next instruction after i, skipping comments but not labels
+  size_t next(size_t i) const {
+    if (i == none) return none;
+    for (i++; i < code.size(); i++) {
+      if (!code[i].transparent()) break;
+    }
+    return i < code.size() && !code[i].op.empty() ? i : none;
+  }
+
+  // the i-th instruction from position i, or none
+  std::vector<size_t> window(size_t i, size_t n) const {
+    std::vector<size_t> positions;
+    for (auto at = i; positions.size() < n && at != none; at = next(at)) {
+      positions.push_back(at);
+    }
+    while (positions.size() < n) positions.push_back(none);
+    return positions;
+  }
+
+  bool at(size_t i, const std::string& op, std::vector<std::string> operands) const {
+    return i != none && code[i].op == op && code[i].operands == operands;
+  }
+
+  static bool gpr(const std::string& operand) {
+    static const std::vector<std::string> regs = {"rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "r8",
+                                                  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+    for (const auto& reg : regs) {
+      if (operand == reg) return true;
+    }
+    return false;
+  }
+
+  static bool xmm(const std::string& operand) {
+    return operand.rfind("xmm", 0) == 0;
+  }
+
+  static bool imm(std::string operand) {
+    if (operand.rfind("qword ", 0) == 0) operand = operand.substr(6);
+    if (operand.empty()) return false;
+    for (size_t k = operand[0] == '-'; k < operand.size(); k++) {
+      if (!isdigit(operand[k])) return false;
+    }
+    return operand != "-";
+  }
+
+  static bool top(const std::string& operand) {
+    return operand == "[rsp]" || operand == "[rsp + 0]";
+  }
+
+  std::optional<Pushed> pushed(size_t i) const {
+    auto w = window(i, 3);
+    if (w[0] == none) return std::nullopt;
+    auto& first = code[w[0]];
+    if (first.is("push", 1)) {
+      auto& operand = first.operands[0];
+      if (gpr(operand) && operand != "rsp") return Pushed{Pushed::Gpr, operand, 1};
+      if (imm(operand)) return Pushed{Pushed::Imm, operand.rfind("qword ", 0) == 0 ? operand.substr(6) : operand, 1};
+      return std::nullopt;
+    }
+    if (!at(w[0], "sub", {"rsp", "8"}) || w[1] == none) return std::nullopt;
+    auto& second = code[w[1]];
+    if (second.is("movsd", 2) && top(second.operands[0]) && xmm(second.operands[1])) {
+      return Pushed{Pushed::Xmm, second.operands[1], 2};
+    }
+    // a copy through r10 from memory that does not move with rsp
+    if (second.is("mov", 2) && second.operands[0] == "r10" && second.operands[1].find("rsp") == std::string::npos &&
+        second.operands[1][0] == '[' && w[2] != none && code[w[2]].is("mov", 2) && top(code[w[2]].operands[0]) &&
+        code[w[2]].operands[1] == "r10") {
+      return Pushed{Pushed::Mem, second.operands[1], 3};
+    }
+    return std::nullopt;
+  }
+
+  // the register popped into by the code at i, and the number of
+  // instructions doing it
+  std::optional<std::pair<std::string, int>> popped(size_t i) const {
+    auto w = window(i, 2);
+    if (w[0] == none) return std::nullopt;
+    auto& first = code[w[0]];
+    if (first.is("pop", 1) && gpr(first.operands[0])) return std::make_pair(first.operands[0], 1);
+    if (first.is("movsd", 2) && xmm(first.operands[0]) && top(first.operands[1]) && at(w[1], "add", {"rsp", "8"})) {
+      return std::make_pair(first.operands[0], 2);
+    }
+    return std::nullopt;
+  }
+
+  // the move from a pushed value to a popped register, if there is one
+  std::optional<std::optional<Instruction>> move(const Pushed& from, const std::string& to) const {
+    std::optional<Instruction> none_needed;
+    if (from.kind != Pushed::Mem && from.operand == to) return none_needed;
+    switch (from.kind) {
+      case Pushed::Gpr:
+        return Instruction::make(xmm(to) ? "movq" : "mov", {to, from.operand});
+      case Pushed::Xmm:
+        return Instruction::make(xmm(to) ? "movsd" : "movq", {to, from.operand});
+      case Pushed::Imm:
+        if (xmm(to)) return std::nullopt;
+        return Instruction::make("mov", {to, from.operand});
+      case Pushed::Mem:
+        return Instruction::make(xmm(to) ? "movsd" : "mov", {to, from.operand});
+    }
+    return std::nullopt;
+  }
+
+  // replaces n instructions starting at i, keeping the comments between them
+  void splice(size_t i, size_t n, std::vector<Instruction> with) {
+    auto w = window(i, n);
+    for (size_t k = 0; k < n; k++) {
+      if (k < with.size()) {
+        code[w[k]] = with[k];
+      } else {
+        code[w[k]] = Instruction();
+      }
+    }
+  }
+
+  // an instruction that only reads and writes its operands
+  static bool independent(const Instruction& instruction, const Pushed& value) {
+    static const std::vector<std::string> ops = {"mov",   "movsd", "movq",  "lea",   "add",      "sub",      "imul", "and", "or",
+                                                 "xor",   "addsd", "subsd", "mulsd", "divsd",    "cmp",      "cvtsi2sd"};
+    if (std::find(ops.begin(), ops.end(), instruction.op) == ops.end() || instruction.operands.size() != 2) return false;
+    for (const auto& operand : instruction.operands) {
+      if (operand.find("rsp") != std::string::npos) return false;
+    }
+    // a load from memory cannot move past a store
+    return value.kind != Pushed::Mem || instruction.operands[0][0] != '[';
+  }
+
+  static bool mentions(const Instruction& instruction, const std::string& reg) {
+    for (const auto& operand : instruction.operands) {
+      if (operand == reg || (operand[0] == '[' && operand.find(reg) != std::string::npos)) return true;
+    }
+    return false;
+  }
+
+  static std::optional<int64_t> rsp_adjustment(const Instruction& instruction) {
+    if (instruction.operands.size() != 2 || instruction.operands[0] != "rsp" || !imm(instruction.operands[1])) return std::nullopt;
+    auto amount = std::stoll(instruction.operands[1]);
+    if (instruction.op == "add") return amount;
+    if (instruction.op == "sub") return -amount;
+    return std::nullopt;
+  }
+
+  bool rewrite(size_t i) {
+    if (code[i].op.empty()) return false;
+    auto& instruction = code[i];
+
+    // mov x, x
+    if (instruction.is("mov", 2) && instruction.operands[0] == instruction.operands[1]) {
+      code[i] = Instruction();
+      return true;
+    }
+
+    // a move back to where the value came from
+    if (instruction.is("mov", 2) || instruction.is("movsd", 2)) {
+      auto j = next(i);
+      auto& to = instruction.operands[0];
+      auto& from = instruction.operands[1];
+      auto reg = from[0] == '[' ? to : from;
+      auto mem = from[0] == '[' ? from : to;
+      if (j != none && code[j].op == instruction.op && code[j].operands == std::vector<std::string>{from, to} &&
+          mem.find(reg) == std::string::npos) {
+        code[j] = Instruction();
+        return true;
+      }
+    }
+
+    // jmp to the next label
+    if (instruction.is("jmp", 1)) {
+      auto j = i + 1;
+      while (j < code.size() && code[j].transparent()) j++;
+      if (j < code.size() && code[j].op.empty()) {
+        auto label = code[j].text.substr(code[j].text.find_first_not_of(' '));
+        if (label == instruction.operands[0] + ":") {
+          code[i] = Instruction();
+          return true;
+        }
+      }
+    }
+
+    // add rsp, a; sub rsp, b
+    if (auto first = rsp_adjustment(instruction)) {
+      auto j = next(i);
+      if (j != none) {
+        if (auto second = rsp_adjustment(code[j])) {
+          auto total = *first + *second;
+          code[j] = Instruction();
+          if (total == 0) {
+            code[i] = Instruction();
+          } else {
+            code[i] = Instruction::make(total > 0 ? "add" : "sub", {"rsp", std::to_string(total > 0 ? total : -total)});
+          }
+          return true;
+        }
+      }
+    }
+
+    // push r; mov r, [rsp]
+    if (instruction.is("push", 1) && gpr(instruction.operands[0])) {
+      auto j = next(i);
+      if (j != none && code[j].is("mov", 2) && code[j].operands[0] == instruction.operands[0] && top(code[j].operands[1])) {
+        code[j] = Instruction();
+        return true;
+      }
+    }
+
+    if (auto value = pushed(i)) {
+      auto after = window(i, value->length + 1).back();
+      if (after == none) return false;
+      // a push discarded straight away
+      if (at(after, "add", {"rsp", "8"})) {
+        splice(i, value->length + 1, {});
+        return true;
+      }
+      // a push popped straight away, or past one instruction that leaves
+      // the popped register and the stack alone
+      auto between = none;
+      auto pop = after;
+      if (!popped(after) && independent(code[after], *value)) {
+        between = after;
+        pop = next(after);
+      }
+      if (pop == none) return false;
+      if (auto target = popped(pop); target && (between == none || !mentions(code[between], target->first))) {
+        if (auto replacement = move(*value, target->first)) {
+          std::vector<Instruction> with;
+          if (*replacement) with.push_back(**replacement);
+          // the pop follows the push, so clear both in one window
+          for (auto position : window(pop, target->second)) code[position] = Instruction();
+          splice(i, value->length, with);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+};
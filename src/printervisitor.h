@@ -278,7 +278,17 @@ class PrinterVisitor : public ASTVisitor {
       expr->accept(*this);
       std::cout << " ";
     }
+    print_hoisted(node.axis, node.hoisted);
     node.expr->accept(*this);
+    // (Interior i 1 1 expr) replaces the body for i in [1, bound - 1)
+    if (node.interior) {
+      std::cout << " (Interior ";
+      for (size_t k = 0; k < node.margins.size(); k++) {
+        std::cout << node.axis[k].first << " " << node.margins[k].first << " " << node.margins[k].second << " ";
+      }
+      node.interior->accept(*this);
+      std::cout << ")";
+    }
     std::cout << ")";
   }
 
@@ -292,10 +302,35 @@ class PrinterVisitor : public ASTVisitor {
       expr->accept(*this);
       std::cout << " ";
     }
+    print_hoisted(node.axis, node.hoisted);
     node.expr->accept(*this);
     std::cout << ")";
   }
 
+  // (Hoisted i x expr) binds x once per iteration of axis i
+  void print_hoisted(const std::vector<std::pair<std::string, std::unique_ptr<Expr>>> &axis,
+                     const std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>> &hoisted) {
+    for (size_t k = 0; k < hoisted.size(); k++) {
+      for (const auto &[var, expr] : hoisted[k]) {
+        std::cout << "(Hoisted " << axis[k].first << " " << var << " ";
+        expr->accept(*this);
+        std::cout << ") ";
+      }
+    }
+  }
+
+  void visit(const LetExpr &node) override {
+    std::cout << "(LetExpr ";
+    if (node.type) {
+      std::cout << node.type->to_string() << " ";
+    }
+    std::cout << node.identifier << " ";
+    node.value->accept(*this);
+    std::cout << " ";
+    node.body->accept(*this);
+    std::cout << ")";
+  }
+
   /* ========== LValues ========== */
   void visit(const VarLValue &node) override {
     std::cout << "(VarLValue " << node.identifier << ")";
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "astnodes.h"
+#include "rewritevisitor.h"
+
+// Linear-scan register allocation for the scalar bindings of one frame,
+// the top level or a function. A binding is a let, a loop variable, a
+// hoisted let or a parameter, named by the address of its identifier in
+// the node that binds it. It lives from its definition to its last read,
+// extended to the end of the outermost loop entered after the definition
+// that reads it; loop variables and hoisted lets live to the end of their
+// loop. Intervals are scanned by start and given a free callee-saved GPR
+// or xmm register. When none is free, the binding with the smallest use
+// count, weighted by loop depth, stays in memory instead. No xmm register
+// survives a call, so a float binding whose interval spans one is never
+// given one.
+//
+// Bindings always keep their stack slot, written before the register is
+// loaded, so a binding without a register costs nothing extra. The code
+// generator reads allocated bindings from their register and keeps loop
+// variables there as they count.
+class RegisterAllocator {
+ public:
+  inline static const std::vector<std::string> gprs = {"rbx", "r13", "r14", "r15"};
+  inline static const std::vector<std::string> xmms = {"xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15"};
+
+  void allocate(const Program& program) {
+    clear();
+    for (const auto& cmd : program.cmds) {
+      if (!dynamic_cast<const FnCmd*>(cmd.get())) command(*cmd);
+    }
+    scan();
+  }
+
+  void allocate(const FnCmd& fn) {
+    clear();
+    for (const auto& param : fn.params) {
+      define(&param->lvalue->identifier, param->type->type, dynamic_cast<const VarLValue*>(param->lvalue.get()));
+      if (auto array = dynamic_cast<const ArrayLValue*>(param->lvalue.get())) {
+        for (const auto& name : array->indices) define(&name, nullptr, false);
+      }
+    }
+    for (const auto& stmt : fn.stmts) command(*stmt);
+    scan();
+  }
+
+  // the register of a binding, or of the binding a read refers to
+  std::optional<std::string> of(const std::string* binding) const {
+    auto it = registers.find(binding);
+    if (it == registers.end()) return std::nullopt;
+    return it->second;
+  }
+
+  std::optional<std::string> of(const VarExpr& read) const {
+    auto it = reads.find(&read);
+    if (it == reads.end()) return std::nullopt;
+    return of(it->second);
+  }
+
+  // the callee-saved registers the frame uses
+  std::vector<std::string> saved() const {
+    std::vector<std::string> used;
+    for (const auto& reg : gprs) {
+      for (const auto& [_, assigned] : registers) {
+        if (assigned == reg) {
+          used.push_back(reg);
+          break;
+        }
+      }
+    }
+    return used;
+  }
+
+ private:
+  struct Interval {
+    const std::string* binding;
+    bool gpr;
+    int start, end;
+    double weight = 0;
+    int depth;
+    bool eligible;
+  };
+
+  struct Loop {
+    int start;
+    std::vector<Interval*> extended;
+  };
+
+  std::vector<std::unique_ptr<Interval>> intervals;
+  std::unordered_map<std::string, std::vector<Interval*>> scope;
+  std::unordered_map<const VarExpr*, const std::string*> reads;
+  std::unordered_map<const std::string*, std::string> registers;
+  std::vector<Loop> loops;
+  std::vector<int> calls;
+  int position = 0;
+
+  void clear() {
+    intervals.clear();
+    scope.clear();
+    reads.clear();
+    registers.clear();
+    loops.clear();
+    calls.clear();
+    position = 0;
+  }
+
+  Interval* define(const std::string* binding, std::shared_ptr<ResolvedType> type, bool scalar) {
+    auto gpr = type && (type->is<Int>() || type->is<Bool>());
+    auto eligible = scalar && type && (gpr || type->is<Float>());
+    auto start = ++position;
+    intervals.push_back(std::make_unique<Interval>(Interval{binding, gpr, start, start, 0, (int)loops.size(), eligible}));
+    scope[*binding].push_back(intervals.back().get());
+    return intervals.back().get();
+  }
+
+  void undefine(const std::string& name) {
+    scope[name].pop_back();
+  }
+
+  void use(const VarExpr& read) {
+    auto it = scope.find(read.identifier);
+    if (it == scope.end() || it->second.empty()) return;
+    auto interval = it->second.back();
+    reads[&read] = interval->binding;
+    interval->end = std::max(interval->end, ++position);
+    interval->weight += depth_weight(loops.size() - interval->depth);
+    // a read in a loop entered after the definition repeats until it ends
+    for (auto& loop : loops) {
+      if (loop.start > interval->start) {
+        loop.extended.push_back(interval);
+        break;
+      }
+    }
+  }
+
+  static double depth_weight(size_t depth) {
+    double weight = 1;
+    for (size_t k = 0; k < depth; k++) weight *= 10;
+    return weight;
+  }
+
+  void call() {
+    calls.push_back(++position);
+  }
+
+  void command(const Cmd& cmd) {
+    if (auto let = dynamic_cast<const LetCmd*>(&cmd)) {
+      binding(*let->lvalue, *let->expr);
+    } else if (auto let = dynamic_cast<const LetStmt*>(&cmd)) {
+      binding(*let->lvalue, *let->expr);
+    } else if (auto time = dynamic_cast<const TimeCmd*>(&cmd)) {
+      call();
+      command(*time->cmd);
+      call();
+    } else if (auto read = dynamic_cast<const ReadCmd*>(&cmd)) {
+      call();
+      lvalue(*read->lvalue, nullptr);
+    } else {
+      if (auto write = dynamic_cast<const WriteCmd*>(&cmd)) expr(*write->expr);
+      if (auto show = dynamic_cast<const ShowCmd*>(&cmd)) expr(*show->expr);
+      if (auto assert = dynamic_cast<const AssertCmd*>(&cmd)) expr(*assert->expr);
+      if (auto assert = dynamic_cast<const AssertStmt*>(&cmd)) expr(*assert->expr);
+      if (auto ret = dynamic_cast<const ReturnStmt*>(&cmd)) expr(*ret->expr);
+      // writing, showing and printing go through the runtime
+      if (dynamic_cast<const WriteCmd*>(&cmd) || dynamic_cast<const ShowCmd*>(&cmd) || dynamic_cast<const PrintCmd*>(&cmd)) call();
+    }
+  }
+
+  // top-level and function lets stay in scope to the end of the frame
+  void binding(const LValue& lvalue, const Expr& value) {
+    expr(value);
+    this->lvalue(lvalue, value.type);
+  }
+
+  void lvalue(const LValue& lvalue, std::shared_ptr<ResolvedType> type) {
+    define(&lvalue.identifier, type, dynamic_cast<const VarLValue*>(&lvalue));
+    if (auto array = dynamic_cast<const ArrayLValue*>(&lvalue)) {
+      for (const auto& name : array->indices) define(&name, nullptr, false);
+    }
+  }
+
+  typedef std::vector<std::pair<std::string, std::unique_ptr<Expr>>> Lets;
+
+  void loop(const Lets& axis, const std::vector<Lets>& hoisted, const Expr& body, const Expr* interior, bool allocates) {
+    // the code generator evaluates the bounds last to first
+    auto first = position;
+    for (const auto& [_, bound] : axis) expr(*bound);
+    if (axis.size() > 1) keep_live(first);
+    if (allocates) call();
+    std::vector<Interval*> inner;
+    loops.push_back({position + 1, {}});
+    for (const auto& [variable, _] : axis) {
+      inner.push_back(define(&variable, Int::shared, true));
+    }
+    for (size_t k = 0; k < hoisted.size(); k++) {
+      for (const auto& [variable, value] : hoisted[k]) {
+        expr(*value);
+        inner.push_back(define(&variable, value->type, true));
+      }
+    }
+    // they are used inside the loop, like a binding from outside it
+    for (auto interval : inner) interval->depth--;
+    expr(body);
+    if (interior) expr(*interior);
+    auto end = ++position;
+    // loop variables count every iteration
+    for (auto interval : inner) {
+      interval->end = end;
+      interval->weight += depth_weight(loops.size() - interval->depth);
+      undefine(*interval->binding);
+    }
+    for (auto interval : loops.back().extended) {
+      interval->end = std::max(interval->end, end);
+    }
+    loops.pop_back();
+  }
+
+  void expr(const Expr& expr) {
+    if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+      use(*var);
+    } else if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      this->expr(*let->value);
+      auto interval = define(&let->identifier, let->value->type, true);
+      this->expr(*let->body);
+      interval->end = std::max(interval->end, position);
+      undefine(let->identifier);
+    } else if (auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr)) {
+      this->loop(loop->axis, loop->hoisted, *loop->expr, loop->interior.get(), true);
+    } else if (auto loop = dynamic_cast<const SumLoopExpr*>(&expr)) {
+      this->loop(loop->axis, loop->hoisted, *loop->expr, nullptr, false);
+    } else {
+      auto first = position;
+      auto children = RewriteVisitor::children(expr);
+      for (auto child : children) {
+        this->expr(**child);
+      }
+      // the code generator may evaluate the operands in another order
+      if (children.size() > 1) keep_live(first);
+      auto binop = dynamic_cast<const BinopExpr*>(&expr);
+      if (dynamic_cast<const CallExpr*>(&expr) || dynamic_cast<const ArrayLiteralExpr*>(&expr) ||
+          (binop && binop->op == "%" && binop->type->is<Float>())) {
+        call();
+      }
+    }
+  }
+
+  // a binding live at first and read by one of several operands evaluated
+  // since lives until they are all done
+  void keep_live(int first) {
+    for (const auto& interval : intervals) {
+      if (interval->start <= first && interval->end > first) interval->end = position;
+    }
+  }
+
+  bool spans_call(const Interval& interval) const {
+    auto it = std::upper_bound(calls.begin(), calls.end(), interval.start);
+    return it != calls.end() && *it <= interval.end;
+  }
+
+  void scan() {
+    std::vector<Interval*> order;
+    for (const auto& interval : intervals) {
+      if (!interval->eligible || interval->weight == 0) continue;
+      if (!interval->gpr && spans_call(*interval)) continue;
+      order.push_back(interval.get());
+    }
+    std::stable_sort(order.begin(), order.end(), [](auto a, auto b) { return a->start < b->start; });
+    std::vector<Interval*> active;
+    std::map<Interval*, std::string> assigned;
+    for (auto interval : order) {
+      active.erase(std::remove_if(active.begin(), active.end(), [&](auto other) { return other->end < interval->start; }),
+                   active.end());
+      auto& pool = interval->gpr ? gprs : xmms;
+      std::optional<std::string> reg;
+      for (const auto& candidate : pool) {
+        auto taken = std::any_of(active.begin(), active.end(), [&](auto other) { return assigned[other] == candidate; });
+        if (!taken) {
+          reg = candidate;
+          break;
+        }
+      }
+      if (!reg) {
+        // the lightest binding of the class in a register gives it up
+        Interval* victim = nullptr;
+        for (auto other : active) {
+          if (other->gpr == interval->gpr && (!victim || other->weight < victim->weight)) victim = other;
+        }
+        if (!victim || victim->weight >= interval->weight) continue;
+        reg = assigned[victim];
+        assigned.erase(victim);
+        active.erase(std::find(active.begin(), active.end(), victim));
+      }
+      assigned[interval] = *reg;
+      active.push_back(interval);
+    }
+    for (const auto& [interval, reg] : assigned) {
+      registers[interval->binding] = reg;
+    }
+  }
+};
@@ -0,0 +1,253 @@
+#include "rewritevisitor.h"
+
+void RewriteVisitor::rewrite(const std::unique_ptr<Expr> &expr) {
+  expr->accept(*this);
+  if (replacement) {
+    // nodes are only ever const through the visitor interface
+    edit(expr) = std::move(replacement);
+  }
+}
+
+void RewriteVisitor::replace(std::unique_ptr<Expr> expr) {
+  replacement = std::move(expr);
+}
+
+std::unique_ptr<Expr> RewriteVisitor::take(const std::unique_ptr<Expr> &expr) {
+  return std::move(edit(expr));
+}
+
+std::vector<const std::unique_ptr<Expr> *> RewriteVisitor::children(const Expr &expr) {
+  std::vector<const std::unique_ptr<Expr> *> slots;
+  auto add_all = [&](const std::vector<std::unique_ptr<Expr>> &exprs) {
+    for (const auto &child : exprs) {
+      slots.push_back(&child);
+    }
+  };
+  auto add_axis = [&](const std::vector<std::pair<std::string, std::unique_ptr<Expr>>> &axis) {
+    for (const auto &[variable, bound] : axis) {
+      slots.push_back(&bound);
+    }
+  };
+  auto add_hoisted = [&](const std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>> &hoisted) {
+    for (const auto &lets : hoisted) {
+      add_axis(lets);
+    }
+  };
+  if (auto node = dynamic_cast<const ArrayLiteralExpr *>(&expr)) {
+    add_all(node->elements);
+  } else if (auto node = dynamic_cast<const StructLiteralExpr *>(&expr)) {
+    add_all(node->fields);
+  } else if (auto node = dynamic_cast<const DotExpr *>(&expr)) {
+    slots.push_back(&node->expr);
+  } else if (auto node = dynamic_cast<const ArrayIndexExpr *>(&expr)) {
+    slots.push_back(&node->expr);
+    add_all(node->indices);
+  } else if (auto node = dynamic_cast<const CallExpr *>(&expr)) {
+    add_all(node->args);
+  } else if (auto node = dynamic_cast<const UnopExpr *>(&expr)) {
+    slots.push_back(&node->expr);
+  } else if (auto node = dynamic_cast<const BinopExpr *>(&expr)) {
+    slots.push_back(&node->left);
+    slots.push_back(&node->right);
+  } else if (auto node = dynamic_cast<const IfExpr *>(&expr)) {
+    slots.push_back(&node->condition);
+    slots.push_back(&node->if_expr);
+    slots.push_back(&node->else_expr);
+  } else if (auto node = dynamic_cast<const ArrayLoopExpr *>(&expr)) {
+    add_axis(node->axis);
+    add_hoisted(node->hoisted);
+    slots.push_back(&node->expr);
+    if (node->interior) slots.push_back(&node->interior);
+  } else if (auto node = dynamic_cast<const SumLoopExpr *>(&expr)) {
+    add_axis(node->axis);
+    add_hoisted(node->hoisted);
+    slots.push_back(&node->expr);
+  } else if (auto node = dynamic_cast<const LetExpr *>(&expr)) {
+    slots.push_back(&node->value);
+    slots.push_back(&node->body);
+  }
+  return slots;
+}
+
+void RewriteVisitor::names(const Expr &expr, std::unordered_set<std::string> &used) {
+  if (auto var = dynamic_cast<const VarExpr *>(&expr)) {
+    used.insert(var->identifier);
+  }
+  for (auto child : children(expr)) {
+    names(**child, used);
+  }
+}
+
+static bool all(const std::vector<bool> &marks, size_t size) {
+  if (marks.size() < size) return false;
+  for (size_t k = 0; k < size; k++) {
+    if (!marks[k]) return false;
+  }
+  return true;
+}
+
+bool RewriteVisitor::can_fail(const Expr &expr, const std::unordered_map<std::string, bool> &pure) {
+  if (auto index = dynamic_cast<const ArrayIndexExpr *>(&expr)) {
+    for (size_t k = 0; k < index->indices.size(); k++) {
+      if (k >= index->lower_safe.size() || !index->lower_safe[k] || !index->upper_safe[k]) return true;
+    }
+  } else if (auto call = dynamic_cast<const CallExpr *>(&expr)) {
+    auto it = pure.find(call->identifier);
+    if (!builtins.count(call->identifier) && (it == pure.end() || !it->second)) return true;
+  } else if (auto binop = dynamic_cast<const BinopExpr *>(&expr)) {
+    if ((binop->op == "/" || binop->op == "%") && binop->type->is<Int>() && !binop->divisor_safe) return true;
+  } else if (auto loop = dynamic_cast<const ArrayLoopExpr *>(&expr)) {
+    if (!loop->size_safe || !all(loop->bound_safe, loop->axis.size())) return true;
+  } else if (auto loop = dynamic_cast<const SumLoopExpr *>(&expr)) {
+    if (!all(loop->bound_safe, loop->axis.size())) return true;
+  }
+  for (auto child : children(expr)) {
+    if (can_fail(**child, pure)) return true;
+  }
+  return false;
+}
+
+void RewriteVisitor::rename(const std::unique_ptr<Expr> &expr, const std::string &from, const std::string &to) {
+  if (from == to) return;
+  if (auto var = dynamic_cast<const VarExpr *>(expr.get())) {
+    if (var->identifier == from) {
+      edit(var->identifier) = to;
+    }
+    return;
+  }
+  if (auto let = dynamic_cast<const LetExpr *>(expr.get())) {
+    rename(let->value, from, to);
+    if (let->identifier != from) rename(let->body, from, to);
+    return;
+  }
+  auto rebinds = [&](const auto &axis) {
+    for (const auto &[variable, bound] : axis) {
+      rename(bound, from, to);
+    }
+    for (const auto &[variable, bound] : axis) {
+      if (variable == from) return true;
+    }
+    return false;
+  };
+  // hoisted lets are renamed up to the first one that rebinds the name
+  auto inside = [&](const auto &hoisted, const std::unique_ptr<Expr> &body) {
+    for (const auto &lets : hoisted) {
+      for (const auto &[variable, value] : lets) {
+        rename(value, from, to);
+        if (variable == from) return false;
+      }
+    }
+    rename(body, from, to);
+    return true;
+  };
+  if (auto loop = dynamic_cast<const ArrayLoopExpr *>(expr.get())) {
+    if (!rebinds(loop->axis) && inside(loop->hoisted, loop->expr) && loop->interior) rename(loop->interior, from, to);
+    return;
+  }
+  if (auto loop = dynamic_cast<const SumLoopExpr *>(expr.get())) {
+    if (!rebinds(loop->axis)) inside(loop->hoisted, loop->expr);
+    return;
+  }
+  for (auto child : children(*expr)) {
+    rename(*child, from, to);
+  }
+}
+
+void RewriteVisitor::visit(const WriteCmd &node) { rewrite(node.expr); }
+
+void RewriteVisitor::visit(const LetCmd &node) {
+  rewrite(node.expr);
+  node.lvalue->accept(*this);
+}
+
+void RewriteVisitor::visit(const AssertCmd &node) { rewrite(node.expr); }
+
+void RewriteVisitor::visit(const ShowCmd &node) { rewrite(node.expr); }
+
+void RewriteVisitor::visit(const FnCmd &node) {
+  for (const auto &binding : node.params) {
+    binding->accept(*this);
+  }
+  for (const auto &stmt : node.stmts) {
+    stmt->accept(*this);
+  }
+}
+
+void RewriteVisitor::visit(const LetStmt &node) {
+  rewrite(node.expr);
+  node.lvalue->accept(*this);
+}
+
+void RewriteVisitor::visit(const AssertStmt &node) { rewrite(node.expr); }
+
+void RewriteVisitor::visit(const ReturnStmt &node) { rewrite(node.expr); }
+
+void RewriteVisitor::visit(const ArrayLiteralExpr &node) {
+  for (const auto &element : node.elements) {
+    rewrite(element);
+  }
+}
+
+void RewriteVisitor::visit(const StructLiteralExpr &node) {
+  for (const auto &field : node.fields) {
+    rewrite(field);
+  }
+}
+
+void RewriteVisitor::visit(const DotExpr &node) { rewrite(node.expr); }
+
+void RewriteVisitor::visit(const ArrayIndexExpr &node) {
+  rewrite(node.expr);
+  for (const auto &index : node.indices) {
+    rewrite(index);
+  }
+}
+
+void RewriteVisitor::visit(const CallExpr &node) {
+  for (const auto &arg : node.args) {
+    rewrite(arg);
+  }
+}
+
+void RewriteVisitor::visit(const UnopExpr &node) { rewrite(node.expr); }
+
+void RewriteVisitor::visit(const BinopExpr &node) {
+  rewrite(node.left);
+  rewrite(node.right);
+}
+
+void RewriteVisitor::visit(const IfExpr &node) {
+  rewrite(node.condition);
+  rewrite(node.if_expr);
+  rewrite(node.else_expr);
+}
+
+void RewriteVisitor::visit(const ArrayLoopExpr &node) {
+  for (const auto &[variable, expr] : node.axis) {
+    rewrite(expr);
+  }
+  for (const auto &lets : node.hoisted) {
+    for (const auto &[variable, expr] : lets) {
+      rewrite(expr);
+    }
+  }
+  rewrite(node.expr);
+  if (node.interior) rewrite(node.interior);
+}
+
+void RewriteVisitor::visit(const SumLoopExpr &node) {
+  for (const auto &[variable, expr] : node.axis) {
+    rewrite(expr);
+  }
+  for (const auto &lets : node.hoisted) {
+    for (const auto &[variable, expr] : lets) {
+      rewrite(expr);
+    }
+  }
+  rewrite(node.expr);
+}
+
+void RewriteVisitor::visit(const LetExpr &node) {
+  rewrite(node.value);
+  rewrite(node.body);
+}
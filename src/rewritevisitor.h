@@ -0,0 +1,74 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "astnodes.h"
+#include "astvisitor.h"
+
+// Base class for passes that transform the AST in place. Every child
+// expression is visited through rewrite(), and a visit method that calls
+// replace() swaps its node out for the given expression once it returns.
+class RewriteVisitor : public ASTVisitor {
+ public:
+  // Commands
+  virtual void visit(const WriteCmd &node) override;
+  virtual void visit(const LetCmd &node) override;
+  virtual void visit(const AssertCmd &node) override;
+  virtual void visit(const ShowCmd &node) override;
+  virtual void visit(const FnCmd &node) override;
+
+  // Statements
+  virtual void visit(const LetStmt &node) override;
+  virtual void visit(const AssertStmt &node) override;
+  virtual void visit(const ReturnStmt &node) override;
+
+  // Expressions
+  virtual void visit(const ArrayLiteralExpr &node) override;
+  virtual void visit(const StructLiteralExpr &node) override;
+  virtual void visit(const DotExpr &node) override;
+  virtual void visit(const ArrayIndexExpr &node) override;
+  virtual void visit(const CallExpr &node) override;
+  virtual void visit(const UnopExpr &node) override;
+  virtual void visit(const BinopExpr &node) override;
+  virtual void visit(const IfExpr &node) override;
+  virtual void visit(const ArrayLoopExpr &node) override;
+  virtual void visit(const SumLoopExpr &node) override;
+  virtual void visit(const LetExpr &node) override;
+
+  // the child expression slots of a node, in evaluation order
+  static std::vector<const std::unique_ptr<Expr> *> children(const Expr &expr);
+
+ protected:
+  // functions provided by the runtime, which never fail
+  inline static const std::unordered_set<std::string> builtins = {
+      "sqrt", "exp", "sin", "cos", "tan", "asin", "acos", "atan", "log", "pow", "atan2", "to_int", "to_float"};
+
+  void rewrite(const std::unique_ptr<Expr> &expr);
+  void replace(std::unique_ptr<Expr> expr);
+
+  // moves a child out of a node that is about to be replaced
+  std::unique_ptr<Expr> take(const std::unique_ptr<Expr> &expr);
+
+  // every variable read anywhere in an expression
+  static void names(const Expr &expr, std::unordered_set<std::string> &used);
+
+  // whether evaluating an expression might fail: a check the earlier passes
+  // could not prove away, or a call to a function not known to be pure
+  static bool can_fail(const Expr &expr, const std::unordered_map<std::string, bool> &pure = {});
+
+  // renames free uses of a variable, stopping where it is rebound
+  static void rename(const std::unique_ptr<Expr> &expr, const std::string &from, const std::string &to);
+
+  // gives write access to a child slot or a list of commands/statements
+  template <typename T>
+  static T &edit(const T &node) {
+    return const_cast<T &>(node);
+  }
+
+ private:
+  std::unique_ptr<Expr> replacement;
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "astnodes.h"
+#include "clonevisitor.h"
+#include "context.h"
+#include "rewritevisitor.h"
+
+// Procedure cloning. A call that passes literals, like circle(400.0, 10.0),
+// is redirected to a copy of the function with those parameters replaced by
+// the literals and dropped from its signature, so the later passes see fixed
+// loop bounds and geometry where the original has arbitrary values. Calls
+// with the same literals in the same places share a copy, which is placed
+// right after the original and specialized in turn. Copies are limited per
+// function and in total size; an original that is no longer called is left
+// for dead code elimination. This runs before inlining, which may then take
+// the copies where it would not have taken the original.
+class SpecializeVisitor : public RewriteVisitor {
+ public:
+  SpecializeVisitor(std::shared_ptr<Context> ctx) : ctx(ctx) {}
+
+  virtual void visit(const Program& program) override {
+    auto& cmds = edit(program.cmds);
+    for (const auto& cmd : cmds) {
+      if (auto fn = dynamic_cast<const FnCmd*>(cmd.get())) functions[fn->identifier] = fn;
+    }
+    for (size_t i = 0; i < cmds.size(); i++) {
+      cmds[i]->accept(*this);
+      while (!made.empty()) {
+        auto [original, copy] = std::move(made.front());
+        made.erase(made.begin());
+        // after the original and the copies made of it before
+        size_t at = 0;
+        while (!defines(*cmds[at], original)) at++;
+        for (at++; at < cmds.size() && copied_from(*cmds[at], original); at++);
+        auto fn = copy.get();
+        cmds.insert(cmds.begin() + at, std::move(copy));
+        // a copy of the function being visited is reached by the loop
+        if (at <= i) {
+          i++;
+          fn->accept(*this);
+        }
+      }
+    }
+  }
+
+  virtual void visit(const CallExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    auto it = functions.find(expr.identifier);
+    if (it == functions.end()) return;
+    std::vector<std::optional<std::string>> literals;
+    auto key = expr.identifier;
+    bool any = false;
+    for (const auto& arg : expr.args) {
+      literals.push_back(literal(*arg));
+      any |= literals.back().has_value();
+      key += "," + literals.back().value_or("");
+    }
+    if (!any) return;
+    auto name = specialize(*it->second, expr, literals, key);
+    if (!name) return;
+    std::vector<std::unique_ptr<Expr>> args;
+    for (size_t k = 0; k < expr.args.size(); k++) {
+      if (!literals[k]) args.push_back(take(expr.args[k]));
+    }
+    auto call = std::make_unique<CallExpr>(*name, std::move(args));
+    call->type = expr.type;
+    replace(std::move(call));
+  }
+
+ private:
+  // most copies made of one function
+  static constexpr int max_copies = 4;
+  // most code all the copies may add up to, in AST nodes
+  static constexpr int growth_limit = 4000;
+
+  std::shared_ptr<Context> ctx;
+  std::unordered_map<std::string, const FnCmd*> functions;
+  // the copy for each function and choice of literals
+  std::unordered_map<std::string, std::string> copies;
+  // the function each copy was made from
+  std::unordered_map<std::string, std::string> origins;
+  std::unordered_map<std::string, int> counts;
+  // copies waiting to be placed, with the function they were made from
+  std::vector<std::pair<std::string, std::unique_ptr<FnCmd>>> made;
+  int growth = 0;
+  int ctr = 0;
+
+  // the name of the copy a call goes to, made if needed and allowed
+  std::optional<std::string> specialize(const FnCmd& fn, const CallExpr& call, const std::vector<std::optional<std::string>>& literals,
+                                        const std::string& key) {
+    if (auto it = copies.find(key); it != copies.end()) return it->second;
+    auto size = size_of(fn);
+    if (counts[fn.identifier] >= max_copies || growth + size > growth_limit) return std::nullopt;
+    counts[fn.identifier]++;
+    growth += size;
+    auto name = fresh(fn.identifier);
+    auto copy = CloneVisitor::clone(fn, name);
+    for (size_t k = literals.size(); k-- > 0;) {
+      if (!literals[k]) continue;
+      substitute(*copy, fn.params[k]->lvalue->identifier, *call.args[k]);
+      copy->params.erase(copy->params.begin() + k);
+    }
+    std::vector<std::shared_ptr<ResolvedType>> param_types;
+    for (const auto& param : copy->params) {
+      param_types.push_back(param->type->type);
+    }
+    ctx->add(std::make_shared<FnInfo>(name, param_types, fn.return_type->type));
+    copies[key] = name;
+    origins[name] = fn.identifier;
+    made.emplace_back(fn.identifier, std::move(copy));
+    return name;
+  }
+
+  // the value of an argument written as a literal, spelled out exactly
+  static std::optional<std::string> literal(const Expr& expr) {
+    if (auto constant = dynamic_cast<const IntExpr*>(&expr)) return std::to_string(constant->value);
+    if (auto constant = dynamic_cast<const FloatExpr*>(&expr)) {
+      uint64_t bits;
+      std::memcpy(&bits, &constant->value, sizeof(bits));
+      return "f" + std::to_string(bits);
+    }
+    if (dynamic_cast<const TrueExpr*>(&expr)) return "true";
+    if (dynamic_cast<const FalseExpr*>(&expr)) return "false";
+    if (auto unop = dynamic_cast<const UnopExpr*>(&expr); unop && unop->op == "-") {
+      auto inner = literal(*unop->expr);
+      if (inner && !dynamic_cast<const UnopExpr*>(unop->expr.get())) return "-" + *inner;
+    }
+    return std::nullopt;
+  }
+
+  // a name for a copy that neither it nor its assembly labels, name and
+  // _name, share with another function
+  std::string fresh(const std::string& identifier) {
+    auto taken = [&](const std::string& name) { return ctx->lookup<NameInfo>(name).has_value(); };
+    while (true) {
+      auto name = identifier + "_spec" + std::to_string(ctr++);
+      if (!taken(name) && !taken("_" + name) && !(name[0] == '_' && taken(name.substr(1)))) return name;
+    }
+  }
+
+  static bool defines(const Cmd& cmd, const std::string& identifier) {
+    auto fn = dynamic_cast<const FnCmd*>(&cmd);
+    return fn && fn->identifier == identifier;
+  }
+
+  bool copied_from(const Cmd& cmd, const std::string& identifier) {
+    auto fn = dynamic_cast<const FnCmd*>(&cmd);
+    if (!fn) return false;
+    auto it = origins.find(fn->identifier);
+    return it != origins.end() && it->second == identifier;
+  }
+
+  static int size_of(const Expr& expr) {
+    int size = 1;
+    for (auto child : children(expr)) {
+      size += size_of(**child);
+    }
+    return size;
+  }
+
+  static int size_of(const FnCmd& fn) {
+    int size = 0;
+    for (const auto& stmt : fn.stmts) {
+      if (auto let = dynamic_cast<const LetStmt*>(stmt.get())) size += size_of(*let->expr) + 1;
+      if (auto assert = dynamic_cast<const AssertStmt*>(stmt.get())) size += size_of(*assert->expr) + 1;
+      if (auto ret = dynamic_cast<const ReturnStmt*>(stmt.get())) size += size_of(*ret->expr);
+    }
+    return size;
+  }
+
+  // replaces a parameter with a literal in the statements up to where it is
+  // bound again
+  static void substitute(FnCmd& fn, const std::string& param, const Expr& value) {
+    for (const auto& stmt : fn.stmts) {
+      if (auto let = dynamic_cast<const LetStmt*>(stmt.get())) {
+        substitute(let->expr, param, value);
+        auto array = dynamic_cast<const ArrayLValue*>(let->lvalue.get());
+        if (let->lvalue->identifier == param) return;
+        if (array && std::find(array->indices.begin(), array->indices.end(), param) != array->indices.end()) return;
+      }
+      if (auto assert = dynamic_cast<const AssertStmt*>(stmt.get())) substitute(assert->expr, param, value);
+      if (auto ret = dynamic_cast<const ReturnStmt*>(stmt.get())) substitute(ret->expr, param, value);
+    }
+  }
+
+  // as UnrollVisitor's, stopping where the name is rebound
+  static void substitute(const std::unique_ptr<Expr>& expr, const std::string& param, const Expr& value) {
+    if (auto var = dynamic_cast<const VarExpr*>(expr.get())) {
+      if (var->identifier == param) edit(expr) = CloneVisitor::clone(value);
+      return;
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(expr.get())) {
+      substitute(let->value, param, value);
+      if (let->identifier != param) substitute(let->body, param, value);
+      return;
+    }
+    auto inside = [&](const auto& axis, const std::unique_ptr<Expr>& body) {
+      for (const auto& [_, bound] : axis) substitute(bound, param, value);
+      for (const auto& [name, _] : axis) {
+        if (name == param) return;
+      }
+      substitute(body, param, value);
+    };
+    if (auto loop = dynamic_cast<const ArrayLoopExpr*>(expr.get())) return inside(loop->axis, loop->expr);
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(expr.get())) return inside(loop->axis, loop->expr);
+    for (auto child : children(*expr)) {
+      substitute(*child, param, value);
+    }
+  }
+};
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "astnodes.h"
+#include "context.h"
+#include "rewritevisitor.h"
+
+// Scalar replacement of aggregates. A struct literal bound by a let or a let
+// statement whose name is only ever read through its fields, like rgba{r, g,
+// b, 1.0} or the struct of sums that fusion and unrolling leave behind, is
+// bound field by field instead, and each p.r becomes a plain variable that
+// constant folding, CSE and the register allocator can work with. Field
+// reads are also moved to where the struct is built: into the body of a let
+// and the branches of an if, and onto the field itself for a struct literal
+// whose other fields cannot fail. Structs that are stored, passed or
+// returned whole stay in memory, where the code generator reads a field of
+// a variable straight from its slot.
+class SROAVisitor : public RewriteVisitor {
+ public:
+  SROAVisitor(std::shared_ptr<Context> ctx) : ctx(ctx) {}
+
+  virtual void visit(const FnCmd& fn) override {
+    RewriteVisitor::visit(fn);
+    auto& stmts = edit(fn.stmts);
+    for (size_t i = 0; i < stmts.size(); i++) {
+      auto let = dynamic_cast<const LetStmt*>(stmts[i].get());
+      if (!let || !dynamic_cast<const VarLValue*>(let->lvalue.get())) continue;
+      auto literal = dynamic_cast<const StructLiteralExpr*>(let->expr.get());
+      if (!literal) continue;
+      const auto& identifier = let->lvalue->identifier;
+      bool split = true;
+      for (size_t k = i + 1; k < stmts.size(); k++) {
+        split &= fields_only(*value_of(*stmts[k]), identifier);
+      }
+      if (!split) continue;
+      auto fields = fresh(*literal);
+      for (size_t k = i + 1; k < stmts.size(); k++) {
+        project(value_of(*stmts[k]), identifier, fields);
+      }
+      // the literal evaluates its fields last to first, and so do the lets
+      std::vector<std::unique_ptr<Stmt>> lets;
+      for (size_t f = literal->fields.size(); f-- > 0;) {
+        auto name = fields[field_name(*literal, f)];
+        lets.push_back(std::make_unique<LetStmt>(std::make_unique<VarLValue>(name), take(literal->fields[f])));
+      }
+      auto count = lets.size();
+      stmts.erase(stmts.begin() + i);
+      stmts.insert(stmts.begin() + i, std::make_move_iterator(lets.begin()), std::make_move_iterator(lets.end()));
+      i += count - 1;
+    }
+  }
+
+  virtual void visit(const LetExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    auto literal = dynamic_cast<const StructLiteralExpr*>(expr.value.get());
+    if (!literal || !fields_only(*expr.body, expr.identifier)) return;
+    auto fields = fresh(*literal);
+    project(expr.body, expr.identifier, fields);
+    // the last field is bound outermost, as the literal evaluates it first
+    auto body = take(expr.body);
+    for (size_t f = 0; f < literal->fields.size(); f++) {
+      auto type = body->type;
+      body = std::make_unique<LetExpr>(fields[field_name(*literal, f)], take(literal->fields[f]), std::move(body));
+      body->type = type;
+    }
+    replace(std::move(body));
+  }
+
+  virtual void visit(const DotExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    if (!sinks(expr)) return;
+    auto dot = std::make_unique<DotExpr>(take(expr.expr), expr.field);
+    dot->type = expr.type;
+    std::unique_ptr<Expr> result = std::move(dot);
+    sink(result);
+    replace(std::move(result));
+  }
+
+ private:
+  std::shared_ptr<Context> ctx;
+  int ctr = 0;
+
+  static const std::unique_ptr<Expr>& value_of(const Stmt& stmt) {
+    if (auto let = dynamic_cast<const LetStmt*>(&stmt)) return let->expr;
+    if (auto assert = dynamic_cast<const AssertStmt*>(&stmt)) return assert->expr;
+    return static_cast<const ReturnStmt&>(stmt).expr;
+  }
+
+  std::string field_name(const StructLiteralExpr& literal, size_t f) {
+    return ctx->lookup<StructInfo>(literal.identifier)->fields[f].first;
+  }
+
+  // a variable for each field of a struct literal
+  std::map<std::string, std::string> fresh(const StructLiteralExpr& literal) {
+    std::map<std::string, std::string> fields;
+    for (size_t f = 0; f < literal.fields.size(); f++) {
+      fields[field_name(literal, f)] = "_sra" + std::to_string(ctr++);
+    }
+    return fields;
+  }
+
+  // whether a field read can move into the expression it reads from
+  bool sinks(const DotExpr& dot) {
+    const auto& inner = *dot.expr;
+    if (dynamic_cast<const LetExpr*>(&inner) || dynamic_cast<const IfExpr*>(&inner)) return true;
+    auto literal = dynamic_cast<const StructLiteralExpr*>(&inner);
+    if (!literal) return false;
+    for (size_t f = 0; f < literal->fields.size(); f++) {
+      if (field_name(*literal, f) != dot.field && can_fail(*literal->fields[f])) return false;
+    }
+    return true;
+  }
+
+  // moves the field read in a slot as far in as it goes
+  void sink(std::unique_ptr<Expr>& slot) {
+    auto& dot = static_cast<const DotExpr&>(*slot);
+    if (!sinks(dot)) return;
+    auto field = dot.field;
+    auto type = dot.type;
+    auto inner = take(dot.expr);
+    auto wrap = [&](const std::unique_ptr<Expr>& branch) {
+      auto read = std::make_unique<DotExpr>(take(branch), field);
+      read->type = type;
+      std::unique_ptr<Expr> result = std::move(read);
+      sink(result);
+      edit(branch) = std::move(result);
+    };
+    if (auto literal = dynamic_cast<const StructLiteralExpr*>(inner.get())) {
+      for (size_t f = 0; f < literal->fields.size(); f++) {
+        if (field_name(*literal, f) == field) slot = take(literal->fields[f]);
+      }
+      return;
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(inner.get())) {
+      wrap(let->body);
+    } else if (auto branch = dynamic_cast<const IfExpr*>(inner.get())) {
+      wrap(branch->if_expr);
+      wrap(branch->else_expr);
+    }
+    inner->type = type;
+    slot = std::move(inner);
+  }
+
+  // whether every free use of a name reads one of its fields
+  static bool fields_only(const Expr& expr, const std::string& name) {
+    if (auto var = dynamic_cast<const VarExpr*>(&expr)) return var->identifier != name;
+    if (auto dot = dynamic_cast<const DotExpr*>(&expr)) {
+      auto var = dynamic_cast<const VarExpr*>(dot->expr.get());
+      if (var && var->identifier == name) return true;
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      return fields_only(*let->value, name) && (let->identifier == name || fields_only(*let->body, name));
+    }
+    auto inside = [&](const auto& axis, const auto& hoisted, const Expr& body) {
+      for (const auto& [_, bound] : axis) {
+        if (!fields_only(*bound, name)) return false;
+      }
+      for (const auto& [variable, _] : axis) {
+        if (variable == name) return true;
+      }
+      for (const auto& lets : hoisted) {
+        for (const auto& [identifier, value] : lets) {
+          if (!fields_only(*value, name)) return false;
+          if (identifier == name) return true;
+        }
+      }
+      return fields_only(body, name);
+    };
+    if (auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr)) return inside(loop->axis, loop->hoisted, *loop->expr);
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(&expr)) return inside(loop->axis, loop->hoisted, *loop->expr);
+    for (auto child : children(expr)) {
+      if (!fields_only(**child, name)) return false;
+    }
+    return true;
+  }
+
+  // replaces the field reads of a name with the variables for its fields
+  static void project(const std::unique_ptr<Expr>& expr, const std::string& name, const std::map<std::string, std::string>& fields) {
+    if (auto dot = dynamic_cast<const DotExpr*>(expr.get())) {
+      auto var = dynamic_cast<const VarExpr*>(dot->expr.get());
+      if (var && var->identifier == name) {
+        auto field = std::make_unique<VarExpr>(fields.at(dot->field));
+        field->type = expr->type;
+        edit(expr) = std::move(field);
+        return;
+      }
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(expr.get())) {
+      project(let->value, name, fields);
+      if (let->identifier != name) project(let->body, name, fields);
+      return;
+    }
+    auto inside = [&](const auto& axis, const auto& hoisted, const std::unique_ptr<Expr>& body) {
+      for (const auto& [_, bound] : axis) project(bound, name, fields);
+      for (const auto& [variable, _] : axis) {
+        if (variable == name) return;
+      }
+      for (const auto& lets : hoisted) {
+        for (const auto& [identifier, value] : lets) {
+          project(value, name, fields);
+          if (identifier == name) return;
+        }
+      }
+      project(body, name, fields);
+    };
+    if (auto loop = dynamic_cast<const ArrayLoopExpr*>(expr.get())) return inside(loop->axis, loop->hoisted, loop->expr);
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(expr.get())) return inside(loop->axis, loop->hoisted, loop->expr);
+    for (auto child : children(*expr)) {
+      project(*child, name, fields);
+    }
+  }
+};
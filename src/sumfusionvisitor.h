@@ -0,0 +1,403 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "astnodes.h"
+#include "context.h"
+#include "rewritevisitor.h"
+
+// Fuses sum loops over the same iteration space into a single loop that
+// accumulates a struct with one field per original sum, e.g. the four
+// neighbourhood sums of a blur kernel. Sums are fused when they are evaluated
+// unconditionally in the same statement list (or chain of LetExprs / loop
+// body), only lets separate them, and none of them reads a variable bound in
+// between. The fused loop runs where the first sum did, so a group is only
+// fused when nothing else evaluated from there to the last sum can fail, and
+// the bodies that can fail all fail alike, at a field of the same read like
+// padded[i + ii, j + jj].r; the failure reported is then the same.
+class SumFusionVisitor : public RewriteVisitor {
+ public:
+  SumFusionVisitor(std::shared_ptr<Context> ctx) : ctx(ctx) {}
+
+  virtual void visit(const Program& program) override {
+    auto items = [&]() {
+      std::vector<Item> items;
+      for (const auto& cmd : program.cmds) {
+        items.push_back(item_of(*cmd));
+      }
+      return items;
+    };
+    auto bind = [&](size_t position, std::string name, std::unique_ptr<Expr> value) {
+      auto& cmds = edit(program.cmds);
+      auto let = std::make_unique<LetCmd>(std::make_unique<VarLValue>(name), std::move(value));
+      cmds.insert(cmds.begin() + position, std::move(let));
+    };
+    fuse(items, bind);
+    for (const auto& cmd : program.cmds) {
+      if (dynamic_cast<const FnCmd*>(cmd.get())) {
+        cmd->accept(*this);
+      } else if (auto expr = item_of(*cmd).expr) {
+        walk(*expr);
+      }
+    }
+
+    // the accumulator structs go first so every backend sees them before use
+    auto& cmds = edit(program.cmds);
+    for (auto& st : structs) {
+      cmds.insert(cmds.begin(), std::move(st));
+    }
+    structs.clear();
+  }
+
+  virtual void visit(const FnCmd& fn) override {
+    auto items = [&]() {
+      std::vector<Item> items;
+      for (const auto& stmt : fn.stmts) {
+        items.push_back(item_of(*stmt));
+      }
+      return items;
+    };
+    auto bind = [&](size_t position, std::string name, std::unique_ptr<Expr> value) {
+      auto& stmts = edit(fn.stmts);
+      auto let = std::make_unique<LetStmt>(std::make_unique<VarLValue>(name), std::move(value));
+      stmts.insert(stmts.begin() + position, std::move(let));
+    };
+    fuse(items, bind);
+    for (const auto& stmt : fn.stmts) {
+      if (auto expr = item_of(*stmt).expr) {
+        walk(*expr);
+      }
+    }
+  }
+
+ private:
+  // one evaluation step of a region: a statement or a link of a LetExpr chain
+  struct Item {
+    const std::unique_ptr<Expr>* expr;
+    std::vector<std::string> binds;
+    bool let;
+  };
+
+  struct Candidate {
+    const std::unique_ptr<Expr>* slot;
+    size_t position;
+  };
+
+  typedef std::function<std::vector<Item>()> Items;
+  typedef std::function<void(size_t, std::string, std::unique_ptr<Expr>)> Bind;
+
+  std::shared_ptr<Context> ctx;
+  std::vector<std::unique_ptr<StructCmd>> structs;
+  int ctr = 0;
+
+  void walk(const std::unique_ptr<Expr>& expr) {
+    if (dynamic_cast<const LetExpr*>(expr.get())) {
+      chain(expr);
+    } else if (auto loop = dynamic_cast<const ArrayLoopExpr*>(expr.get())) {
+      for (const auto& [variable, bound] : loop->axis) {
+        walk(bound);
+      }
+      chain(loop->expr);
+    } else if (auto loop = dynamic_cast<const SumLoopExpr*>(expr.get())) {
+      for (const auto& [variable, bound] : loop->axis) {
+        walk(bound);
+      }
+      chain(loop->expr);
+    } else {
+      for (auto child : children(*expr)) {
+        walk(*child);
+      }
+    }
+  }
+
+  // a LetExpr chain is a region of its own, with a link per binding
+  void chain(const std::unique_ptr<Expr>& head) {
+    auto links = [&head]() {
+      std::vector<const std::unique_ptr<Expr>*> links{&head};
+      while (auto let = dynamic_cast<const LetExpr*>(links.back()->get())) {
+        links.push_back(&let->body);
+      }
+      return links;
+    };
+    auto items = [=]() {
+      std::vector<Item> items;
+      for (auto link : links()) {
+        if (auto let = dynamic_cast<const LetExpr*>(link->get())) {
+          items.push_back({&let->value, {let->identifier}, true});
+        } else {
+          items.push_back({link, {}, true});
+        }
+      }
+      return items;
+    };
+    auto bind = [=](size_t position, std::string name, std::unique_ptr<Expr> value) {
+      auto link = links()[position];
+      auto type = (*link)->type;
+      auto let = std::make_unique<LetExpr>(name, std::move(value), take(*link));
+      let->type = type;
+      edit(*link) = std::move(let);
+    };
+    fuse(items, bind);
+    for (const auto& item : items()) {
+      walk(*item.expr);
+    }
+  }
+
+  void fuse(Items items, Bind bind) {
+    while (auto group = pick(items())) {
+      auto position = group->front().position;
+      auto name = "_sum" + std::to_string(ctr++);
+      bind(position, name, fused(name, *group));
+    }
+  }
+
+  // the first set of sums that can share a loop, in evaluation order
+  std::optional<std::vector<Candidate>> pick(const std::vector<Item>& items) {
+    std::vector<Candidate> sums;
+    for (size_t i = 0; i < items.size(); i++) {
+      if (items[i].expr) {
+        candidates(*items[i].expr, i, sums);
+      }
+    }
+    for (size_t l = 0; l < sums.size(); l++) {
+      const auto& leader = as_sum(sums[l]);
+      std::vector<Candidate> group{sums[l]};
+      std::unordered_set<std::string> bound;
+      size_t position = sums[l].position;
+      for (size_t m = l + 1; m < sums.size(); m++) {
+        // everything evaluated between the two sums must be a let
+        for (; position < sums[m].position; position++) {
+          if (!items[position].let) break;
+          bound.insert(items[position].binds.begin(), items[position].binds.end());
+        }
+        if (position < sums[m].position) break;
+        if (fusable(leader, as_sum(sums[m]), bound)) {
+          group.push_back(sums[m]);
+        }
+      }
+      if (group.size() > 1 && in_order(items, group)) {
+        return group;
+      }
+    }
+    return std::nullopt;
+  }
+
+  // sums evaluated every time the expression is, outside of nested loops
+  void candidates(const std::unique_ptr<Expr>& expr, size_t position, std::vector<Candidate>& sums) {
+    if (dynamic_cast<const SumLoopExpr*>(expr.get())) {
+      sums.push_back({&expr, position});
+    } else if (dynamic_cast<const ArrayLoopExpr*>(expr.get()) || dynamic_cast<const LetExpr*>(expr.get())) {
+      return;
+    } else if (auto if_expr = dynamic_cast<const IfExpr*>(expr.get())) {
+      candidates(if_expr->condition, position, sums);
+    } else if (auto binop = dynamic_cast<const BinopExpr*>(expr.get()); binop && (binop->op == "&&" || binop->op == "||")) {
+      candidates(binop->left, position, sums);
+    } else {
+      for (auto child : children(*expr)) {
+        candidates(*child, position, sums);
+      }
+    }
+  }
+
+  bool fusable(const SumLoopExpr& leader, const SumLoopExpr& sum, const std::unordered_set<std::string>& bound) {
+    if (leader.axis.size() != sum.axis.size()) return false;
+    std::unordered_set<std::string> used;
+    names(sum, used);
+    for (const auto& name : used) {
+      if (bound.count(name)) return false;
+    }
+    for (size_t i = 0; i < sum.axis.size(); i++) {
+      if (!same(*leader.axis[i].second, *sum.axis[i].second)) return false;
+      // the body is renamed to the leader's loop variables, which must be free
+      if (leader.axis[i].first != sum.axis[i].first && used.count(leader.axis[i].first)) return false;
+    }
+    return true;
+  }
+
+  // whether the fused loop reports the failure the sums would have
+  bool in_order(const std::vector<Item>& items, const std::vector<Candidate>& group) {
+    for (size_t i = group.front().position; i <= group.back().position; i++) {
+      if (fails_besides(**items[i].expr, group)) return false;
+    }
+    auto& leader = as_sum(group.front());
+    const ArrayIndexExpr* first = nullptr;
+    std::unordered_map<std::string, std::string> first_renames;
+    for (const auto& member : group) {
+      auto& sum = as_sum(member);
+      if (!can_fail(*sum.expr)) continue;
+      auto read = failing_read(*sum.expr);
+      if (!read) return false;
+      // the sum's loop variables stand for the leader's
+      std::unordered_map<std::string, std::string> renames;
+      for (size_t i = 0; i < sum.axis.size(); i++) renames[sum.axis[i].first] = leader.axis[i].first;
+      if (!first) {
+        first = read;
+        first_renames = renames;
+      } else if (!same_read(*first, first_renames, *read, renames)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // whether anything in an expression but the sums of a group can fail
+  static bool fails_besides(const Expr& expr, const std::vector<Candidate>& group) {
+    for (const auto& member : group) {
+      if (member.slot->get() == &expr) return false;
+    }
+    if (!std::any_of(group.begin(), group.end(), [&](const Candidate& member) { return contains(expr, **member.slot); })) {
+      return can_fail(expr);
+    }
+    // around a sum, only the node itself and its other parts count
+    if (dynamic_cast<const ArrayIndexExpr*>(&expr)) return true;
+    if (auto call = dynamic_cast<const CallExpr*>(&expr); call && !builtins.count(call->identifier)) return true;
+    auto binop = dynamic_cast<const BinopExpr*>(&expr);
+    if (binop && (binop->op == "/" || binop->op == "%") && binop->type->is<Int>()) return true;
+    for (auto child : children(expr)) {
+      if (fails_besides(**child, group)) return true;
+    }
+    return false;
+  }
+
+  static bool contains(const Expr& expr, const Expr& part) {
+    if (&expr == &part) return true;
+    for (auto child : children(expr)) {
+      if (contains(**child, part)) return true;
+    }
+    return false;
+  }
+
+  // the read a sum's body can fail at, when all that can fail in it is a
+  // field of a read of a variable
+  static const ArrayIndexExpr* failing_read(const Expr& body) {
+    const Expr* base = &body;
+    while (auto dot = dynamic_cast<const DotExpr*>(base)) base = dot->expr.get();
+    auto read = dynamic_cast<const ArrayIndexExpr*>(base);
+    if (!read || base == &body || !dynamic_cast<const VarExpr*>(read->expr.get())) return nullptr;
+    for (const auto& index : read->indices) {
+      if (can_fail(*index)) return nullptr;
+    }
+    return read;
+  }
+
+  typedef std::unordered_map<std::string, std::string> Renames;
+
+  static bool same_read(const ArrayIndexExpr& a, const Renames& a_renames, const ArrayIndexExpr& b, const Renames& b_renames) {
+    if (!same(*a.expr, *b.expr) || a.indices.size() != b.indices.size()) return false;
+    for (size_t k = 0; k < a.indices.size(); k++) {
+      if (!same(*a.indices[k], *b.indices[k], a_renames, b_renames)) return false;
+    }
+    return true;
+  }
+
+  std::unique_ptr<Expr> fused(const std::string& name, const std::vector<Candidate>& group) {
+    auto struct_name = name + "_t";
+    auto struct_type = std::make_shared<Struct>(struct_name);
+    auto& leader = as_sum(group.front());
+
+    std::vector<std::unique_ptr<Expr>> bodies;
+    std::vector<std::pair<std::string, std::shared_ptr<ResolvedType>>> fields;
+    std::vector<std::pair<std::string, std::unique_ptr<Type>>> field_types;
+    for (size_t k = 0; k < group.size(); k++) {
+      auto& sum = as_sum(group[k]);
+      for (size_t i = 0; i < sum.axis.size(); i++) {
+        rename(sum.expr, sum.axis[i].first, leader.axis[i].first);
+      }
+      auto field = "f" + std::to_string(k);
+      auto type = sum.type;
+      fields.emplace_back(field, type);
+      field_types.emplace_back(field, type_node(type));
+      bodies.push_back(take(sum.expr));
+    }
+    ctx->add(std::make_shared<StructInfo>(struct_name, fields));
+    structs.push_back(std::make_unique<StructCmd>(struct_name, std::move(field_types)));
+
+    auto body = std::make_unique<StructLiteralExpr>(struct_name, std::move(bodies));
+    body->type = struct_type;
+    std::vector<std::pair<std::string, std::unique_ptr<Expr>>> axis;
+    for (const auto& [variable, bound] : leader.axis) {
+      axis.emplace_back(variable, take(bound));
+    }
+    auto loop = std::make_unique<SumLoopExpr>(std::move(axis), std::move(body));
+    loop->type = struct_type;
+
+    // each sum now reads its field of the fused result
+    for (size_t k = 0; k < group.size(); k++) {
+      auto var = std::make_unique<VarExpr>(name);
+      var->type = struct_type;
+      auto type = (*group[k].slot)->type;
+      auto dot = std::make_unique<DotExpr>(std::move(var), "f" + std::to_string(k));
+      dot->type = type;
+      edit(*group[k].slot) = std::move(dot);
+    }
+    return loop;
+  }
+
+  Item item_of(const ASTNode& node) {
+    if (auto cmd = dynamic_cast<const LetCmd*>(&node)) return {&cmd->expr, binds_of(*cmd->lvalue), true};
+    if (auto stmt = dynamic_cast<const LetStmt*>(&node)) return {&stmt->expr, binds_of(*stmt->lvalue), true};
+    if (auto cmd = dynamic_cast<const ShowCmd*>(&node)) return {&cmd->expr, {}, false};
+    if (auto cmd = dynamic_cast<const AssertCmd*>(&node)) return {&cmd->expr, {}, false};
+    if (auto cmd = dynamic_cast<const WriteCmd*>(&node)) return {&cmd->expr, {}, false};
+    if (auto stmt = dynamic_cast<const AssertStmt*>(&node)) return {&stmt->expr, {}, false};
+    if (auto stmt = dynamic_cast<const ReturnStmt*>(&node)) return {&stmt->expr, {}, false};
+    if (auto cmd = dynamic_cast<const ReadCmd*>(&node)) return {nullptr, binds_of(*cmd->lvalue), false};
+    // definitions do nothing when run
+    bool definition = dynamic_cast<const FnCmd*>(&node) || dynamic_cast<const StructCmd*>(&node);
+    return {nullptr, {}, definition};
+  }
+
+  static std::vector<std::string> binds_of(const LValue& lvalue) {
+    std::vector<std::string> binds{lvalue.identifier};
+    if (auto array_lvalue = dynamic_cast<const ArrayLValue*>(&lvalue)) {
+      binds.insert(binds.end(), array_lvalue->indices.begin(), array_lvalue->indices.end());
+    }
+    return binds;
+  }
+
+  static const SumLoopExpr& as_sum(const Candidate& candidate) {
+    return static_cast<const SumLoopExpr&>(**candidate.slot);
+  }
+
+  // structural equality of pure loop bounds and indices, with the variables
+  // of each side renamed
+  static bool same(const Expr& a, const Expr& b, const Renames& a_renames = {}, const Renames& b_renames = {}) {
+    if (auto x = dynamic_cast<const IntExpr*>(&a)) {
+      auto y = dynamic_cast<const IntExpr*>(&b);
+      return y && x->value == y->value;
+    }
+    if (auto x = dynamic_cast<const VarExpr*>(&a)) {
+      auto y = dynamic_cast<const VarExpr*>(&b);
+      auto renamed = [](const std::string& name, const Renames& renames) {
+        auto it = renames.find(name);
+        return it == renames.end() ? name : it->second;
+      };
+      return y && renamed(x->identifier, a_renames) == renamed(y->identifier, b_renames);
+    }
+    if (auto x = dynamic_cast<const UnopExpr*>(&a)) {
+      auto y = dynamic_cast<const UnopExpr*>(&b);
+      return y && x->op == y->op && same(*x->expr, *y->expr, a_renames, b_renames);
+    }
+    if (auto x = dynamic_cast<const BinopExpr*>(&a)) {
+      auto y = dynamic_cast<const BinopExpr*>(&b);
+      return y && x->op == y->op && same(*x->left, *y->left, a_renames, b_renames) && same(*x->right, *y->right, a_renames, b_renames);
+    }
+    return false;
+  }
+
+  static std::unique_ptr<Type> type_node(std::shared_ptr<ResolvedType> type) {
+    std::unique_ptr<Type> node;
+    if (type->is<Int>()) {
+      node = std::make_unique<IntType>();
+    } else {
+      node = std::make_unique<FloatType>();
+    }
+    node->type = type;
+    return node;
+  }
+};
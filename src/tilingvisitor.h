@@ -0,0 +1,170 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_set>
+
+#include "affine.h"
+#include "astnodes.h"
+#include "context.h"
+#include "rewritevisitor.h"
+
+// Cache-blocked tiling for stencils. A two-axis array loop whose body reads
+// a two-dimensional array at [i + a, j + b], with a and b constants or the
+// variables of inner loops with constant bounds, reads every input row again
+// for each output row in its neighbourhood; on a large image the row has left
+// L1 by then. Such loops are marked to run in strips of columns, all the rows
+// of one strip before the next, so the rows a strip reads stay in cache. The
+// strip is as wide as fits the rows read from each array into half of a
+// 32 KiB L1. Tiling changes the order the elements are computed in, so only
+// loops whose body and hoisted lets cannot fail are tiled.
+class TilingVisitor : public RewriteVisitor {
+ public:
+  TilingVisitor(std::shared_ptr<Context> ctx) : ctx(ctx) {}
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    if (expr.axis.size() != 2 || !expr.dims.empty() || can_fail(*expr.expr)) return;
+    Scope scope;
+    for (const auto& lets : expr.hoisted) {
+      for (const auto& [identifier, value] : lets) {
+        if (can_fail(*value)) return;
+        let(identifier, *value, scope);
+      }
+    }
+    scope.rows = {expr.axis[0].first, expr.axis[1].first};
+    find_reads(*expr.expr, scope);
+    int64_t bytes = 0;
+    bool stencil = false;
+    for (const auto& [array, read] : scope.reads) {
+      bytes += read.rows * read.element_size;
+      stencil |= read.rows > 1;
+    }
+    if (!stencil) return;
+    int64_t tile = max_tile;
+    while (tile > min_tile && tile * bytes > l1_size / 2) tile /= 2;
+    expr.tile = tile;
+  }
+
+ private:
+  std::shared_ptr<Context> ctx;
+
+  inline static const int64_t l1_size = 32 * 1024;
+  inline static const int64_t min_tile = 8;
+  inline static const int64_t max_tile = 1024;
+
+  struct Read {
+    int64_t rows = 0;
+    int64_t element_size = 0;
+  };
+
+  struct Scope {
+    // the loop's variables, outer then inner
+    std::vector<std::string> rows;
+    // lets in the loop with an affine value, in terms of outer names
+    std::map<std::string, Affine> lets;
+    // every other name bound in the loop
+    std::unordered_set<std::string> opaque;
+    // variables of inner loops with constant bounds
+    AffineRanges inner;
+    std::map<std::string, Read> reads;
+  };
+
+  void let(const std::string& identifier, const Expr& value, Scope& scope) {
+    if (auto affine = resolve(value, scope)) {
+      scope.lets[identifier] = *affine;
+    } else {
+      scope.opaque.insert(identifier);
+    }
+  }
+
+  // an index in terms of the loop's variables, inner loop variables and
+  // names bound outside the loop
+  std::optional<Affine> resolve(const Expr& expr, const Scope& scope) {
+    if (!expr.type || !expr.type->is<Int>()) return std::nullopt;
+    auto affine = Affine::of(expr);
+    if (!affine) return std::nullopt;
+    auto terms = affine->terms;
+    for (const auto& [name, _] : terms) {
+      if (scope.opaque.count(name)) return std::nullopt;
+      if (auto it = scope.lets.find(name); it != scope.lets.end()) {
+        affine = affine->substitute(name, it->second);
+        if (!affine) return std::nullopt;
+      }
+    }
+    return affine;
+  }
+
+  void inner_loop(const std::vector<std::pair<std::string, std::unique_ptr<Expr>>>& axis,
+                  const std::vector<std::vector<std::pair<std::string, std::unique_ptr<Expr>>>>& hoisted, const Expr& body,
+                  Scope& scope) {
+    for (const auto& [_, bound] : axis) find_reads(*bound, scope);
+    for (const auto& [variable, bound] : axis) {
+      if (auto constant = dynamic_cast<const IntExpr*>(bound.get())) {
+        scope.inner.loops[variable] = Affine(constant->value);
+      } else {
+        scope.opaque.insert(variable);
+      }
+    }
+    for (const auto& lets : hoisted) {
+      for (const auto& [identifier, value] : lets) {
+        find_reads(*value, scope);
+        let(identifier, *value, scope);
+      }
+    }
+    find_reads(body, scope);
+  }
+
+  void find_reads(const Expr& expr, Scope& scope) {
+    if (auto let = dynamic_cast<const LetExpr*>(&expr)) {
+      find_reads(*let->value, scope);
+      this->let(let->identifier, *let->value, scope);
+      find_reads(*let->body, scope);
+      return;
+    }
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(&expr)) {
+      inner_loop(loop->axis, loop->hoisted, *loop->expr, scope);
+      return;
+    }
+    if (auto loop = dynamic_cast<const ArrayLoopExpr*>(&expr)) {
+      inner_loop(loop->axis, loop->hoisted, *loop->expr, scope);
+      return;
+    }
+    if (auto read = dynamic_cast<const ArrayIndexExpr*>(&expr)) {
+      neighbourhood(*read, scope);
+    }
+    for (auto child : children(expr)) {
+      find_reads(**child, scope);
+    }
+  }
+
+  // records the rows a read of a two-dimensional array at [i + a, j + b]
+  // touches, for a and b with a constant range
+  void neighbourhood(const ArrayIndexExpr& read, Scope& scope) {
+    auto array = dynamic_cast<const VarExpr*>(read.expr.get());
+    if (!array || read.indices.size() != 2 || scope.opaque.count(array->identifier)) {
+      return;
+    }
+    std::vector<int64_t> spans;
+    for (size_t k = 0; k < 2; k++) {
+      auto index = resolve(*read.indices[k], scope);
+      if (!index) return;
+      for (size_t other = 0; other < 2; other++) {
+        if (index->coefficient(scope.rows[other]) != (other == k ? 1 : 0)) return;
+      }
+      auto offset = index->add(Affine::var(scope.rows[k]), -1);
+      if (!offset) return;
+      auto least = scope.inner.extreme(*offset, false);
+      auto most = scope.inner.extreme(*offset, true);
+      if (!least || !most) return;
+      auto span = most->add(*least, -1);
+      if (!span || !span->is_constant()) return;
+      spans.push_back(span->constant + 1);
+    }
+    auto& record = scope.reads[array->identifier];
+    record.rows = std::max(record.rows, spans[0]);
+    record.element_size = read.type->size(ctx.get());
+  }
+};
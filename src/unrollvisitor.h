@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "astnodes.h"
+#include "clonevisitor.h"
+#include "rewritevisitor.h"
+
+// Full unrolling of small loops. A sum or a one-axis array loop whose bounds
+// are small constants, like the sum[ii : 3, jj : 3] of a 3x3 stencil, is
+// replaced by a copy of its body for every iteration, in the order the loop
+// runs them, with the loop variables substituted by their values: a chain of
+// additions, a struct literal of chains for the struct sums of fused loops,
+// or an array literal. Offsets such as img[i + 1, j + 2] are left for
+// constant folding and the code generator's addressing. Only loops whose
+// copies stay under a size budget are unrolled. The code generator evaluates
+// operands and elements right to left, so where copies can fail, a sum adds
+// each onto the left of the ones before it and other loops bind them by lets
+// in iteration order, and the failure reported is the loop's.
+class UnrollVisitor : public RewriteVisitor {
+ public:
+  virtual void visit(const SumLoopExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    auto iterations = unrollable(expr.axis, *expr.expr);
+    if (!iterations) return;
+    auto ordered = can_fail(*expr.expr);
+    if (expr.type->is<Int>() || expr.type->is<Float>()) {
+      std::vector<std::unique_ptr<Expr>> terms;
+      for (int64_t n = 0; n < *iterations; n++) {
+        terms.push_back(instance(expr.axis, *expr.expr, n));
+      }
+      replace(chain(std::move(terms), expr.type, ordered));
+      return;
+    }
+    // a fused sum adds up each field of its struct literal separately
+    auto literal = dynamic_cast<const StructLiteralExpr*>(expr.expr.get());
+    if (!literal) return;
+    for (const auto& field : literal->fields) {
+      if (!field->type->is<Int>() && !field->type->is<Float>()) return;
+    }
+    // the loop evaluates the fields last to first in each iteration; when
+    // they can only fail alike, one chain after another fails the same way
+    auto interleaved = ordered && !fail_alike(*literal);
+    std::vector<std::vector<std::unique_ptr<Expr>>> terms(literal->fields.size());
+    for (int64_t n = 0; n < *iterations; n++) {
+      for (size_t f = literal->fields.size(); f-- > 0;) {
+        terms[f].push_back(term(instance(expr.axis, *literal->fields[f], n), interleaved));
+      }
+    }
+    std::vector<std::unique_ptr<Expr>> fields;
+    for (size_t f = 0; f < literal->fields.size(); f++) {
+      fields.push_back(chain(std::move(terms[f]), literal->fields[f]->type, ordered && !interleaved));
+    }
+    auto result = std::make_unique<StructLiteralExpr>(literal->identifier, std::move(fields));
+    result->type = expr.type;
+    replace(bind(std::move(result)));
+  }
+
+  virtual void visit(const ArrayLoopExpr& expr) override {
+    RewriteVisitor::visit(expr);
+    if (expr.axis.size() != 1) return;
+    auto iterations = unrollable(expr.axis, *expr.expr);
+    if (!iterations) return;
+    auto ordered = can_fail(*expr.expr);
+    std::vector<std::unique_ptr<Expr>> elements;
+    for (int64_t n = 0; n < *iterations; n++) {
+      elements.push_back(term(instance(expr.axis, *expr.expr, n), ordered));
+    }
+    auto literal = std::make_unique<ArrayLiteralExpr>(std::move(elements));
+    literal->type = expr.type;
+    replace(bind(std::move(literal)));
+  }
+
+ private:
+  typedef std::vector<std::pair<std::string, std::unique_ptr<Expr>>> Axis;
+
+  inline static const int64_t max_iterations = 16;
+  // the number of nodes all the copies of a body may add up to
+  inline static const int64_t max_size = 512;
+
+  int ctr = 0;
+  // copies bound so far for the loop being unrolled, in iteration order
+  std::vector<std::pair<std::string, std::unique_ptr<Expr>>> lets;
+
+  // the number of iterations of a loop worth unrolling
+  std::optional<int64_t> unrollable(const Axis& axis, const Expr& body) {
+    int64_t iterations = 1;
+    for (const auto& [_, bound] : axis) {
+      auto constant = dynamic_cast<const IntExpr*>(bound.get());
+      if (!constant || constant->value <= 0 || constant->value > max_iterations) return std::nullopt;
+      iterations *= constant->value;
+      if (iterations > max_iterations) return std::nullopt;
+    }
+    if (iterations * size(body) > max_size) return std::nullopt;
+    return iterations;
+  }
+
+  static int64_t size(const Expr& expr) {
+    int64_t total = 1;
+    for (auto child : children(expr)) {
+      total += size(**child);
+    }
+    return total;
+  }
+
+  // a copy of the body, or, if it must run in order, a variable bound to it
+  std::unique_ptr<Expr> term(std::unique_ptr<Expr> copy, bool ordered) {
+    if (!ordered) return copy;
+    auto type = copy->type;
+    lets.emplace_back("_ur" + std::to_string(ctr++), std::move(copy));
+    auto var = std::make_unique<VarExpr>(lets.back().first);
+    var->type = type;
+    return var;
+  }
+
+  // wraps the unrolled loop in the lets of its copies, the first outermost
+  std::unique_ptr<Expr> bind(std::unique_ptr<Expr> body) {
+    for (size_t i = lets.size(); i-- > 0;) {
+      auto type = body->type;
+      body = std::make_unique<LetExpr>(lets[i].first, std::move(lets[i].second), std::move(body));
+      body->type = type;
+    }
+    lets.clear();
+    return body;
+  }
+
+  // the terms added up in iteration order; a float sum starts from 0.0 as
+  // the loop's does, so a sum of -0.0s is still 0.0. Ordered terms are
+  // added on the left, which computes the same sums and evaluates the
+  // earlier terms first.
+  static std::unique_ptr<Expr> chain(std::vector<std::unique_ptr<Expr>> terms, std::shared_ptr<ResolvedType> type, bool ordered) {
+    std::unique_ptr<Expr> total;
+    if (type->is<Float>()) {
+      total = std::make_unique<FloatExpr>(0.0);
+      total->type = type;
+    }
+    for (auto& term : terms) {
+      if (!total) {
+        total = std::move(term);
+        continue;
+      }
+      if (ordered) {
+        total = std::make_unique<BinopExpr>(std::move(term), "+", std::move(total));
+      } else {
+        total = std::make_unique<BinopExpr>(std::move(total), "+", std::move(term));
+      }
+      total->type = type;
+    }
+    return total;
+  }
+
+  // whether every field that can fail is a field of the same read, like
+  // the img[i + ii, j + jj].r and .g of fused sums
+  static bool fail_alike(const StructLiteralExpr& literal) {
+    const ArrayIndexExpr* first = nullptr;
+    for (const auto& field : literal.fields) {
+      if (!can_fail(*field)) continue;
+      const Expr* base = field.get();
+      while (auto dot = dynamic_cast<const DotExpr*>(base)) base = dot->expr.get();
+      auto read = dynamic_cast<const ArrayIndexExpr*>(base);
+      if (!read || base == field.get() || !dynamic_cast<const VarExpr*>(read->expr.get())) return false;
+      if (!first) first = read;
+      if (!same(*read, *first)) return false;
+    }
+    return true;
+  }
+
+  // structural equality of reads and their integer arithmetic
+  static bool same(const Expr& a, const Expr& b) {
+    if (auto x = dynamic_cast<const IntExpr*>(&a)) {
+      auto y = dynamic_cast<const IntExpr*>(&b);
+      return y && x->value == y->value;
+    }
+    if (auto x = dynamic_cast<const VarExpr*>(&a)) {
+      auto y = dynamic_cast<const VarExpr*>(&b);
+      return y && x->identifier == y->identifier;
+    }
+    if (auto x = dynamic_cast<const ArrayIndexExpr*>(&a)) {
+      auto y = dynamic_cast<const ArrayIndexExpr*>(&b);
+      if (!y || x->indices.size() != y->indices.size() || !same(*x->expr, *y->expr)) return false;
+      for (size_t k = 0; k < x->indices.size(); k++) {
+        if (!same(*x->indices[k], *y->indices[k])) return false;
+      }
+      return true;
+    }
+    auto x = dynamic_cast<const BinopExpr*>(&a);
+    auto y = dynamic_cast<const BinopExpr*>(&b);
+    return x && y && x->op == y->op && same(*x->left, *y->left) && same(*x->right, *y->right);
+  }
+
+  // the body of iteration n, counting in row-major order
+  std::unique_ptr<Expr> instance(const Axis& axis, const Expr& body, int64_t n) {
+    auto copy = CloneVisitor::clone(body);
+    for (size_t k = axis.size(); k-- > 0;) {
+      auto bound = static_cast<const IntExpr&>(*axis[k].second).value;
+      substitute(copy, axis[k].first, n % bound);
+      n /= bound;
+    }
+    return copy;
+  }
+
+  // replaces free uses of a variable with a constant, stopping where it is
+  // rebound, as rename does
+  static void substitute(std::unique_ptr<Expr>& expr, const std::string& variable, int64_t value) {
+    if (auto var = dynamic_cast<const VarExpr*>(expr.get())) {
+      if (var->identifier == variable) {
+        expr = std::make_unique<IntExpr>(value);
+        expr->type = Int::shared;
+      }
+      return;
+    }
+    if (auto let = dynamic_cast<const LetExpr*>(expr.get())) {
+      substitute(edit(let->value), variable, value);
+      if (let->identifier != variable) substitute(edit(let->body), variable, value);
+      return;
+    }
+    auto inside = [&](const Axis& axis, const std::unique_ptr<Expr>& body) {
+      for (const auto& [_, bound] : axis) substitute(edit(bound), variable, value);
+      for (const auto& [name, _] : axis) {
+        if (name == variable) return;
+      }
+      substitute(edit(body), variable, value);
+    };
+    if (auto loop = dynamic_cast<const ArrayLoopExpr*>(expr.get())) {
+      inside(loop->axis, loop->expr);
+      return;
+    }
+    if (auto loop = dynamic_cast<const SumLoopExpr*>(expr.get())) {
+      inside(loop->axis, loop->expr);
+      return;
+    }
+    for (auto child : children(*expr)) {
+      substitute(edit(*child), variable, value);
+    }
+  }
+};